@@ -29,51 +29,46 @@ int main(int argc, char **argv)
     }
 
     char msg[100];
+    struct Stats *stats = libmemc_stats_create();
+    libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), NULL, stats);
+
     // Test 1: is 64 bit
-    char *stats = libmemc_stats(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), NULL);
-    char *ptr_size = (!stats) || (!strlen(stats)) ? NULL : strstr(stats, "pointer_size");
-    if (ptr_size != NULL) {
-        ptr_size += (strlen("pointer_size")+1);
-        if (!memcmp(ptr_size,"32",2)) {
+    const char *pointer_size = libmemc_stats_value(stats, "pointer_size");
+    if (pointer_size != NULL) {
+        if (!strcmp(pointer_size, "32")) {
             fprintf(stdout, "Skipping 64-bit tests on 32-bit build\n");
             exit(0);
         }
-        ok_test(!memcmp(ptr_size,"64",2), "is 64 bit", "is not 64 bit");
+        ok_test(!strcmp(pointer_size, "64"), "is 64 bit", "is not 64 bit");
     } else {
         fprintf(stderr,"Could not find pointer_size in stats\n");
         fflush(stderr);
     }
 
     // Test 2: max bytes is 4098 MB
-    char *ptr_maxbytes = (!stats) || (!strlen(stats)) ? NULL : strstr(stats, "limit_maxbytes");
-    if (ptr_maxbytes != NULL) {
-        ptr_maxbytes += (strlen("limit_maxbytes")+1);
-        long long maxbytes = atoll(ptr_maxbytes);
-        sprintf(msg, "max bytes = %d", maxbytes);
-        ok_test(maxbytes == 4297064448, "max bytes is 4098 MB", msg);
+    int64_t maxbytes;
+    if (libmemc_stats_int64(stats, "limit_maxbytes", &maxbytes) == 0) {
+        sprintf(msg, "max bytes = %lld", (long long)maxbytes);
+        ok_test(maxbytes == 4297064448LL, "max bytes is 4098 MB", msg);
     } else {
         fprintf(stderr,"Could not find limit_maxbytes in stats\n");
     }
 
     // Test 3: expected (faked) value of total_malloced
-    stats = libmemc_stats(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), "slabs");
-    char *ptr_totmalloc = (!stats) || (!strlen(stats)) ? NULL : strstr(stats, "total_malloced");
-    if (ptr_totmalloc != NULL) {
-        ptr_totmalloc += (strlen("total_malloced")+1);
-        long long total_malloced = atoll(ptr_totmalloc);
-        sprintf(msg, "total_malloced = %d", total_malloced);
-        ok_test(total_malloced == 4294967328,
+    libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), "slabs", stats);
+    int64_t total_malloced;
+    if (libmemc_stats_int64(stats, "total_malloced", &total_malloced) == 0) {
+        sprintf(msg, "total_malloced = %lld", (long long)total_malloced);
+        ok_test(total_malloced == 4294967328LL,
                 "expected (faked) value of total_malloced", msg);
     } else {
         fprintf(stderr,"Could not find total_malloced in stats\n\n");
     }
 
     // Test 4: no active slabs
-    char *ptr_activeslabs = (!stats) || (!strlen(stats)) ? NULL : strstr(stats, "active_slabs");
-    if (ptr_activeslabs != NULL) {
-        ptr_activeslabs += (strlen("active_slabs")+1);
-        long active_slabs = atol(ptr_activeslabs);
-        sprintf(msg, "active_slabs = %d", active_slabs);
+    int64_t active_slabs;
+    if (libmemc_stats_int64(stats, "active_slabs", &active_slabs) == 0) {
+        sprintf(msg, "active_slabs = %lld", (long long)active_slabs);
         ok_test(active_slabs == 0, "no active slabs", msg);
     } else {
         fprintf(stderr,"Could not find active_slabs in stats\n\n");
@@ -109,17 +104,15 @@ int main(int argc, char **argv)
     ok_test(hit_limit, "hit size limit", "did not hit size limit");
 
     // Test 6: 1 active slab
-    stats = libmemc_stats(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), "slabs");
-    ptr_activeslabs = (!stats) || (!strlen(stats)) ? NULL : strstr(stats, "active_slabs");
-    if (ptr_activeslabs != NULL) {
-        ptr_activeslabs += (strlen("active_slabs")+1);
-        long active_slabs = atol(ptr_activeslabs);
-        sprintf(msg, "active_slabs = %d", active_slabs);
+    libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), "slabs", stats);
+    if (libmemc_stats_int64(stats, "active_slabs", &active_slabs) == 0) {
+        sprintf(msg, "active_slabs = %lld", (long long)active_slabs);
         ok_test(active_slabs == 1, "1 active slab", msg);
     } else {
         fprintf(stderr,"Could not find active_slabs in stats\n\n");
     }
 
+    libmemc_stats_destroy(stats);
     libmemc_destroy(memcache);
     test_report();
 }
@@ -46,6 +46,56 @@ int main(int argc, char **argv)
                 msg_ok, msg_not_ok);
     }
 
+    // a multi-get of values that are smaller and larger than the receive
+    // buffer, with a missing key. Items that come with a buffer big enough
+    // get the value in it, the others get a bigger one
+    enum { KEYS = 40 };
+    char keys[KEYS][20];
+    struct Item items[KEYS] = {{0}};
+    char *value = malloc(KEYS * 3001);
+    for (int i=0; i<KEYS * 3001; i++) {
+        value[i] = (char)(i * 7);
+    }
+    for (int i=0; i<KEYS; i++) {
+        sprintf(keys[i], "multi%d", i);
+        setItem(&items[i], 0, keys[i], strlen(keys[i]), i, value + i, i * 3001, 0);
+        if (i != 17) {
+            libmemc_set(memcache, &items[i]);
+        }
+    }
+
+    void *given[KEYS];
+    for (int i=0; i<KEYS; i++) {
+        setItem(&items[i], 0, keys[i], strlen(keys[i]), 0, NULL, 0, 0);
+        items[i].capacity = (i % 2) ? 64 * 1024 : 16;
+        items[i].data = given[i] = malloc(items[i].capacity);
+    }
+    ok_test(libmemc_gets(libmemc_get_server_no(memcache, 0),
+                         libmemc_get_protocol(memcache), items, KEYS) == 0,
+            "multi-get of 40 keys", "multi-get of 40 keys failed");
+
+    int matched = 0;
+    int reused = 0;
+    for (int i=0; i<KEYS; i++) {
+        if (i == 17) {
+            matched += (items[i].status == NotFound);
+        } else if ((items[i].status == Success) && (items[i].flags == i) &&
+                   (items[i].size == i * 3001) &&
+                   !memcmp(items[i].data, value + i, items[i].size)) {
+            ++matched;
+        }
+        if ((items[i].size <= 16) || ((i % 2) && (items[i].size <= 64 * 1024))) {
+            reused += (items[i].data == given[i]);
+        } else {
+            ++reused;
+        }
+        free(items[i].data);
+    }
+    ok_test(matched == KEYS, "multi-get values match", "multi-get values differ");
+    ok_test(reused == KEYS, "multi-get used the given buffers",
+            "multi-get did not use the given buffers");
+
+    free(value);
     libmemc_destroy(memcache);
     test_report();
 }
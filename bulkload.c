@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // start the server
+    struct memcached_process_handle* mchandle = new_memcached(0, "");
+    if (!mchandle) {
+        fprintf(stderr,"Could not start memcached process\n\n");
+        exit(0);
+    }
+
+    struct Memcache* memcache = libmemc_create(Automatic);
+    if (libmemc_add_server(memcache, "127.0.0.1", mchandle->port) == -1) {
+        fprintf(stderr,"Could not add server\n\n");
+        exit(0);
+    }
+
+    // write a corpus with 1000 values of increasing size and one that is too big
+    char tmpfilename[] = "/tmp/bulkload.XXXXXX";
+    int fd = mkstemp(tmpfilename);
+    FILE *file = (fd != -1) ? fdopen(fd, "w") : NULL;
+    ok_test(file != NULL, "created corpus file", "failed to create corpus file");
+    if (file == NULL) {
+        exit(0);
+    }
+
+    int records = 1000;
+    char *val = malloc(2 * 1024 * 1024);
+    memset(val, 'c', 2 * 1024 * 1024);
+    for (int i=0; i<records; i++) {
+        fprintf(file, "corpus_%d %d 0 %d\r\n", i, i, i * 10);
+        fwrite(val, 1, i * 10, file);
+        fprintf(file, "\r\n");
+    }
+    fprintf(file, "corpus_too_big 0 0 %d\r\n", 2 * 1024 * 1024);
+    fwrite(val, 1, 2 * 1024 * 1024, file);
+    fprintf(file, "\r\n");
+    fclose(file);
+
+    // Test 1: everything but the big value is stored
+    ok_test(libmemc_load_corpus(memcache, tmpfilename) == records,
+            "loaded 1000 records", "did not load 1000 records");
+
+    // Test 2: the values are the ones in the corpus
+    struct Item item = {0};
+    for (int i=0; i<records; i+=111) {
+        char key[20];
+        char msgOK[40];
+        char msgNotOK[40];
+        sprintf(key, "corpus_%d", i);
+        sprintf(msgOK, "%s found", key);
+        sprintf(msgNotOK, "%s not found", key);
+        setItem(&item, 0, key, strlen(key), i, val, i * 10, 0);
+        mem_get_is(memcache, &item, msgOK, msgNotOK);
+    }
+
+    setItem(&item, 0, "corpus_too_big", 14, 0, NULL, 0, 0);
+    mem_get_is(memcache, &item, "corpus_too_big == <undef>",
+               "corpus_too_big != <undef>");
+
+    // Test 3: a truncated record is rejected
+    file = fopen(tmpfilename, "w");
+    fprintf(file, "corpus_bad 0 0 10\r\nshort\r\n");
+    fclose(file);
+    ok_test(libmemc_load_corpus(memcache, tmpfilename) == -1,
+            "truncated corpus rejected", "truncated corpus accepted");
+
+    // Test 4: a size that wraps around is rejected
+    file = fopen(tmpfilename, "w");
+    fprintf(file, "corpus_huge 0 0 18446744073709551614\r\nx\r\n");
+    fclose(file);
+    ok_test(libmemc_load_corpus(memcache, tmpfilename) == -1,
+            "huge size rejected", "huge size accepted");
+
+    // Test 5: the connection is still usable
+    setItem(&item, 0, "foo", 3, 0, "fooval", 6, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored foo", "failed to store foo");
+    mem_get_is(memcache, &item, "foo == 'fooval'", "foo != 'fooval'");
+
+    free(val);
+    remove(tmpfilename);
+    libmemc_destroy(memcache);
+    test_report();
+}
@@ -132,17 +132,9 @@ int main(int argc, char **argv)
     setItem(&item_arr[1], item_arr[1].cas_id, "foo1", 4, 0, "apple", 5, 0);
     libmemc_cas(memcache, &item_arr[1]);
 
-    ok_test(((strstr(item_arr[0].errmsg, "STORED") == item_arr[0].errmsg) &&
-             (strstr(item_arr[1].errmsg, "EXISTS") == item_arr[1].errmsg))
+    ok_test(((item_arr[0].status == Success) && (item_arr[1].status == Exists))
             ||
-            ((strstr(item_arr[0].errmsg, "EXISTS") == item_arr[0].errmsg) &&
-             (strstr(item_arr[1].errmsg, "STORED") == item_arr[1].errmsg))
-            || //binary protocol
-            ((strstr(item_arr[0].errmsg, "Stored") == item_arr[0].errmsg) &&
-             (strstr(item_arr[1].errmsg, "Data exists for key") == item_arr[1].errmsg))
-            || //binary protocol
-            ((strstr(item_arr[0].errmsg, "Data exists for key") == item_arr[0].errmsg) &&
-             (strstr(item_arr[1].errmsg, "Stored") == item_arr[1].errmsg)),
+            ((item_arr[0].status == Exists) && (item_arr[1].status == Success)),
             "cas on same item from two sockets", "cas on same item from two sockets failed");
 
     libmemc_destroy(memcache);
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+// the number of items on both servers
+static int64_t items_stored(struct Memcache *memcache)
+{
+    struct Stats *stats = libmemc_stats_create();
+    int64_t total = 0;
+    for (int i = 0; i < 2; i++) {
+        int64_t items = -1;
+        if (libmemc_stats_fetch(libmemc_get_server_no(memcache, i),
+                                libmemc_get_protocol(memcache), "", stats) == -1 ||
+            libmemc_stats_int64(stats, "curr_items", &items) == -1) {
+            total = -1;
+            break;
+        }
+        total += items;
+    }
+    libmemc_stats_destroy(stats);
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // two servers, so that the chunks of a value are spread over both
+    struct memcached_process_handle* mchandle[2];
+    struct Memcache* memcache = libmemc_create(Automatic);
+    struct Memcache* raw = libmemc_create(Automatic);
+    for (int i = 0; i < 2; i++) {
+        mchandle[i] = new_memcached(0, "");
+        if (!mchandle[i]) {
+            fprintf(stderr,"Could not start memcached process\n\n");
+            exit(0);
+        }
+        if (libmemc_add_server(memcache, "127.0.0.1", mchandle[i]->port) == -1 ||
+            libmemc_add_server(raw, "127.0.0.1", mchandle[i]->port) == -1) {
+            fprintf(stderr,"Could not add server\n\n");
+            exit(0);
+        }
+    }
+
+    size_t size = 3 * 1024 * 1024 + 123;
+    char *value = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        value[i] = 'a' + (i * 7 + i / 4096) % 26;
+    }
+
+    // Test 1: a 3 MB value is too large for the server
+    struct Item item = {0};
+    setItem(&item, 0, "big", 3, 0, value, size, 0);
+    ok_test(libmemc_set(memcache, &item) == -1 && item.status == TooLarge,
+            "3 MB value too large", "3 MB value not too large");
+
+    // Test 2: but not in chunks. A chunk size that does not fit in the
+    // manifest is refused
+    ok_test((sizeof(size_t) == 4 || libmemc_set_chunking(memcache, (size_t)-1) == -1) &&
+            !libmemc_set_chunking(memcache, 512 * 1024),
+            "chunk size set", "chunk size not set");
+    setItem(&item, 0, "big", 3, 77, value, size, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored 3 MB value in chunks",
+            "failed to store 3 MB value in chunks");
+    mem_get_is(memcache, &item, "3 MB value read back", "3 MB value not read back");
+
+    // Test 3: the item holds the manifest
+    struct Item manifest = {0};
+    setItem(&manifest, 0, "big", 3, 0, NULL, 0, 0);
+    ok_test(!libmemc_get(raw, &manifest) && manifest.size == 32 &&
+            manifest.flags == (77 | LIBMEMC_CHUNKED),
+            "item holds the manifest", "item does not hold the manifest");
+
+    // Test 4: a cas with the cas id of an older value fails
+    struct Item got = {0};
+    setItem(&got, 0, "big", 3, 0, NULL, 0, 0);
+    ok_test(!libmemc_get(memcache, &got), "got cas id", "failed to get cas id");
+    uint64_t cas_id = got.cas_id;
+    value[0] = 'X';
+    setItem(&item, 0, "big", 3, 77, value, size, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored new value", "failed to store new value");
+    value[0] = 'Y';
+    setItem(&item, cas_id, "big", 3, 77, value, size, 0);
+    ok_test(libmemc_cas(memcache, &item) == -1 && item.status == Exists,
+            "cas of older value failed", "cas of older value succeeded");
+    value[0] = 'X';
+    setItem(&item, 0, "big", 3, 77, value, size, 0);
+    mem_get_is(memcache, &item, "new value read back", "new value not read back");
+
+    // Test 5: a chunk that is gone makes a miss
+    setItem(&manifest, 0, "big", 3, 0, NULL, 0, 0);
+    libmemc_get(raw, &manifest);
+    const unsigned char *data = manifest.data;
+    unsigned long long version = 0;
+    for (int i = 16; i < 24; i++) {
+        version = (version << 8) | data[i];
+    }
+    char key[64];
+    sprintf(key, "big:%016llx:3", version);
+    setItem(&got, 0, key, strlen(key), 0, NULL, 0, 0);
+    ok_test(!libmemc_delete(raw, &got), "deleted a chunk", "failed to delete a chunk");
+    setItem(&got, 0, "big", 3, 0, NULL, 0, 0);
+    ok_test(libmemc_get(memcache, &got) == -1 && got.status == NotFound,
+            "value with a chunk gone is a miss", "value with a chunk gone is not a miss");
+
+    // Test 6: a new value deletes the chunks of the one it replaces
+    setItem(&item, 0, "big", 3, 77, value, size, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored over old value",
+            "failed to store over old value");
+    sprintf(key, "big:%016llx:0", version);
+    setItem(&got, 0, key, strlen(key), 0, NULL, 0, 0);
+    ok_test(libmemc_get(raw, &got) == -1 && got.status == NotFound,
+            "old chunks deleted", "old chunks left behind");
+    int64_t stored = items_stored(raw);
+    ok_test(stored == 1 + 7, "manifest and 7 chunks stored",
+            "not just the manifest and 7 chunks stored");
+
+    // Test 7: a manifest that is not stored deletes its chunks
+    value[0] = 'Z';
+    setItem(&item, 0, "big", 3, 77, value, size, 0);
+    ok_test(libmemc_add(memcache, &item) == -1 &&
+            (item.status == NotStored || item.status == Exists),
+            "add over value failed", "add over value did not fail");
+    ok_test(items_stored(raw) == stored, "chunks of failed add deleted",
+            "chunks of failed add left behind");
+    value[0] = 'X';
+    setItem(&item, 0, "big", 3, 77, value, size, 0);
+    mem_get_is(memcache, &item, "value kept", "value not kept");
+
+    free(got.data);
+    free(manifest.data);
+    free(value);
+    libmemc_destroy(memcache);
+    libmemc_destroy(raw);
+    test_report();
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+// a JSON array of records, like the blobs that are worth compressing
+static size_t make_json(char *buffer, size_t size)
+{
+    size_t len = 0;
+    unsigned int seed = 42;
+    buffer[len++] = '[';
+    while (len + 200 < size) {
+        len += sprintf(buffer + len, "{\"id\":%d,\"name\":\"user%d\",\"score\":%d,"
+                       "\"active\":%s},", rand_r(&seed), rand_r(&seed) % 1000,
+                       rand_r(&seed) % 100, rand_r(&seed) % 2 ? "true" : "false");
+    }
+    buffer[len - 1] = ']';
+    return len;
+}
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // start the server
+    struct memcached_process_handle* mchandle = new_memcached(0, "");
+    if (!mchandle) {
+        fprintf(stderr,"Could not start memcached process\n\n");
+        exit(0);
+    }
+
+    // a handle that compresses and another one that sees the stored bytes
+    struct Memcache* memcache = libmemc_create(Automatic);
+    struct Memcache* raw = libmemc_create(Automatic);
+    if (libmemc_add_server(memcache, "127.0.0.1", mchandle->port) == -1 ||
+        libmemc_add_server(raw, "127.0.0.1", mchandle->port) == -1) {
+        fprintf(stderr,"Could not add server\n\n");
+        exit(0);
+    }
+    libmemc_set_compression(memcache, 1024);
+
+    // Test 1: a large JSON value is stored compressed and read back whole
+    size_t size = 256 * 1024;
+    char *json = malloc(size);
+    size = make_json(json, size);
+    struct Item item = {0};
+    setItem(&item, 0, "json", 4, 123, json, size, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored json", "failed to store json");
+    ok_test(item.size == size && memcmp(item.data, json, size) == 0 && item.flags == 123,
+            "stored item unchanged", "stored item changed");
+    mem_get_is(memcache, &item, "json read back", "json not read back");
+
+    struct Item got = {0};
+    setItem(&got, 0, "json", 4, 0, NULL, 0, 0);
+    ok_test(!libmemc_get(raw, &got) && (got.flags & LIBMEMC_COMPRESSED) &&
+            (got.flags & ~LIBMEMC_COMPRESSED) == 123 && got.size < size / 2,
+            "json stored compressed", "json not stored compressed");
+
+    // Test 2: a value below the threshold is stored as it is
+    setItem(&item, 0, "small", 5, 0, "smallval", 8, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored small", "failed to store small");
+    setItem(&got, 0, "small", 5, 0, NULL, 0, 0);
+    ok_test(!libmemc_get(raw, &got) && got.flags == 0 && got.size == 8,
+            "small stored as it is", "small stored compressed");
+
+    // Test 3: so is a value that does not compress
+    size_t noisesize = 64 * 1024;
+    char *noise = malloc(noisesize);
+    unsigned int seed = 7;
+    for (size_t i = 0; i < noisesize; i++) {
+        noise[i] = rand_r(&seed);
+    }
+    setItem(&item, 0, "noise", 5, 0, noise, noisesize, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored noise", "failed to store noise");
+    setItem(&got, 0, "noise", 5, 0, NULL, 0, 0);
+    ok_test(!libmemc_get(raw, &got) && got.flags == 0 && got.size == noisesize,
+            "noise stored as it is", "noise stored compressed");
+    setItem(&item, 0, "noise", 5, 0, noise, noisesize, 0);
+    mem_get_is(memcache, &item, "noise read back", "noise not read back");
+
+    // Test 4: values of every length around the match limits survive
+    int correct = 0;
+    for (size_t len = 1024; len < 1024 + 64; len++) {
+        setItem(&item, 0, "edge", 4, 0, json, len, 0);
+        setItem(&got, 0, "edge", 4, 0, NULL, 0, 0);
+        if (!libmemc_set(memcache, &item) && !libmemc_get(memcache, &got) &&
+            got.size == len && memcmp(got.data, json, len) == 0) {
+            correct++;
+        }
+    }
+    ok_test(correct == 64, "values of every length read back",
+            "a value was not read back");
+
+    free(got.data);
+    free(json);
+    free(noise);
+    libmemc_destroy(memcache);
+    libmemc_destroy(raw);
+    test_report();
+}
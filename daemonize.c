@@ -43,16 +43,17 @@ int main(int argc, char **argv)
             "process was killed");
 
     // Test 4
-    char* statsbuffer = libmemc_stats(libmemc_get_server_no(memcache, 0), 
-            libmemc_get_protocol(memcache), "");
-    char *ptr = (!statsbuffer) || (strlen(statsbuffer) == 0) ? NULL : strstr(statsbuffer, "pid");
-    if (!ptr) {
+    struct Stats *stats = libmemc_stats_create();
+    int64_t pid;
+    if (libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), 
+            libmemc_get_protocol(memcache), "", stats) == -1 ||
+        libmemc_stats_int64(stats, "pid", &pid) == -1) {
         fprintf(stderr,"Could not find pid in stats\n");
     } else {
-        int pid = atoi(ptr + (strlen("pid")+1));
         ok_test(pid == readpid, "memcached reports same pid as file", 
                 "memcached does not report same pid as file");        
     }
+    libmemc_stats_destroy(stats);
 
     // Test 5
     ok_test(new_sock(mchandle) != -1, "opened new socket",
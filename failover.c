@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+static uint64_t now_msec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // start the server
+    struct memcached_process_handle* mchandle = new_memcached(0, "");
+    if (!mchandle) {
+        fprintf(stderr,"Could not start memcached process\n\n");
+        exit(0);
+    }
+
+    // and a stalled one, that takes connections but never answers
+    int stalled = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (stalled == -1 || bind(stalled, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(stalled, 16) == -1 ||
+        getsockname(stalled, (struct sockaddr*)&addr, &len) == -1) {
+        fprintf(stderr,"Could not create stalled server\n\n");
+        exit(0);
+    }
+
+    struct Memcache* memcache = libmemc_create(Automatic);
+    if (libmemc_add_server(memcache, "127.0.0.1", mchandle->port) == -1 ||
+        libmemc_add_server(memcache, "127.0.0.1", ntohs(addr.sin_port)) == -1) {
+        fprintf(stderr,"Could not add server\n\n");
+        exit(0);
+    }
+    ok_test(!libmemc_set_timeouts(memcache, 200, 200, 200), "set timeouts",
+            "failed to set timeouts");
+    ok_test(!libmemc_set_failover(memcache, 1, 1000, 4000), "set failover",
+            "failed to set failover");
+
+    // Test 1: a key of the stalled server times out instead of blocking
+    struct Item item = {0};
+    char key[20];
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    int i;
+    for (i = 0; i < 20; i++) {
+        sprintf(key, "failover_%d", i);
+        setItem(&item, 0, key, strlen(key), 0, "val", 3, 0);
+        start = now_msec();
+        if (libmemc_set(memcache, &item) != 0)
+            break;
+    }
+    elapsed = now_msec() - start;
+    ok_test(i < 20 && item.status == Timeout, "set to stalled server timed out",
+            "no set timed out");
+    ok_test(elapsed < 1000, "timed out within a second", "took too long to time out");
+
+    // Test 2: the stalled server is out, so its keys go to the other one
+    setItem(&item, 0, key, strlen(key), 0, "val", 3, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored key on the live server",
+            "failed to store key on the live server");
+    mem_get_is(memcache, &item, "key == 'val'", "key != 'val'");
+
+    // Test 3: after the backoff the stalled server is tried again
+    usleep(1100 * 1000);
+    ok_test(libmemc_set(memcache, &item) != 0 && item.status == Timeout,
+            "stalled server retried after backoff",
+            "stalled server not retried after backoff");
+    ok_test(!libmemc_set(memcache, &item), "stored key on the live server again",
+            "failed to store key on the live server again");
+
+    // Test 4: a server added after the timeouts are set gets them too
+    struct Memcache* later = libmemc_create(Automatic);
+    ok_test(!libmemc_set_timeouts(later, 200, 200, 200) &&
+            !libmemc_add_server(later, "127.0.0.1", ntohs(addr.sin_port)),
+            "server added after the timeouts", "failed to add server after the timeouts");
+    setItem(&item, 0, "later", 5, 0, "val", 3, 0);
+    start = now_msec();
+    ok_test(libmemc_set(later, &item) != 0 && item.status == Timeout &&
+            now_msec() - start < 1000,
+            "server added later timed out", "server added later did not time out");
+    libmemc_destroy(later);
+
+    close(stalled);
+    libmemc_destroy(memcache);
+    test_report();
+}
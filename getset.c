@@ -2,9 +2,56 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "libmemc.h"
 #include "libmemctest.h"
 
+#define STALLED 300
+
+// A server that answers every get with "hedgedval", but holds the reply to
+// get number STALLED on the first connection back for 100 ms
+struct stall {
+    int fd;
+    int first;
+};
+
+static void *stall_serve(void *arg)
+{
+    struct stall *conn = arg;
+    char request[512];
+    for (int i = 0; recv(conn->fd, request, sizeof(request), 0) > 0; i++) {
+        if (conn->first && i == STALLED) {
+            usleep(100000);
+        }
+        if (request[0] == (char)0x80) {
+            // flags as the extras, cas 1
+            unsigned char response[24 + 4 + 9] = { 0x81, 0x00, 0, 0, 4, 0, 0, 0,
+                                                    0, 0, 0, 13 };
+            response[23] = 1;
+            memcpy(response + 28, "hedgedval", 9);
+            send(conn->fd, response, sizeof(response), 0);
+        } else {
+            const char *response = "VALUE hedged 0 9 1\r\nhedgedval\r\nEND\r\n";
+            send(conn->fd, response, strlen(response), 0);
+        }
+    }
+    return NULL;
+}
+
+// the second connection is the one that the slow get is hedged over
+static void *stall_accept(void *arg)
+{
+    struct stall *conn = arg;
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    if (poll(&pfd, 1, 5000) == 1 && (conn->fd = accept(conn->fd, NULL, NULL)) != -1) {
+        stall_serve(conn);
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     test_init(argc, argv);
@@ -53,8 +100,7 @@ int main(int argc, char **argv)
 
     // delete foo again.  not found this time.
     libmemc_delete(memcache, &item);
-    ok_test((strstr(item.errmsg, "NOT_FOUND") == item.errmsg) ||
-            (strstr(item.errmsg, "Not found") == item.errmsg),
+    ok_test(item.status == NotFound,
         "deleted foo, but not found", "deleted foo, and found");
 
     // add moo
@@ -110,7 +156,127 @@ int main(int argc, char **argv)
        free(val);
        len += 2048;
     }
-    
+
+    // Test the thread-per-core runtime: sets and gets of 100 keys spread
+    // over two cores
+    struct Shards *shards = libmemc_shards_create(libmemc_get_protocol(memcache), 2);
+    int shards_started = shards != NULL &&
+            !libmemc_shards_add_server(shards, "127.0.0.1", mchandle->port) &&
+            !libmemc_shards_start(shards);
+    ok_test(shards_started,
+            "started two cores", "failed to start two cores");
+
+    if (shards_started) {
+        enum { nshard = 100 };
+        struct Item items[nshard];
+        struct ShardRequest requests[nshard];
+        char keys[nshard][20];
+        char vals[nshard][20];
+        memset(items, 0, sizeof(items));
+        for (int phase = 0; phase < 2; phase++) {
+            for (int i = 0; i < nshard; i++) {
+                sprintf(keys[i], "shard_%d", i);
+                sprintf(vals[i], "shardval_%d", i);
+                if (phase == 0) {
+                    setItem(&items[i], 0, keys[i], strlen(keys[i]), 0, vals[i], strlen(vals[i]), 0);
+                } else {
+                    setItem(&items[i], 0, keys[i], strlen(keys[i]), 0, NULL, 0, 0);
+                }
+                requests[i].command = (phase == 0) ? ShardSet : ShardGet;
+                requests[i].item = &items[i];
+                requests[i].ret = -1;
+                while (libmemc_shards_submit(shards, &requests[i]) == -1) {
+                    usleep(100);
+                }
+            }
+            int completed = 0;
+            while (completed < nshard) {
+                struct ShardRequest *done[nshard];
+                int count = libmemc_shards_complete(shards, done, nshard);
+                completed += count;
+                if (count == 0) {
+                    usleep(100);
+                }
+            }
+        }
+        int shard_ok = 1;
+        for (int i = 0; i < nshard; i++) {
+            if (requests[i].ret != 0 || items[i].size != strlen(vals[i]) ||
+                memcmp(items[i].data, vals[i], items[i].size)) {
+                shard_ok = 0;
+            }
+            free(items[i].data);
+        }
+        ok_test(shard_ok, "100 keys stored and found over two cores",
+                "keys missing over two cores");
+    }
+    libmemc_shards_destroy(shards);
+
+    // a core that failed to start, as its server can't be resolved, takes
+    // no requests
+    shards = libmemc_shards_create(libmemc_get_protocol(memcache), 1);
+    setItem(&item, 0, "foo", 3, 0, NULL, 0, 0);
+    struct ShardRequest request = { ShardGet, &item, 0, NULL };
+    ok_test(shards != NULL &&
+            !libmemc_shards_add_server(shards, "no-such-host.invalid", 11211) &&
+            libmemc_shards_start(shards) == -1 &&
+            libmemc_shards_submit(shards, &request) == -1,
+            "failed core takes no requests", "failed core takes requests");
+    libmemc_shards_destroy(shards);
+
+    // Test hedged gets: once the deadline is known, the get that the
+    // server stalls is sent again over a second connection, which answers
+    // first. The stalled reply is read later, without a reconnect
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(listener, 4) == -1 ||
+        getsockname(listener, (struct sockaddr*)&addr, &addrlen) == -1) {
+        fprintf(stderr,"Could not create stalling server\n\n");
+        exit(0);
+    }
+    struct Memcache* hedging = libmemc_create(libmemc_get_protocol(memcache));
+    struct stall conn[2] = { { -1, 1 }, { listener, 0 } };
+    if (libmemc_add_server(hedging, "127.0.0.1", ntohs(addr.sin_port)) == -1 ||
+        (conn[0].fd = accept(listener, NULL, NULL)) == -1) {
+        fprintf(stderr,"Could not connect to stalling server\n\n");
+        exit(0);
+    }
+    pthread_t stall_thread[2];
+    pthread_create(&stall_thread[0], NULL, stall_serve, &conn[0]);
+    pthread_create(&stall_thread[1], NULL, stall_accept, &conn[1]);
+    libmemc_set_timeouts(hedging, 1000, 1000, 1000);
+    ok_test(!libmemc_set_hedging(hedging, 50.0, 1000), "hedging on",
+            "failed to turn hedging on");
+    int hedged_ok = 1;
+    for (int i = 0; i < 1000; i++) {
+        setItem(&item, 0, "hedged", 6, 0, NULL, 0, 0);
+        if (libmemc_get(hedging, &item) != 0 || item.size != 9 ||
+            memcmp(item.data, "hedgedval", 9)) {
+            hedged_ok = 0;
+        }
+    }
+    uint64_t hedged, won;
+    libmemc_hedge_counters(hedging, &hedged, &won);
+    ok_test(hedged_ok, "hedged == 'hedgedval' 1000 times", "hedged != 'hedgedval'");
+    ok_test(hedged > 0 && won > 0 && won <= hedged, "stalled get hedged and won",
+            "stalled get not hedged");
+    struct pollfd pfd = { .fd = listener, .events = POLLIN };
+    ok_test(poll(&pfd, 1, 0) == 0, "no reconnect after hedging",
+            "reconnected after hedging");
+    libmemc_destroy(hedging);
+    pthread_join(stall_thread[0], NULL);
+    pthread_join(stall_thread[1], NULL);
+    close(conn[0].fd);
+    if (conn[1].fd != listener) {
+        close(conn[1].fd);
+    }
+    close(listener);
+
     libmemc_destroy(memcache);
     test_report();
 }
@@ -22,6 +22,9 @@
  * Use is subject to license terms.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* sendmmsg and recvmmsg */
+#endif
 #include "../config.h"
 #include "libmemc.h"
 
@@ -30,15 +33,45 @@
 #endif
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
+#ifndef __GNUC__
+#include <atomic.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+
+/* Build with -DHAVE_IO_URING to do the socket I/O through io_uring */
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+struct Ring;
 
 struct Server {
    int sock;
@@ -47,41 +80,121 @@ struct Server {
    const char *peername;
    char *buffer;
    int buffersize;
+   char errbuf[256];
+   enum Status status;
+   size_t zerocopy;         /* sends of at least this size use MSG_ZEROCOPY */
+   uint32_t zerocopy_sent;  /* zerocopy sends on this connection */
+   uint32_t zerocopy_done;  /* and the ones the kernel is done with */
+   struct Ring *ring;       /* NULL if the I/O uses plain syscalls */
+   int connect_timeout;     /* milliseconds, 0 waits for as long as it takes */
+   int read_timeout;
+   int write_timeout;
+   int dead_after;          /* failures in a row that take the server out */
+   int backoff;             /* for this many ms at first */
+   int max_backoff;
+   int failures;            /* connection errors and timeouts in a row */
+   uint64_t retry_at;       /* when a dead server gets another chance */
+   struct Server *hedge;    /* second connection for hedged gets */
+   struct Server *primary;  /* set on a hedge, which shares its addrinfo */
+   int owed;                /* replies to gets that lost a hedge, unread */
+   uint64_t latency;        /* moving average of the gets in usec */
 };
 
 enum StoreCommand {add, set, replace, cas};
 
 enum IncrDecrCommand {incr, decr};
 
+struct Hedging;
+
 struct Memcache {
    struct Server** servers;
    enum Protocol protocol;
    int no_servers;
+   struct Hedging *hedging;  /* NULL unless gets are hedged */
+   int replicas;             /* servers that every key is stored on */
+   uint32_t reads;           /* replicated gets so far */
+   struct NearCache *near;   /* NULL unless gets go through a near cache */
+   struct SingleFlight *flights; /* NULL unless concurrent gets are merged */
+   size_t compress;          /* values of at least this size are compressed */
+   char *pool;               /* for the compressed or uncompressed value */
+   size_t poolsize;
+   size_t chunk;             /* larger values are split in chunks this big */
+   uint32_t versions;        /* chunked values written */
+   int connect_timeout;      /* the settings of the servers, for those */
+   int read_timeout;         /* that are added later on */
+   int write_timeout;
+   int dead_after;
+   int backoff;
+   int max_backoff;
+   size_t zerocopy;
 };
 
 static struct Server* server_create(const char *name, in_port_t port);
+static struct Server* server_create_unix(const char *path);
 static void server_destroy(struct Server *server);
 
 static int textual_store(struct Server* server, enum StoreCommand cmd, 
                         struct Item *item);
+static int textual_store_request(struct Server* server, enum StoreCommand cmd, 
+                                 struct Item *item);
 static int textual_get(struct Server* server, struct Item* item);
+static int textual_get_request(struct Server* server, struct Item* item);
+static int textual_get_reply(struct Server* server, struct Item* item);
 static int binary_store(struct Server* server, enum StoreCommand cmd, 
                         struct Item *item);
+static int binary_store_request(struct Server* server, enum StoreCommand cmd, 
+                                struct Item *item);
+static int binary_store_reply(struct Server* server);
 static int binary_get(struct Server* server, struct Item* item);
+static int binary_get_request(struct Server* server, struct Item* item);
+static int binary_get_reply(struct Server* server, struct Item* item);
+static int hedged_get(struct Memcache *handle, struct Server* server,
+                      struct Server* alternate, struct Item* item);
 static int libmemc_store(struct Memcache* handle, enum StoreCommand cmd, struct Item *item);
+static int store_item(struct Memcache* handle, enum StoreCommand cmd, struct Item *item);
+static int replicated_store(struct Memcache* handle, enum StoreCommand cmd, struct Item *item);
+static int replicated_get(struct Memcache* handle, struct Item *item);
+static int replicated_delete(struct Memcache* handle, struct Item *item);
+static int replicated_incr_decr(struct Memcache* handle, enum IncrDecrCommand cmd,
+                                struct Item *item, uint64_t delta);
+static int remote_get(struct Memcache* handle, struct Item *item);
+static int fetch_item(struct Memcache* handle, struct Item *item);
+static int read_item(struct Memcache* handle, struct Item *item);
+static int pack_item(struct Memcache* handle, struct Item *item);
+static int unpack_item(struct Memcache* handle, struct Item *item);
+static int chunked_store(struct Memcache* handle, enum StoreCommand cmd, struct Item *item);
+static int chunked_read(struct Memcache* handle, struct Item *item);
+static int flight_get(struct Memcache* handle, struct Item *item);
+static int near_get(struct Memcache* handle, struct Item *item);
+static int near_stored(struct Memcache* handle, struct Item *item, int ret);
+static void near_forget(struct Memcache* handle, struct Item *item);
+static void near_clear(struct Memcache* handle);
 
 static int textual_gets(struct Server* server, struct Item item[], int items);
+static int textual_gets_request(struct Server* server, struct Item item[], int items);
+static int textual_gets_reply(struct Server* server, struct Item item[], int items);
 static int binary_gets(struct Server* server, struct Item item[], int items);
+static int binary_gets_request(struct Server* server, struct Item item[], int items);
+static int binary_gets_reply(struct Server* server, struct Item item[], int items);
+static int multi_get_items(struct Memcache *handle, struct Item item[], int items);
 
 static struct Server *get_server(struct Memcache *handle, const char *key);
 static int server_connect(struct Server *server);
+static void server_enable_zerocopy(struct Server *server);
+static int server_zerocopy_wait(struct Server* server);
+static void server_set_timeout(struct Server *server, int option, int msec);
+static int item_set_status(struct Item *item, struct Server *server, int ret);
 
 static int textual_incr_decr(struct Server* server, enum IncrDecrCommand cmd, struct Item *item, uint64_t delta);
 static int binary_incr_decr(struct Server* server, enum IncrDecrCommand cmd, struct Item *item, uint64_t delta);
 static int libmemc_incr_decr(struct Memcache* handle, enum IncrDecrCommand cmd, struct Item *item, uint64_t delta);
 
 static int textual_delete(struct Server* server, struct Item* item);
+static int textual_delete_request(struct Server* server, struct Item* item);
+static int textual_delete_reply(struct Server* server);
 static int binary_delete(struct Server* server, struct Item* item);
+static int binary_delete_request(struct Server* server, struct Item* item);
+static int binary_delete_reply(struct Server* server);
 
 static int textual_flush_all(struct Server *server, long exptime);
 static int binary_flush_all(struct Server *server, long exptime);
@@ -89,6 +202,9 @@ static int binary_flush_all(struct Server *server, long exptime);
 static char* textual_stats(struct Server *server, const char* stats_type);
 static char* binary_stats(struct Server *server, const char* stats_type);
 
+struct CorpusBatch;
+static int corpus_flush(struct CorpusBatch *batch, enum Protocol protocol);
+
 /**
  * External interface
  */
@@ -113,14 +229,31 @@ void libmemc_destroy(struct Memcache* handle) {
    for (int ii = 0; ii < handle->no_servers; ++ii) {
       server_destroy(handle->servers[ii]);
    }
+   free(handle->servers);
+   free(handle->hedging);
+   free(handle->pool);
    free(handle);
 }
 
-int libmemc_add_server(struct Memcache *handle, const char *host, in_port_t port) {
+/* A new server gets the settings of the handle before it connects */
+static int add_server(struct Memcache *handle, struct Server *server) {
+   if (server == NULL) {
+      return -1;
+   }
+   server->connect_timeout = handle->connect_timeout;
+   server->read_timeout = handle->read_timeout;
+   server->write_timeout = handle->write_timeout;
+   server->dead_after = handle->dead_after;
+   server->backoff = handle->backoff;
+   server->max_backoff = handle->max_backoff;
+   server->zerocopy = handle->zerocopy;
+   server_connect(server);
+
    struct Server** servers = calloc(handle->no_servers + 1, sizeof(struct Server));
    struct Server** old = handle->servers;
     
    if (servers == 0) {
+      server_destroy(server);
       return -1;
    }
     
@@ -130,15 +263,19 @@ int libmemc_add_server(struct Memcache *handle, const char *host, in_port_t port
     
    handle->servers = servers;
    free(old);
-    
-   struct Server *server = server_create(host, port);
-   if (server != NULL) {
-      handle->servers[handle->no_servers++] = server;
-   }
+   handle->servers[handle->no_servers++] = server;
     
    return 0;
 }
 
+int libmemc_add_server(struct Memcache *handle, const char *host, in_port_t port) {
+   return add_server(handle, server_create(host, port));
+}
+
+int libmemc_add_server_unix(struct Memcache *handle, const char *path) {
+   return add_server(handle, server_create_unix(path));
+}
+
 struct Server *libmemc_get_server_no(struct Memcache *handle, int server_no)
 {
    if (handle->no_servers > server_no)
@@ -158,38 +295,126 @@ int libmemc_set_socket(struct Server *server, int socket)
 }
 
 
+int libmemc_set_timeouts(struct Memcache *handle, int connect, int read, int write) {
+   if ((connect < 0) || (read < 0) || (write < 0)) {
+      return -1;
+   }
+   handle->connect_timeout = connect;
+   handle->read_timeout = read;
+   handle->write_timeout = write;
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      /* and the second connection of a server, if gets were hedged */
+      for (struct Server *server = handle->servers[ii]; server != NULL;
+           server = server->hedge) {
+         server->connect_timeout = connect;
+         server->read_timeout = read;
+         server->write_timeout = write;
+         if (server->sock != -1) {
+            server_set_timeout(server, SO_RCVTIMEO, read);
+            server_set_timeout(server, SO_SNDTIMEO, write);
+         }
+      }
+   }
+   return 0;
+}
+
+int libmemc_set_failover(struct Memcache *handle, int failures, int backoff,
+                         int max_backoff) {
+   if ((failures < 0) || (backoff < 0) || (max_backoff < backoff)) {
+      return -1;
+   }
+   handle->dead_after = failures;
+   handle->backoff = backoff;
+   handle->max_backoff = max_backoff;
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      struct Server *server = handle->servers[ii];
+      server->dead_after = failures;
+      server->backoff = backoff;
+      server->max_backoff = max_backoff;
+   }
+   return 0;
+}
+
+int libmemc_set_zerocopy(struct Memcache *handle, size_t threshold) {
+   int ret = 0;
+   handle->zerocopy = threshold;
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      struct Server *server = handle->servers[ii];
+      server->zerocopy = threshold;
+      if (threshold > 0) {
+         server_enable_zerocopy(server);
+         if (server->zerocopy == 0) {
+            ret = -1;
+         }
+      }
+   }
+   return ret;
+}
+
 int libmemc_add(struct Memcache *handle, struct Item *item) {
-   return libmemc_store(handle, add, item);
+   return near_stored(handle, item, libmemc_store(handle, add, item));
 }
 
 int libmemc_set(struct Memcache *handle, struct Item *item) {
-   return libmemc_store(handle, set, item);    
+   return near_stored(handle, item, libmemc_store(handle, set, item));
 }
 
 int libmemc_replace(struct Memcache *handle, struct Item *item) {
-   return libmemc_store(handle, replace, item);        
+   return near_stored(handle, item, libmemc_store(handle, replace, item));
 }
 
 int libmemc_cas(struct Memcache *handle, struct Item *item) {
-   return libmemc_store(handle, cas, item);        
+   return near_stored(handle, item, libmemc_store(handle, cas, item));
 }
 
 int libmemc_get(struct Memcache *handle, struct Item *item) {
+   if (handle->near != NULL) {
+      return near_get(handle, item);
+   }
+   return remote_get(handle, item);
+}
+
+static int remote_get(struct Memcache *handle, struct Item *item) {
+   if (handle->flights != NULL) {
+      return flight_get(handle, item);
+   }
+   return fetch_item(handle, item);
+}
+
+static int fetch_item(struct Memcache *handle, struct Item *item) {
+   int ret = read_item(handle, item);
+   if ((ret == 0) && (handle->chunk > 0) && (item->flags & LIBMEMC_CHUNKED)) {
+      ret = chunked_read(handle, item);
+   }
+   if ((ret == 0) && (handle->compress > 0) && (item->flags & LIBMEMC_COMPRESSED)) {
+      ret = unpack_item(handle, item);
+   }
+   return ret;
+}
+
+static int read_item(struct Memcache *handle, struct Item *item) {
+   if (handle->replicas > 1) {
+      return replicated_get(handle, item);
+   }
    struct Server* server = get_server(handle, item->key);
    if (server == NULL) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
       return -1;
    } else {
       if (server->sock == -1) {
          if (server_connect(server) == -1) {
             fprintf(stderr, "%s\n", server->errmsg);
             fflush(stderr);
-            return -1;
+            return item_set_status(item, server, -1);
          }
       }
-      if (handle->protocol == Binary) {
-         return binary_get(server, item);
+      if (handle->hedging != NULL) {
+         return hedged_get(handle, server, NULL, item);
+      } else if (handle->protocol == Binary) {
+         return item_set_status(item, server, binary_get(server, item));
       } else {
-         return textual_get(server, item);
+         return item_set_status(item, server, textual_get(server, item));
       }
    }
 }
@@ -214,7 +439,8 @@ int libmemc_gets(struct Server *server, enum Protocol protocol, struct Item item
    }
 }
 
-static struct addrinfo *lookuphost(const char *hostname, in_port_t port)
+static struct addrinfo *lookuphost(const char *hostname, in_port_t port,
+                                   int socktype)
 {
     struct addrinfo *ai = 0;
     struct addrinfo hints = {0};
@@ -223,8 +449,8 @@ static struct addrinfo *lookuphost(const char *hostname, in_port_t port)
 
     hints.ai_flags = AI_PASSIVE|AI_ADDRCONFIG;
     hints.ai_family = AF_UNSPEC;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = (socktype == SOCK_DGRAM) ? IPPROTO_UDP : IPPROTO_TCP;
+    hints.ai_socktype = socktype;
     
     (void)snprintf(service, NI_MAXSERV, "%d", port);
     if ((error = getaddrinfo(hostname, service, &hints, &ai)) != 0) {
@@ -240,7 +466,7 @@ static struct addrinfo *lookuphost(const char *hostname, in_port_t port)
 
 int libmemc_connect_server(const char *hostname, in_port_t port)
 {
-    struct addrinfo *ai = lookuphost(hostname, port);
+    struct addrinfo *ai = lookuphost(hostname, port, SOCK_STREAM);
     int sock = -1;
     if (ai != NULL) { 
        if ((sock = socket(ai->ai_family, ai->ai_socktype,
@@ -274,34 +500,104 @@ static uint32_t simplehash(const char *key) {
    return ret;
 }
 
-static struct Server *get_server(struct Memcache *handle, const char *key) {
-   if (handle->no_servers == 1) {
-      return handle->servers[0];
-   } else if (handle->no_servers > 0) {
-      int idx = simplehash(key) % handle->no_servers;
-      return handle->servers[idx];
+static int get_server_index(struct Memcache *handle, const char *key) {
+   if (handle->no_servers > 1) {
+      return simplehash(key) % handle->no_servers;
    } else {
+      return 0;
+   }
+}
+
+static uint64_t now_usec(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_msec(void) {
+   return now_usec() / 1000;
+}
+
+/* A server is dead while it backs off after too many failures in a row */
+static int server_dead(struct Server *server) {
+   return (server->dead_after > 0) && (server->failures >= server->dead_after) &&
+      (now_msec() < server->retry_at);
+}
+
+static struct Server *get_server(struct Memcache *handle, const char *key) {
+   if (handle->no_servers == 0) {
+      return NULL;
+   }
+   struct Server *server = handle->servers[get_server_index(handle, key)];
+   if (!server_dead(server)) {
+      return server;
+   }
+
+   /* spread the keys of a dead server over the live ones, with other
+    * bits of the hash than picked the server */
+   int live = 0;
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      live += !server_dead(handle->servers[ii]);
+   }
+   if (live == 0) {
       return NULL;
    }
+   int pick = (simplehash(key) / handle->no_servers) % live;
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      if (!server_dead(handle->servers[ii]) && pick-- == 0) {
+         return handle->servers[ii];
+      }
+   }
+   return NULL;
 }
 
 static int libmemc_store(struct Memcache* handle, enum StoreCommand cmd, 
                          struct Item *item) {
+   struct Item packed = *item;
+   struct Item *value = item;
+   if ((handle->compress > 0) && (item->size >= handle->compress) &&
+       (pack_item(handle, &packed) == 0)) {
+      value = &packed;
+   }
+   int ret;
+   if ((handle->chunk > 0) && (value->size > handle->chunk)) {
+      ret = chunked_store(handle, cmd, value);
+   } else {
+      ret = store_item(handle, cmd, value);
+   }
+   item->status = value->status;
+   item->errmsg = value->errmsg;
+   return ret;
+}
+
+static int store_item(struct Memcache* handle, enum StoreCommand cmd, 
+                      struct Item *item) {
+   if (handle->replicas > 1) {
+      return replicated_store(handle, cmd, item);
+   }
    struct Server* server = get_server(handle, item->key);
    if (server == NULL) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
       return -1;
    } else {
       if (server->sock == -1) {
          if (server_connect(server) == -1) {
-            return -1;
+            return item_set_status(item, server, -1);
          }
       }
       
+      int ret;
       if (handle->protocol == Binary) {
-         return binary_store(server, cmd, item);
+         ret = binary_store(server, cmd, item);
       } else {
-         return textual_store(server, cmd, item);
+         ret = textual_store(server, cmd, item);
       }
+      if ((server->zerocopy_done != server->zerocopy_sent) &&
+          (server_zerocopy_wait(server) == -1)) {
+         ret = -1;
+      }
+      return item_set_status(item, server, ret);
    }
 }
 
@@ -310,46 +606,217 @@ static int server_sendv(struct Server* server, struct iovec *iov, int iovcnt);
 static int server_send(struct Server* server, const void *data, size_t size);
 static int server_connect(struct Server *server);
 static void server_disconnect(struct Server *server);
+static int server_drain(struct Server *server);
+static struct Ring* ring_create(void);
+static void ring_destroy(struct Ring *ring);
+
+static const char* const status_messages[] = {
+   "Success",
+   "Not found",
+   "Data exists for key",
+   "Not stored",
+   "Too large",
+   "Invalid arguments",
+   "Non-numeric value",
+   "Unknown command",
+   "Out of memory",
+   "Server error",
+   "Protocol error",
+   "Connection error",
+   "Failed to allocate memory",
+   "Timed out"
+};
+
+/* Record the outcome of the last operation on the server. Returns 0 on
+ * success and -1 otherwise, so it can be used as a return value */
+static int server_set_status(struct Server *server, enum Status status) {
+   server->status = status;
+   server->errmsg = status_messages[status];
+   return (status == Success) ? 0 : -1;
+}
+
+static int server_set_error(struct Server *server, enum Status status,
+                            const char *errmsg) {
+   server->status = status;
+   server->errmsg = errmsg;
+   return -1;
+}
+
+static void server_set_errno(struct Server *server, const char *what) {
+   /* a socket timeout shows up as EAGAIN */
+   int timeout = (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ETIMEDOUT);
+   snprintf(server->errbuf, sizeof(server->errbuf), "%s: %s", what,
+            timeout ? status_messages[Timeout] : strerror(errno));
+   server->status = timeout ? Timeout : ConnectionError;
+   server->errmsg = server->errbuf;
+}
+
+/* Pass the outcome of the last operation on the server on to the item */
+static int item_set_status(struct Item *item, struct Server *server, int ret) {
+   item->status = server->status;
+   item->errmsg = server->errmsg;
+   return ret;
+}
+
+/* Make sure the item has room for a value of the given size. The current
+ * buffer is reused whenever it is big enough */
+static int item_reserve(struct Item *item, size_t size) {
+   if (size > item->capacity) {
+      free(item->data);
+      item->data = malloc(size);
+      if (item->data == NULL) {
+         item->capacity = 0;
+         item->size = 0;
+         return -1;
+      }
+      item->capacity = size;
+   }
+   item->size = size;
+   return 0;
+}
 
 void server_destroy(struct Server *server) {
    if (server != NULL) {
       if (server->sock != -1) {
          close(server->sock);
       }
+      server_destroy(server->hedge);
+      if (server->primary != NULL) {
+         /* the addrinfo belongs to the primary */
+      } else if (server->addrinfo->ai_family == AF_UNIX) {
+         free(server->addrinfo);
+      } else {
+         freeaddrinfo(server->addrinfo);
+      }
+      ring_destroy(server->ring);
+      free((char*)server->peername);
       free(server->buffer);
       free(server);
    }
 }
 
+static struct Server* server_init(struct addrinfo *ai, const char *peername) {
+   struct Server* ret = calloc(1, sizeof(struct Server));
+   if (ret != 0) {
+      ret->sock = -1;
+      ret->errmsg = 0;
+      ret->addrinfo = ai;
+      ret->peername = strdup(peername);
+      ret->buffer = malloc(65 * 1024);
+      ret->buffersize = 65 * 1024;
+      if (ret->buffer == NULL) {
+         free((char*)ret->peername);
+         free(ret);
+         return NULL;
+      }
+      ret->ring = ring_create();
+   }
+   return ret;
+}
+
 struct Server* server_create(const char *name, in_port_t port) {
-   struct addrinfo* ai = lookuphost(name, port);
+   struct addrinfo* ai = lookuphost(name, port, SOCK_STREAM);
    struct Server* ret = NULL;
    if (ai != NULL) {
-      ret = calloc(1, sizeof(struct Server));
-      if (ret != 0) {
-         char buffer[1024];         
-         ret->sock = -1;
-         ret->errmsg = 0;
-         ret->addrinfo = ai;
-         sprintf(buffer, "%s:%d", name, port);
-         ret->peername = strdup(buffer);
-         ret->buffer = malloc(65 * 1024);
-         ret->buffersize = 65 * 1024;
-         server_connect(ret);
-         if (ret->buffer == NULL) {
-            server_destroy(ret);
-            ret = 0;
-         }
+      char buffer[1024];         
+      sprintf(buffer, "%s:%d", name, port);
+      ret = server_init(ai, buffer);
+      if (ret == NULL) {
+         freeaddrinfo(ai);
       }
    }
     
    return ret;
 }
 
+/* A server on a unix domain socket. The address is allocated along with
+ * the addrinfo, which server_destroy() knows by its family */
+static struct Server* server_create_unix(const char *path) {
+   struct sockaddr_un *sa;
+   if (strlen(path) >= sizeof(sa->sun_path)) {
+      return NULL;
+   }
+
+   struct addrinfo *ai = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_un));
+   if (ai == NULL) {
+      return NULL;
+   }
+   sa = (struct sockaddr_un*)(ai + 1);
+   sa->sun_family = AF_UNIX;
+   strcpy(sa->sun_path, path);
+   ai->ai_family = AF_UNIX;
+   ai->ai_socktype = SOCK_STREAM;
+   ai->ai_addr = (struct sockaddr*)sa;
+   ai->ai_addrlen = sizeof(struct sockaddr_un);
+
+   struct Server* ret = server_init(ai, path);
+   if (ret == NULL) {
+      free(ai);
+   }
+   return ret;
+}
+
+/* Count a connection error or a timeout, and take the server out for
+ * twice as long as the last time once there are too many in a row */
+static void server_failed(struct Server *server) {
+   ++server->failures;
+   if ((server->dead_after > 0) && (server->failures >= server->dead_after)) {
+      int shift = server->failures - server->dead_after;
+      uint64_t backoff = (uint64_t)server->backoff << ((shift < 20) ? shift : 20);
+      if (backoff > server->max_backoff) {
+         backoff = server->max_backoff;
+      }
+      server->retry_at = now_msec() + backoff;
+   }
+}
+
 static void server_disconnect(struct Server *server) {
+   server->owed = 0;
    if (server->sock != -1) {
       (void)close(server->sock);
       server->sock = -1;
+      if ((server->status == ConnectionError) || (server->status == Timeout)) {
+         server_failed(server);
+      }
+   }
+}
+
+/* Connect without waiting longer than the connect timeout */
+static int server_connect_timeout(struct Server *server) {
+   int flags = fcntl(server->sock, F_GETFL, 0);
+   if ((flags == -1) || (fcntl(server->sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+      return -1;
+   }
+   int ret = connect(server->sock, server->addrinfo->ai_addr,
+                     server->addrinfo->ai_addrlen);
+   if ((ret == -1) && (errno == EINPROGRESS)) {
+      struct pollfd pfd = { .fd = server->sock, .events = POLLOUT };
+      do {
+         ret = poll(&pfd, 1, server->connect_timeout);
+      } while ((ret == -1) && (errno == EINTR));
+      if (ret == 0) {
+         errno = ETIMEDOUT;
+         ret = -1;
+      } else if (ret == 1) {
+         int error = 0;
+         socklen_t len = sizeof(error);
+         ret = getsockopt(server->sock, SOL_SOCKET, SO_ERROR, &error, &len);
+         if ((ret == 0) && (error != 0)) {
+            errno = error;
+            ret = -1;
+         }
+      }
+   }
+   if ((ret == 0) && (fcntl(server->sock, F_SETFL, flags) == -1)) {
+      ret = -1;
+   }
+   return ret;
+}
+
+static void server_set_timeout(struct Server *server, int option, int msec) {
+   struct timeval tv = { .tv_sec = msec / 1000, .tv_usec = (msec % 1000) * 1000 };
+   if (setsockopt(server->sock, SOL_SOCKET, option, &tv, sizeof(tv)) == -1) {
+      perror("Failed to set socket timeout");
    }
 }
 
@@ -360,38 +827,320 @@ static int server_connect(struct Server *server)
    if ((server->sock = socket(server->addrinfo->ai_family,
                               server->addrinfo->ai_socktype,
                               server->addrinfo->ai_protocol)) == -1) {
-      char errmsg[1024];
-      sprintf(errmsg, "Failed to create socket: %s", strerror(errno));
-      server->errmsg = strdup(errmsg);
+      server_set_errno(server, "Failed to create socket");
       return -1;
    }
 
-   if (setsockopt(server->sock, IPPROTO_TCP, TCP_NODELAY,
-                  &flag, sizeof(flag)) == -1) {
+   if ((server->addrinfo->ai_family != AF_UNIX) &&
+       (setsockopt(server->sock, IPPROTO_TCP, TCP_NODELAY,
+                   &flag, sizeof(flag)) == -1)) {
       perror("Failed to set TCP_NODELAY");
    }
    
-   if (connect(server->sock, server->addrinfo->ai_addr,
-               server->addrinfo->ai_addrlen) == -1) {
-      char errmsg[1024];
-      sprintf(errmsg, "Failed to connect socket: %s", strerror(errno));
-      server->errmsg = strdup(errmsg);
+   int ret;
+   if (server->connect_timeout > 0) {
+      ret = server_connect_timeout(server);
+   } else {
+      ret = connect(server->sock, server->addrinfo->ai_addr,
+                    server->addrinfo->ai_addrlen);
+   }
+   if (ret == -1) {
+      server_set_errno(server, "Failed to connect socket");
       server_disconnect(server);
       return -1;
    }
+   if (server->read_timeout > 0) {
+      server_set_timeout(server, SO_RCVTIMEO, server->read_timeout);
+   }
+   if (server->write_timeout > 0) {
+      server_set_timeout(server, SO_SNDTIMEO, server->write_timeout);
+   }
+
+   server->zerocopy_sent = 0;
+   server->zerocopy_done = 0;
+   if (server->zerocopy > 0) {
+      server_enable_zerocopy(server);
+   }
     
    return 0;
 }
 
+/**
+ * io_uring
+ */
+#if HAVE_IO_URING
+#define RING_ENTRIES 4
+
+/* A ring per server, with at most one request in flight. server->buffer
+ * is registered as fixed buffer 0, so reads into it skip pinning the
+ * pages for every request */
+struct Ring {
+   int fd;
+   void *sq_ring;
+   size_t sq_ring_size;
+   void *cq_ring;
+   size_t cq_ring_size;
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+   unsigned *sq_tail;
+   unsigned *sq_array;
+   unsigned sq_mask;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned cq_mask;
+   struct io_uring_cqe *cqes;
+   const char *fixed;       /* the registered buffer */
+   size_t fixedsize;        /* 0 if it couldn't be registered */
+   int broken;              /* io_uring_enter() failed with a request queued */
+};
+
+/* Set up a ring, or return NULL to use the plain syscalls when the kernel
+ * doesn't have io_uring or won't let us use it */
+static struct Ring* ring_create(void) {
+   struct io_uring_params params;
+   memset(&params, 0, sizeof(params));
+   int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+   if (fd == -1) {
+      return NULL;
+   }
+
+   struct Ring *ring = calloc(1, sizeof(struct Ring));
+   if (ring == NULL) {
+      close(fd);
+      return NULL;
+   }
+   ring->fd = fd;
+   ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   ring->cq_ring_size = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      if (ring->cq_ring_size > ring->sq_ring_size) {
+         ring->sq_ring_size = ring->cq_ring_size;
+      }
+      ring->cq_ring_size = ring->sq_ring_size;
+   }
+
+   void *map = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   if (map == MAP_FAILED) {
+      ring_destroy(ring);
+      return NULL;
+   }
+   ring->sq_ring = map;
+
+   if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      ring->cq_ring = ring->sq_ring;
+   } else {
+      map = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (map == MAP_FAILED) {
+         ring_destroy(ring);
+         return NULL;
+      }
+      ring->cq_ring = map;
+   }
+
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   map = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   if (map == MAP_FAILED) {
+      ring_destroy(ring);
+      return NULL;
+   }
+   ring->sqes = map;
+
+   char *sq = ring->sq_ring;
+   char *cq = ring->cq_ring;
+   ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+   ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+   ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+   ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+   ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+   ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+   return ring;
+}
+
+static void ring_destroy(struct Ring *ring) {
+   if (ring != NULL) {
+      if (ring->sqes != NULL) {
+         munmap(ring->sqes, ring->sqes_size);
+      }
+      if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+         munmap(ring->cq_ring, ring->cq_ring_size);
+      }
+      if (ring->sq_ring != NULL) {
+         munmap(ring->sq_ring, ring->sq_ring_size);
+      }
+      close(ring->fd);
+      free(ring);
+   }
+}
+
+/* Register the buffer in place of the previous one. The server buffer may
+ * be reallocated, so this is done again whenever it moves */
+static void ring_register(struct Ring *ring, const char *buffer, size_t size) {
+   if (ring->fixed != NULL && ring->fixedsize > 0) {
+      (void)syscall(__NR_io_uring_register, ring->fd,
+                    IORING_UNREGISTER_BUFFERS, NULL, 0);
+   }
+   struct iovec iov = { .iov_base = (void*)buffer, .iov_len = size };
+   ring->fixed = buffer;
+   ring->fixedsize = size;
+   if (syscall(__NR_io_uring_register, ring->fd,
+               IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+      /* most likely RLIMIT_MEMLOCK, so read into it like any other */
+      ring->fixedsize = 0;
+   }
+}
+
+static void ring_queue(struct Ring *ring, unsigned tail,
+                       const struct io_uring_sqe *sqe) {
+   unsigned index = tail & ring->sq_mask;
+   ring->sqes[index] = *sqe;
+   ring->sq_array[index] = index;
+}
+
+/* Queue the request, with a linked timeout if msec > 0, and wait for it
+ * with a single io_uring_enter(). Returns the result like the syscall
+ * would, with EAGAIN for a timeout like the socket timeouts */
+static ssize_t ring_submit(struct Ring *ring, struct io_uring_sqe *sqe, int msec) {
+   struct __kernel_timespec ts = { .tv_sec = msec / 1000,
+                                   .tv_nsec = (msec % 1000) * 1000000LL };
+   unsigned count = 1;
+   unsigned tail = *ring->sq_tail;
+   sqe->user_data = 1;
+   if (msec > 0) {
+      struct io_uring_sqe timeout;
+      memset(&timeout, 0, sizeof(timeout));
+      timeout.opcode = IORING_OP_LINK_TIMEOUT;
+      timeout.addr = (uintptr_t)&ts;
+      timeout.len = 1;
+      timeout.user_data = 2;
+      sqe->flags |= IOSQE_IO_LINK;
+      ring_queue(ring, tail++, sqe);
+      ring_queue(ring, tail++, &timeout);
+      count = 2;
+   } else {
+      ring_queue(ring, tail++, sqe);
+   }
+   __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+   unsigned submit = count;
+   unsigned head = *ring->cq_head;
+   int res = 0;
+   while (count > 0) {
+      while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+         int ret = syscall(__NR_io_uring_enter, ring->fd, submit, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+         if (ret == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+               ring->broken = 1;
+               return -1;
+            }
+         } else {
+            submit -= ret;
+         }
+      }
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      if (cqe->user_data == 1) {
+         res = cqe->res;
+      }
+      ++head;
+      --count;
+   }
+   __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+   if (res < 0) {
+      errno = (res == -ECANCELED) ? EAGAIN : -res;
+      return -1;
+   }
+   return res;
+}
+
+/* When io_uring_enter() fails, the request is left in the ring with its
+ * completion still to come, so the ring is torn down, which cancels it,
+ * and the server goes on with the plain syscalls */
+static ssize_t server_ring_submit(struct Server *server, struct io_uring_sqe *sqe,
+                                  int msec) {
+   ssize_t ret = ring_submit(server->ring, sqe, msec);
+   if ((ret == -1) && server->ring->broken) {
+      int error = errno;
+      ring_destroy(server->ring);
+      server->ring = NULL;
+      errno = error;
+   }
+   return ret;
+}
+#else
+static struct Ring* ring_create(void) {
+   return NULL;
+}
+
+static void ring_destroy(struct Ring *ring) {
+   (void)ring;
+}
+#endif
+
+/* The syscalls the server I/O boils down to, done through the ring when
+ * there is one */
+static ssize_t server_recv(struct Server* server, char *data, size_t size) {
+   ssize_t nread;
+#if HAVE_IO_URING
+   if (server->ring != NULL) {
+      struct Ring *ring = server->ring;
+      struct io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.fd = server->sock;
+      sqe.addr = (uintptr_t)data;
+      sqe.len = size;
+      if (ring->fixed != server->buffer) {
+         ring_register(ring, server->buffer, server->buffersize);
+      }
+      if (data >= ring->fixed && data + size <= ring->fixed + ring->fixedsize) {
+         sqe.opcode = IORING_OP_READ_FIXED;
+         sqe.off = (uint64_t)-1;
+         sqe.buf_index = 0;
+      } else {
+         sqe.opcode = IORING_OP_RECV;
+      }
+      nread = server_ring_submit(server, &sqe, server->read_timeout);
+   } else
+#endif
+   nread = recv(server->sock, data, size, 0);
+
+   /* the server answers, so it is alive */
+   if (nread > 0) {
+      server->failures = 0;
+   }
+   return nread;
+}
+
+static ssize_t server_write(struct Server* server, const void *data, size_t size) {
+#if HAVE_IO_URING
+   if (server->ring != NULL) {
+      struct io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_SEND;
+      sqe.fd = server->sock;
+      sqe.addr = (uintptr_t)data;
+      sqe.len = size;
+      return server_ring_submit(server, &sqe, server->write_timeout);
+   }
+#endif
+   return send(server->sock, data, size, 0);
+}
+
 static int server_send(struct Server* server, const void *data, size_t size) {
+   if ((server->owed > 0) && (server_drain(server) == -1)) {
+      return -1;
+   }
    size_t offset = 0;
    do {
-      ssize_t sent = send(server->sock, ((const char*)data) + offset, size - offset, 0);
+      ssize_t sent = server_write(server, ((const char*)data) + offset, size - offset);
       if (sent == -1) {
          if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to send data to server: %s", strerror(errno));
-            server->errmsg = strdup(errmsg);
+            server_set_errno(server, "Failed to send data to server");
             server_disconnect(server);
             return -1;
          }
@@ -403,6 +1152,90 @@ static int server_send(struct Server* server, const void *data, size_t size) {
    return 0;
 }
 
+/* Enable MSG_ZEROCOPY on the connection, or turn it off for the server
+ * if the kernel or the socket type doesn't support it */
+static void server_enable_zerocopy(struct Server *server) {
+#if HAVE_MSG_ZEROCOPY
+   int flag = 1;
+   if ((server->sock != -1) &&
+       (setsockopt(server->sock, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)) == -1)) {
+      server->zerocopy = 0;
+   }
+#else
+   server->zerocopy = 0;
+#endif
+}
+
+/* Write as much of the vectors as the socket takes. Large writes skip
+ * the copy into the kernel with MSG_ZEROCOPY, when it is enabled */
+static ssize_t server_writev(struct Server* server, struct iovec *iov, int iovcnt,
+                             size_t size) {
+#if HAVE_MSG_ZEROCOPY
+   if ((server->zerocopy > 0) && (size >= server->zerocopy)) {
+      struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+      ssize_t sent = sendmsg(server->sock, &msg, MSG_ZEROCOPY);
+      if (sent != -1) {
+         ++server->zerocopy_sent;
+         return sent;
+      }
+      if (errno != ENOBUFS) {
+         return -1;
+      }
+      /* no room to pin the pages, so copy this one */
+   }
+#endif
+#if HAVE_IO_URING
+   if (server->ring != NULL) {
+      struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+      struct io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_SENDMSG;
+      sqe.fd = server->sock;
+      sqe.addr = (uintptr_t)&msg;
+      sqe.len = 1;
+      return server_ring_submit(server, &sqe, server->write_timeout);
+   }
+#endif
+   return writev(server->sock, iov, iovcnt);
+}
+
+/* Wait for the kernel to let go of the pages of the zerocopy sends, so
+ * that the caller may reuse or free its buffers */
+static int server_zerocopy_wait(struct Server* server) {
+#if HAVE_MSG_ZEROCOPY
+   while ((server->sock != -1) && (server->zerocopy_done != server->zerocopy_sent)) {
+      char control[128];
+      struct msghdr msg = { .msg_control = control,
+                            .msg_controllen = sizeof(control) };
+      if (recvmsg(server->sock, &msg, MSG_ERRQUEUE) == -1) {
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            /* the notifications show up as POLLERR */
+            struct pollfd pfd = { .fd = server->sock, .events = 0 };
+            if (poll(&pfd, 1, 1000) == 0) {
+               return server_set_status(server, Timeout);
+            }
+         } else if (errno != EINTR) {
+            server_set_errno(server, "Failed to read zerocopy notifications");
+            return -1;
+         }
+         continue;
+      }
+
+      for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+           cm = CMSG_NXTHDR(&msg, cm)) {
+         struct sock_extended_err *serr = (struct sock_extended_err*)CMSG_DATA(cm);
+         if (((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) &&
+             (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)) {
+            /* a range of sends, counted from 0 on this connection */
+            server->zerocopy_done += serr->ee_data - serr->ee_info + 1;
+         }
+      }
+   }
+#endif
+   return 0;
+}
+
 static int server_sendv(struct Server* server, struct iovec *iov, int iovcnt) {
 #ifdef WIN32
    // @todo I might have a scattered IO function on windows...
@@ -412,34 +1245,36 @@ static int server_sendv(struct Server* server, struct iovec *iov, int iovcnt) {
       }
    }
 #else
-   // @todo Verify implementation if the writev returns with partitial
-   // writes!
+   if ((server->owed > 0) && (server_drain(server) == -1)) {
+      return -1;
+   }
    size_t size = 0;
    for (int ii = 0;  ii < iovcnt; ++ ii) {
       size += iov[ii].iov_len;
    }
 
-   do {
-      ssize_t sent = writev(server->sock, iov, iovcnt);
+   while (size > 0) {
+      // skip the vectors that are already sent
+      while (iov->iov_len == 0) {
+         ++iov;
+         --iovcnt;
+      }
+
+      ssize_t sent = server_writev(server, iov,
+                                   (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt, size);
 
       if (sent == -1) {
          if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to send data to server: %s", strerror(errno));
-            server->errmsg = strdup(errmsg);
+            server_set_errno(server, "Failed to send data to server");
             fprintf(stderr, "%s%s", server->errmsg,"\n");
             fflush(stderr);
             server_disconnect(server);
             return -1;
          }
       } else {
-         if (sent == size) {
-            return 0;
-         }
-            
+         size -= sent;
          for (int ii = 0; ii < iovcnt && sent > 0; ++ii) {
-            if (iov[ii].iov_len < sent) {
-               size -= iov[ii].iov_len;
+            if (iov[ii].iov_len <= sent) {
                sent -= iov[ii].iov_len;
                iov[ii].iov_len = 0;
             } else {
@@ -450,12 +1285,11 @@ static int server_sendv(struct Server* server, struct iovec *iov, int iovcnt) {
                iov[ii].iov_base = ((char*)iov[ii].iov_base) + sent;
 #endif
                iov[ii].iov_len -= sent;
-               size -= sent;
-               break;
+               sent = 0;
             }
          }
       }
-   } while (size > 0);
+   }
 #endif
    return 0;
 }
@@ -464,15 +1298,17 @@ static size_t server_receive(struct Server* server, char* data, size_t size, int
    size_t offset = 0;
    int stop = 0;
    do {
-      ssize_t nread = recv(server->sock, data + offset, size - offset, 0);
+      ssize_t nread = server_recv(server, data + offset, size - offset);
       if (nread == -1) {
          if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to receive data from server: %s", strerror(errno));
-            server->errmsg = strdup(errmsg);
+            server_set_errno(server, "Failed to receive data from server");
             server_disconnect(server);
             return -1;
          }
+      } else if (nread == 0) {
+         server_set_error(server, ConnectionError, "Lost contact with server");
+         server_disconnect(server);
+         return -1;
       } else {
          if (line) {
             if (memchr(data + offset, '\r', nread) != 0) {
@@ -484,7 +1320,7 @@ static size_t server_receive(struct Server* server, char* data, size_t size, int
    } while (offset < size && !stop);
     
    if (line && !stop) {
-      server->errmsg = strdup("Protocol error");
+      server_set_status(server, ProtocolError);
       server_disconnect(server);
       return -1;
    }
@@ -492,116 +1328,194 @@ static size_t server_receive(struct Server* server, char* data, size_t size, int
    return offset;
 }
 
-/* Byte swap a 64-bit number */
-static int64_t swap64(int64_t in) {
-#ifndef __sparc
-    /* Little endian, flip the bytes around until someone makes a faster/better
-    * way to do this. */
-    int64_t rv = 0;
-    int i = 0;
-     for(i = 0; i < 8; i++) {
-        rv = (rv << 8) | (in & 0xff);
-        in >>= 8;
-     }
-    return rv;
+static int server_discard(struct Server* server, size_t size) {
+   while (size > 0) {
+      size_t chunk = (size > server->buffersize) ? server->buffersize : size;
+      if (server_receive(server, server->buffer, chunk, 0) != chunk) {
+         return -1;
+      }
+      size -= chunk;
+   }
+   return 0;
+}
+
+/* Read a message body sent by the server into the error buffer of the
+ * server. Messages that don't fit are truncated */
+static int server_receive_message(struct Server* server, size_t size) {
+   size_t len = (size < sizeof(server->errbuf)) ? size : sizeof(server->errbuf) - 1;
+   if ((len > 0) && (server_receive(server, server->errbuf, len, 0) != len)) {
+      return -1;
+   }
+   if (server_discard(server, size - len) == -1) {
+      return -1;
+   }
+   server->errbuf[len] = '\0';
+   server->errmsg = server->errbuf;
+   return 0;
+}
+
+/* Like server_receive_message, for a message that has been received */
+static void server_copy_message(struct Server* server, const char* data, size_t size) {
+   size_t len = (size < sizeof(server->errbuf)) ? size : sizeof(server->errbuf) - 1;
+   memcpy(server->errbuf, data, len);
+   server->errbuf[len] = '\0';
+   server->errmsg = server->errbuf;
+}
+
+/* Byte order of the 64-bit numbers of the binary protocol, decided at
+ * compile time. The builtin swaps in a single instruction */
+#if defined(__BYTE_ORDER__)
+#define LIBMEMC_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined(_BIG_ENDIAN) || defined(__sparc)
+#define LIBMEMC_BIG_ENDIAN 1
+#else
+#define LIBMEMC_BIG_ENDIAN 0
+#endif
+
+static uint64_t ntoh64(uint64_t value) {
+#if LIBMEMC_BIG_ENDIAN
+   return value;
+#elif defined(__GNUC__)
+   return __builtin_bswap64(value);
+#else
+   return ((uint64_t)ntohl((uint32_t)value) << 32) | ntohl((uint32_t)(value >> 32));
+#endif
+}
+
+static uint64_t hton64(uint64_t value) {
+   return ntoh64(value);
+}
+
+/* Map a status code of the binary protocol to a status */
+static enum Status binary_status(uint16_t status) {
+#if HAVE_PROTOCOL_BINARY
+   switch (ntohs(status)) {
+   case PROTOCOL_BINARY_RESPONSE_SUCCESS: return Success;
+   case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT: return NotFound;
+   case PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS: return Exists;
+   case PROTOCOL_BINARY_RESPONSE_E2BIG: return TooLarge;
+   case PROTOCOL_BINARY_RESPONSE_EINVAL: return InvalidArguments;
+   case PROTOCOL_BINARY_RESPONSE_NOT_STORED: return NotStored;
+   case PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL: return NonNumeric;
+   case PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND: return UnknownCommand;
+   case PROTOCOL_BINARY_RESPONSE_ENOMEM: return ServerOutOfMemory;
+   default: return ServerError;
+   }
 #else
-    /* big-endian machines don't need byte swapping */
-    return in;
+   return ProtocolError;
 #endif
 }
 
 /**
  * Implementation of the Binary protocol
  */
+#if HAVE_PROTOCOL_BINARY
+/* The header of every request starts as a copy of the template of its
+ * opcode, which has the fields that don't depend on the item filled in */
+#define REQUEST_TEMPLATE(op, ext) \
+   [op] = { .request = { .magic = PROTOCOL_BINARY_REQ, .opcode = op, \
+                         .extlen = ext, .datatype = PROTOCOL_BINARY_RAW_BYTES } }
+
+static const protocol_binary_request_header request_templates[] = {
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_GET, 0),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_SET, 8),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_ADD, 8),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_REPLACE, 8),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_DELETE, 0),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_INCREMENT, 20),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_DECREMENT, 20),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_FLUSH, 4),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_NOOP, 0),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_GETKQ, 0),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_STAT, 0),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_SETQ, 8),
+   REQUEST_TEMPLATE(PROTOCOL_BINARY_CMD_DELETEQ, 0),
+};
+
+/* Fill in a request header for a key and a value of the given sizes */
+static void binary_header(protocol_binary_request_header *header, uint8_t opcode,
+                          uint16_t keylen, uint32_t size) {
+   *header = request_templates[opcode];
+   header->request.keylen = htons(keylen);
+   header->request.bodylen = htonl(header->request.extlen + keylen + size);
+}
+#endif
+
 static int binary_get(struct Server* server, struct Item* item) 
+{
+   if (binary_get_request(server, item) == -1) {
+      return -1;
+   }
+   return binary_get_reply(server, item);
+}
+
+static int binary_get_request(struct Server* server, struct Item* item)
 {
 #if HAVE_PROTOCOL_BINARY
    uint16_t keylen = item->keylen;
-   uint32_t bodylen = keylen;
-
-   protocol_binary_request_get request = { .bytes = {0} };
-   request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-   request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET;
-   request.message.header.request.keylen = htons(keylen);
-   request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-   request.message.header.request.bodylen = htonl(bodylen);
-   
+
+   protocol_binary_request_get request;
+   binary_header(&request.message.header, PROTOCOL_BINARY_CMD_GET, keylen, 0);
+
    struct iovec iovec[2];
    iovec[0].iov_base = (void*)&request;
    iovec[0].iov_len = sizeof(protocol_binary_request_header);
    iovec[1].iov_base = (void*)item->key;
    iovec[1].iov_len = keylen;
 
-   server_sendv(server, iovec, 2);
+   return server_sendv(server, iovec, 2);
+#else
+   return -1;
+#endif
+}
 
+static int binary_get_reply(struct Server* server, struct Item* item)
+{
+#if HAVE_PROTOCOL_BINARY
    protocol_binary_response_no_extras response;
    size_t nread = server_receive(server, (char*)response.bytes,
                                  sizeof(response.bytes), 0);
    if (nread != sizeof(response)) {
-      server->errmsg = strdup("Protocol error");
+      if (nread != (size_t)-1) {
+         server_set_status(server, ProtocolError);
+      }
       server_disconnect(server);      
       return -1;
    }
 
-   bodylen = ntohl(response.message.header.response.bodylen);
+   uint32_t bodylen = ntohl(response.message.header.response.bodylen);
+   uint8_t extlen = response.message.header.response.extlen;
    if (response.message.header.response.status == 0) {
-      if (item->data != NULL) {
-         if ((bodylen-response.message.header.response.extlen) > item->size) {
-            free(item->data);
-            item->data = NULL;
-         }
+      if (((extlen != 0) && (extlen != sizeof(uint32_t))) || (bodylen < extlen)) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
+         return -1;
       }
-
-      item->size = bodylen - response.message.header.response.extlen;
-
-      if (item->data == NULL) {
-         item->data = malloc(item->size);
-         if (item->data == NULL) {
-            server->errmsg = strdup("failed to allocate memory\n");
-            server_disconnect(server);      
-            return -1;
-         }
+      if (item_reserve(item, bodylen - extlen) == -1) {
+         server_set_status(server, ClientOutOfMemory);
+         server_disconnect(server);      
+         return -1;
       }
 
-      if (response.message.header.response.extlen != 0) {
-         assert(response.message.header.response.extlen == 4);
-         uint32_t flags;
-         struct iovec iovec[2];
-         iovec[0].iov_base = (void*)&flags;
-         iovec[0].iov_len = sizeof(flags);
-         iovec[1].iov_base = item->data;
-         iovec[1].iov_len = item->size;
-
-         ssize_t nread = readv(server->sock, iovec, 2);
-         if (nread < bodylen) {
-             // partial read.. read the rest!
-             nread -= 4;
-             size_t left = item->size - nread;
-             if (server_receive(server, item->data + nread, left, 0) != left) {
-                 abort();
-             }
-         }
-         item->flags = ntohl(flags);
-      } else {
-         size_t nread = server_receive(server, item->data, item->size, 0);
-         assert(nread == item->size);
+      // a receive that fails or times out has disconnected the server
+      uint32_t flags = 0;
+      if ((extlen != 0) &&
+          (server_receive(server, (char*)&flags, sizeof(flags), 0) != sizeof(flags))) {
+         return -1;
       }
-      
-      item->cas_id = swap64(response.message.header.response.cas);
-   } else {
-      char *buffer = malloc(bodylen + 1);
-      if (buffer == NULL) {
-         server->errmsg = strdup("failed to allocate memory\n");
-         server_disconnect(server);      
+      if ((item->size > 0) &&
+          (server_receive(server, item->data, item->size, 0) != item->size)) {
          return -1;
       }
-      buffer[bodylen] = '\0';
-      server_receive(server, buffer, bodylen, 0);
-      server->errmsg = buffer;
+      item->flags = ntohl(flags);
+      item->cas_id = ntoh64(response.message.header.response.cas);
+   } else {
+      server_set_status(server, binary_status(response.message.header.response.status));
+      server_receive_message(server, bodylen);
       return -1;
    }
 
-   return 0;
+   return server_set_status(server, Success);
 #else
    return -1;
 #endif
@@ -611,31 +1525,29 @@ static int binary_store(struct Server* server,
                          enum StoreCommand cmd, 
                          struct Item *item)  
 {
-#if HAVE_PROTOCOL_BINARY
-   protocol_binary_request_set request = { .bytes = {0} };
-   request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+   if (binary_store_request(server, cmd, item) == -1) {
+      return -1;
+   }
+   return binary_store_reply(server);
+}
 
-   switch (cmd) {
-   case add :
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_ADD; break;
-   case set :
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_SET; break;
-   case replace :
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_REPLACE; break;
-   case cas :
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_SET; break;
-   default:
+static int binary_store_request(struct Server* server, 
+                                enum StoreCommand cmd, 
+                                struct Item *item)  
+{
+#if HAVE_PROTOCOL_BINARY
+   static const uint8_t opcodes[] = {
+      PROTOCOL_BINARY_CMD_ADD, PROTOCOL_BINARY_CMD_SET,
+      PROTOCOL_BINARY_CMD_REPLACE, PROTOCOL_BINARY_CMD_SET
+   };
+   if ((unsigned)cmd >= sizeof(opcodes)) {
       abort();
    }
 
    uint16_t keylen = item->keylen;
-   request.message.header.request.keylen = htons(keylen);
-   request.message.header.request.extlen = 8;
-   request.message.header.request.datatype = 0;
-   request.message.header.request.reserved = 0;
-   request.message.header.request.bodylen = htonl(keylen + item->size + 8);
-   request.message.header.request.opaque = 0;
-   request.message.header.request.cas = swap64(item->cas_id);
+   protocol_binary_request_set request;
+   binary_header(&request.message.header, opcodes[cmd], keylen, item->size);
+   request.message.header.request.cas = hton64(item->cas_id);
    request.message.body.flags = htonl(item->flags);
    request.message.body.expiration = htonl(item->exptime);
    
@@ -649,50 +1561,46 @@ static int binary_store(struct Server* server,
    iovec[2].iov_base = item->data;
    iovec[2].iov_len = item->size;
 
-   server_sendv(server, iovec, 3);
+   return server_sendv(server, iovec, 3);
+#else
+  return -1;
+#endif
+}
 
+static int binary_store_reply(struct Server* server)
+{
+#if HAVE_PROTOCOL_BINARY
    protocol_binary_response_set response;
    size_t nread = server_receive(server, (char*)response.bytes,
                                  sizeof(response.bytes), 0);
 
    if (nread != sizeof(response)) {
-      item->errmsg = strdup("Protocol error");
-      server->errmsg = strdup(item->errmsg);
-      fprintf(stderr, item->errmsg);
+      if (nread != (size_t)-1) {
+         server_set_status(server, ProtocolError);
+      }
+      fprintf(stderr, server->errmsg);
       fflush(stderr);
       server_disconnect(server);      
       return -1;
    }
 
-   if (response.message.header.response.status == 0 &&
+   enum Status status = binary_status(response.message.header.response.status);
+   if (status == Success &&
        response.message.header.response.bodylen != 0) {
-      item->errmsg = strdup("Unexpected data returned");
-      server->errmsg = strdup(item->errmsg);
-      fprintf(stderr, item->errmsg);
+      server_set_error(server, ProtocolError, "Unexpected data returned");
+      fprintf(stderr, server->errmsg);
       fflush(stderr);
       server_disconnect(server);      
       return -1;
-   } else if (response.message.header.response.bodylen != 0) {
-      uint32_t len = ntohl(response.message.header.response.bodylen);
-      char* buffer = malloc(len + 1);
-      if (buffer == 0) {
-         item->errmsg = strdup("failed to allocate memory");
-         server->errmsg = strdup(item->errmsg);
-         fprintf(stderr, item->errmsg);
-         fflush(stderr);
-         server_disconnect(server);      
-         return -1;
-      }
+   }
 
-      size_t nread = server_receive(server, buffer, len, 0);
-      memset(buffer + len, 0, 1);
-      item->errmsg = strdup(buffer);
-      free(buffer);
-   } else {
-      item->errmsg = strdup("Stored");
+   int ret = server_set_status(server, status);
+   if (response.message.header.response.bodylen != 0) {
+      uint32_t len = ntohl(response.message.header.response.bodylen);
+      server_receive_message(server, len);
    }
 
-   return (response.message.header.response.status == 0) ? 0 : -1;
+   return ret;
 #else
   return -1;
 #endif
@@ -701,6 +1609,210 @@ static int binary_store(struct Server* server,
 /**
  * Implementation of the Textual protocol
  */
+
+/* Write the decimal digits of value, two at a time. Returns the end */
+static char* put_uint(char *ptr, uint64_t value) {
+   static const char pairs[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+   char digits[20];
+   char *end = digits + sizeof(digits);
+   char *start = end;
+   while (value >= 100) {
+      const char *pair = pairs + 2 * (value % 100);
+      value /= 100;
+      *--start = pair[1];
+      *--start = pair[0];
+   }
+   if (value >= 10) {
+      const char *pair = pairs + 2 * value;
+      *--start = pair[1];
+      *--start = pair[0];
+   } else {
+      *--start = '0' + value;
+   }
+   memcpy(ptr, start, end - start);
+   return ptr + (end - start);
+}
+
+/* Write a space and the decimal digits of value. Returns the end */
+static char* put_field(char *ptr, uint64_t value) {
+   *ptr++ = ' ';
+   return put_uint(ptr, value);
+}
+
+static int reply_is(const char *line, size_t len, const char *reply) {
+   size_t replylen = strlen(reply);
+   return (len >= replylen) && (memcmp(line, reply, replylen) == 0);
+}
+
+/* Map a reply line (without "\r\n") to a status */
+static enum Status textual_status(const char *line, size_t len) {
+   if (len == 0) {
+      return ProtocolError;
+   }
+
+   switch (line[0]) {
+   case 'S':
+      if (reply_is(line, len, "STORED")) {
+         return Success;
+      } else if (reply_is(line, len, "SERVER_ERROR object too large")) {
+         return TooLarge;
+      } else if (reply_is(line, len, "SERVER_ERROR out of memory")) {
+         return ServerOutOfMemory;
+      } else if (reply_is(line, len, "SERVER_ERROR")) {
+         return ServerError;
+      }
+      break;
+   case 'D':
+      if (reply_is(line, len, "DELETED")) {
+         return Success;
+      }
+      break;
+   case 'O':
+      if (reply_is(line, len, "OK")) {
+         return Success;
+      }
+      break;
+   case 'R':
+      if (reply_is(line, len, "RESET")) {
+         return Success;
+      }
+      break;
+   case 'N':
+      if (reply_is(line, len, "NOT_FOUND")) {
+         return NotFound;
+      } else if (reply_is(line, len, "NOT_STORED")) {
+         return NotStored;
+      }
+      break;
+   case 'E':
+      if (reply_is(line, len, "EXISTS")) {
+         return Exists;
+      } else if (reply_is(line, len, "END")) {
+         return NotFound;
+      } else if (reply_is(line, len, "ERROR")) {
+         return UnknownCommand;
+      }
+      break;
+   case 'C':
+      if (reply_is(line, len, "CLIENT_ERROR cannot increment or decrement non-numeric value")) {
+         return NonNumeric;
+      } else if (reply_is(line, len, "CLIENT_ERROR")) {
+         return InvalidArguments;
+      }
+      break;
+   }
+
+   return ProtocolError;
+}
+
+/* Receive a single reply line into the server buffer. Returns the length
+ * of the line without the terminating "\r\n", or -1 */
+static ssize_t textual_receive_line(struct Server* server) {
+   size_t offset = 0;
+   do {
+      ssize_t len = server_recv(server, server->buffer + offset,
+                                server->buffersize - offset);
+      if (len == -1) {
+         if (errno != EINTR) {
+            server_set_errno(server, "Failed to receive data from server");
+            server_disconnect(server);
+            return -1;
+         }
+      } else if (len == 0) {
+         server_set_error(server, ConnectionError, "Lost contact with server");
+         server_disconnect(server);
+         return -1;
+      } else {
+         char *eol = memchr(server->buffer + offset, '\n', len);
+         offset += len;
+         if (eol != NULL) {
+            if ((eol == server->buffer) || (eol[-1] != '\r')) {
+               server_set_status(server, ProtocolError);
+               server_disconnect(server);
+               return -1;
+            }
+            return (eol - 1) - server->buffer;
+         }
+      }
+      if (offset == server->buffersize) {
+         server_set_error(server, ProtocolError, "Out of sync with server...");
+         server_disconnect(server);
+         return -1;
+      }
+   } while (1);
+}
+
+/* Receive a reply line and record its status */
+static int textual_reply(struct Server* server) {
+   ssize_t len = textual_receive_line(server);
+   if (len == -1) {
+      return -1;
+   }
+
+   enum Status status = textual_status(server->buffer, len);
+   if (status == ProtocolError) {
+      server_disconnect(server);
+   }
+   return server_set_status(server, status);
+}
+
+/* Position of the next unread line in the server buffer when a reply
+ * spans several lines, like the replies to stats and pipelined commands */
+struct LineReader {
+   size_t start;
+   size_t offset;
+};
+
+/* Return the next line of a multi-line reply, without the terminating
+ * "\r\n". The line stays valid until the next call. Returns NULL on error */
+static char* textual_next_line(struct Server* server, struct LineReader* reader,
+                               size_t* len) {
+   while (1) {
+      char *line = server->buffer + reader->start;
+      char *eol = memchr(line, '\n', reader->offset - reader->start);
+      if (eol != NULL) {
+         if ((eol == line) || (eol[-1] != '\r')) {
+            server_set_status(server, ProtocolError);
+            server_disconnect(server);
+            return NULL;
+         }
+         reader->start = (eol + 1) - server->buffer;
+         *len = (eol - 1) - line;
+         return line;
+      }
+
+      if (reader->start > 0) {
+         memmove(server->buffer, line, reader->offset - reader->start);
+         reader->offset -= reader->start;
+         reader->start = 0;
+      }
+      if (reader->offset == server->buffersize) {
+         server_set_error(server, ProtocolError, "Out of sync with server...");
+         server_disconnect(server);
+         return NULL;
+      }
+
+      ssize_t nread = server_recv(server, server->buffer + reader->offset,
+                                  server->buffersize - reader->offset);
+      if (nread == -1) {
+         if (errno != EINTR) {
+            server_set_errno(server, "Failed to receive data from server");
+            server_disconnect(server);
+            return NULL;
+         }
+      } else if (nread == 0) {
+         server_set_error(server, ConnectionError, "Lost contact with server");
+         server_disconnect(server);
+         return NULL;
+      } else {
+         reader->offset += nread;
+      }
+   }
+}
+
 static int parse_value_line(char *header, uint32_t* flag, size_t* size, uint64_t* cas_id, char** data) {
    char *end = strchr(header, ' ');
    if (end == 0) {
@@ -760,10 +1872,14 @@ static int parse_value_line_gets(char *header, uint32_t* flag, size_t* size, uin
    return 0;
 }
 
-static int textual_get(struct Server* server, struct Item* item) {    
-   uint32_t flag;
-   uint64_t cas_id;
+static int textual_get(struct Server* server, struct Item* item) {
+   if (textual_get_request(server, item) == -1) {
+      return -1;
+   }
+   return textual_get_reply(server, item);
+}
 
+static int textual_get_request(struct Server* server, struct Item* item) {
    struct iovec iovec[3];
    iovec[0].iov_base = (char*)"gets ";
    iovec[0].iov_len = 5;
@@ -771,9 +1887,17 @@ static int textual_get(struct Server* server, struct Item* item) {
    iovec[1].iov_len = item->keylen;
    iovec[2].iov_base = (char*)"\r\n";
    iovec[2].iov_len = 2;
-   server_sendv(server, iovec, 3);
+   return server_sendv(server, iovec, 3);
+}
+
+static int textual_get_reply(struct Server* server, struct Item* item) {
+   uint32_t flag;
+   uint64_t cas_id;
 
    size_t nread = server_receive(server, server->buffer,server->buffersize, 1);
+   if (nread == (size_t)-1) {
+      return -1;
+   }
 
    // Split the header line
    if (strstr(server->buffer, "VALUE ") == server->buffer) {
@@ -781,7 +1905,7 @@ static int textual_get(struct Server* server, struct Item* item) {
       char *ptr;
       
       if (parse_value_line(server->buffer + 6, &flag, &elemsize, &cas_id, &ptr) == -1){
-         server->errmsg = strdup("Protocol error");
+         server_set_status(server, ProtocolError);
          server_disconnect(server);
          return -1;
       }
@@ -796,273 +1920,459 @@ static int textual_get(struct Server* server, struct Item* item) {
          if (server->buffersize < (headsize + elemsize + 7)) {
              server->buffer = realloc(server->buffer, (headsize + elemsize + 7));
              if (server->buffer == 0) {
-                server->errmsg = strdup("failed to allocate memory\n");
+                server_set_status(server, ClientOutOfMemory);
                 server_disconnect(server);
                 return -1;                    
              }
              server->buffersize = (headsize + elemsize + 7);
          }
-         server_receive(server, server->buffer + nread,
-                        (elemsize - chunk) + 7, 0);
-      }
-
-      if (elemsize > item->size) {
-         if (item->data != 0) {
-            free(item->data);
-         }
-         item->size = elemsize;
-         item->data = malloc(item->size);
-         if (item->data == 0) {
-            item->size = 0;
-            server->errmsg = strdup("failed to allocate memory\n");
-            server_disconnect(server);
+         size_t missing = (elemsize - chunk) + 7;
+         if (server_receive(server, server->buffer + nread, missing, 0) != missing) {
             return -1;
          }
-      } else {
-         item->size = elemsize;
+      }
+
+      if (item_reserve(item, elemsize) == -1) {
+         server_set_status(server, ClientOutOfMemory);
+         server_disconnect(server);
+         return -1;
       }
       item->flags = flag;
       item->cas_id = cas_id;
       memcpy(item->data, server->buffer + headsize, item->size);
-      return 0;
+      return server_set_status(server, Success);
    } else if (strstr(server->buffer, "END") == server->buffer) {
-      return -1;
+      return server_set_status(server, NotFound);
    } else {
-      server->errmsg = strdup("Protocol error");
+      server_set_status(server, ProtocolError);
       server_disconnect(server);
       return -1;
    }
 }
 
 static int textual_gets(struct Server* server, struct Item item[], int items) {
-   uint32_t flag;
-   int length = sprintf(server->buffer, "gets");
-   for (int i=0; i<items; i++) {
-      length += sprintf(server->buffer + length, " %s", item[i].key);
+   if (textual_gets_request(server, item, items) == -1) {
+      return -1;
    }
-   length += sprintf(server->buffer + length, "\r\n");
-   server_send(server, (void*)server->buffer, length);
-
-   size_t nread = server_receive(server, server->buffer, server->buffersize, 1);
-
-   char *buffer_ptr = server->buffer;
-   char *data_ptr;
-   size_t elemsize;
-#ifndef __sun
-   typedef size_t ptrdiff_t;
-#endif
-   ptrdiff_t headsize;
+   return textual_gets_reply(server, item, items);
+}
 
-   for (int i=0; i<items; i++) {
-      // Split the header line
-      if (strstr(buffer_ptr, "VALUE ") == buffer_ptr) {
-         char *key = buffer_ptr + 6;
-         char *end = strchr(key, ' ');
-         int keylen = end - key;
-         uint64_t cas_id;
-         if (parse_value_line_gets(buffer_ptr + 6, &flag, &elemsize, &cas_id, &data_ptr) == -1) {
-            server->errmsg = strdup("Protocol error");
-            server_disconnect(server);
-            return -1;
-         }
-         
-         // Find item
-         struct Item *curr_item = 0;
-         for (int j=0; j<items; j++) {
-             if ((item[j].keylen == keylen) && 
-                 (!strncmp(item[j].key, key, keylen))) {
-                 curr_item = &item[j];
-                 break;
-             }
-         }
-         if (curr_item == 0) {
-            server->errmsg = strdup("Protocol error");
-            server_disconnect(server);
+static int textual_gets_request(struct Server* server, struct Item item[], int items) {
+   // the line may be longer than the buffer, then it is sent in parts
+   size_t length = 4;
+   memcpy(server->buffer, "gets", 4);
+   for (int i=0; i<=items; i++) {
+      size_t keylen = (i < items) ? item[i].keylen + 1 : 2;
+      if (length + keylen > server->buffersize) {
+         if (server_send(server, server->buffer, length) == -1) {
             return -1;
          }
-         
-         headsize = data_ptr - buffer_ptr;
-         size_t chunk = nread - headsize;
-        
-         if (chunk < (elemsize + 2)) {
-            // I don't have all of the data.. keep on reading
-            if (server->buffersize < (headsize + elemsize + 2)) {
-               server->buffer = realloc(server->buffer, (headsize + elemsize + 2));
-               if (server->buffer == 0) {
-                  server->errmsg = strdup("failed to allocate memory\n");
-                  server_disconnect(server);
-                  return -1;                    
-               }
-               buffer_ptr = server->buffer;
-               server->buffersize = (headsize + elemsize + 2);
-            }
-            nread += server_receive(server, buffer_ptr + nread, (elemsize - chunk) + 2, 0);
-         }
-
-         if (elemsize > curr_item->size) {
-            if (curr_item->data != 0) {
-               free(curr_item->data);
-            }
-            curr_item->size = elemsize;
-            curr_item->data = malloc(curr_item->size);
-            if (curr_item->data == 0) {
-               curr_item->size = 0;
-               server->errmsg = strdup("failed to allocate memory\n");
-               server_disconnect(server);
-               return -1;
-            }
-         } else {
-            curr_item->size = elemsize;
-         }
-         memcpy(curr_item->data, buffer_ptr + headsize, curr_item->size);
-         curr_item->flags = flag;
-         curr_item->cas_id = cas_id;
-         
-      } else if (strstr(server->buffer, "END") == server->buffer) {
-         return 0;
-      } else {
-        server->errmsg = strdup("Protocol error");
-        server_disconnect(server);
-        return -1;
+         length = 0;
       }
-
-      //prepare for reading the next item
-      int processed = headsize + elemsize + 2;
-      buffer_ptr = server->buffer + processed;
-      nread -= processed;
-      memmove(server->buffer, buffer_ptr, nread);
-      buffer_ptr = server->buffer;
-      // Make sure "\r\n" has been read
-      if ((nread < 2) || (strncmp(buffer_ptr + nread - 2, "\r\n", 2) != 0)) {
-          nread += server_receive(server, buffer_ptr + nread, 
-                  server->buffersize - nread, 1);
+      if (i < items) {
+         server->buffer[length] = ' ';
+         memcpy(server->buffer + length + 1, item[i].key, item[i].keylen);
+      } else {
+         memcpy(server->buffer + length, "\r\n", 2);
       }
+      length += keylen;
    }
-
-   return 0;
+   return server_send(server, server->buffer, length);
 }
 
-static int binary_gets(struct Server* server, struct Item item[], int items) {
-#if HAVE_PROTOCOL_BINARY
+#define TEXTUAL_HEADER_MAX 320   /* "VALUE", a key of 250 bytes and three numbers */
 
-   // send all the item requests as "get key quiet"
-   for (int i=0; i<items; i++) {
-      uint16_t keylen = item[i].keylen;
-      uint32_t bodylen = keylen;
-
-      protocol_binary_request_get request = { .bytes = {0} };
-      request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GETKQ;
-      request.message.header.request.keylen = htons(keylen);
-      request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-      request.message.header.request.bodylen = htonl(bodylen);
-   
-      struct iovec iovec[2];
-      iovec[0].iov_base = (void*)&request;
-      iovec[0].iov_len = sizeof(protocol_binary_request_header);
-      iovec[1].iov_base = (void*)item[i].key;
-      iovec[1].iov_len = keylen;
+/* Make sure that the unread bytes from start to nread in the server
+ * buffer begin with a whole line, moving them to the front of the buffer
+ * when the room after them may not hold a header. Returns the length of
+ * the line with its "\r\n", or -1 */
+static ssize_t textual_buffer_line(struct Server* server, size_t *start, size_t *nread) {
+   size_t scanned = *start;
+   while (1) {
+      for (; scanned + 1 < *nread; ++scanned) {
+         if ((server->buffer[scanned] == '\r') && (server->buffer[scanned + 1] == '\n')) {
+            return scanned + 2 - *start;
+         }
+      }
+      if ((*start > 0) && (server->buffersize - *nread < TEXTUAL_HEADER_MAX)) {
+         memmove(server->buffer, server->buffer + *start, *nread - *start);
+         *nread -= *start;
+         scanned -= *start;
+         *start = 0;
+      }
+      if (*nread == server->buffersize) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
+         return -1;
+      }
 
-      server_sendv(server, iovec, 2);
+      // take whatever arrived, the line may end in a later read
+      ssize_t chunk = server_recv(server, server->buffer + *nread,
+                                  server->buffersize - *nread);
+      if (chunk == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         server_set_errno(server, "Failed to receive data from server");
+         server_disconnect(server);
+         return -1;
+      } else if (chunk == 0) {
+         server_set_error(server, ConnectionError, "Lost contact with server");
+         server_disconnect(server);
+         return -1;
+      }
+      *nread += chunk;
    }
+}
 
-   // flush with noop
-   protocol_binary_request_noop noopreq = { .bytes = {0} };
-   noopreq.message.header.request.magic = PROTOCOL_BINARY_REQ;
-   noopreq.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOOP;
-   struct iovec iovec_noop[2];
-   iovec_noop[0].iov_base = (void*)&noopreq;
-   iovec_noop[0].iov_len = sizeof(noopreq);
-   server_sendv(server, iovec_noop, 1);
-
-   for (int i=0; i<items; i++)
-   {
-      free(item[i].data);
+static int textual_gets_reply(struct Server* server, struct Item item[], int items) {
+   uint32_t flag;
+   for (int i=0; i<items; i++) {
       item[i].size = 0;
+      item[i].status = NotFound;
+      item[i].errmsg = status_messages[NotFound];
    }
 
-   // receive the items that were found
+   // the reply may be larger than the buffer, so it is read a part at a
+   // time. The values come in the order of the keys, so the search for
+   // the item of a value starts after the last one found
+   size_t start = 0;
+   size_t nread = 0;
+   int next = 0;
    while (1) {
-      protocol_binary_response_no_extras response;
-      size_t nread = server_receive(server, (char*)response.bytes,
-                                 sizeof(response.bytes), 0);
-      if (nread != sizeof(response)) {
-         server->errmsg = strdup("Protocol error");
-         server_disconnect(server);      
+      ssize_t linelen = textual_buffer_line(server, &start, &nread);
+      if (linelen == -1) {
          return -1;
       }
-      
-      uint8_t extlen = response.message.header.response.extlen; // flags
-      uint16_t keylen = ntohs(response.message.header.response.keylen);
-      uint32_t bodylen = ntohl(response.message.header.response.bodylen);
-      uint32_t datalen = bodylen - extlen - keylen;
-      if (response.message.header.response.opcode == PROTOCOL_BINARY_CMD_NOOP) {
-         // no more items
+      char *line = server->buffer + start;
+      if ((linelen == 5) && (memcmp(line, "END\r\n", 5) == 0)) {
          break;
-      } else if ((response.message.header.response.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
-                (extlen != sizeof(uint32_t))) {
-         server->errmsg = strdup("Protocol error");
-         server_disconnect(server);      
+      }
+
+      // Split the header line
+      char *key = line + 6;
+      char *end = (linelen > 6) ? memchr(key, ' ', linelen - 6) : NULL;
+      char *data_ptr;
+      size_t elemsize;
+      uint64_t cas_id;
+      if ((end == NULL) || (memcmp(line, "VALUE ", 6) != 0) ||
+          (parse_value_line_gets(key, &flag, &elemsize, &cas_id, &data_ptr) == -1)) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
+         return -1;
+      }
+      int keylen = end - key;
+
+      // Find item
+      struct Item *curr_item = 0;
+      for (int j=0; j<items; j++) {
+         int k = (next + j) % items;
+         if ((item[k].keylen == keylen) && (!memcmp(item[k].key, key, keylen))) {
+            curr_item = &item[k];
+            next = k + 1;
+            break;
+         }
+      }
+      if (curr_item == 0) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
          return -1;
       }
 
-      // read flags, key
-      uint32_t flags;
-      char key[256];
-
-      struct iovec iovec_flagskey[2];
-      iovec_flagskey[0].iov_base = (void*)&flags;
-      iovec_flagskey[0].iov_len = sizeof(flags);
-      iovec_flagskey[1].iov_base = key;
-      iovec_flagskey[1].iov_len = keylen;
-      nread = readv(server->sock, iovec_flagskey, 2);
-      if (nread < (extlen + keylen)) {
-         // partial read.. read the rest!
-         nread -= 4;
-         size_t left = (extlen + keylen) - nread;
-         if (server_receive(server, key + nread, left, 0) != left) {
-            abort();
+      // Read the rest of the data, making room for it first
+      size_t total = linelen + elemsize + 2;
+      if (start + total > server->buffersize) {
+         memmove(server->buffer, server->buffer + start, nread - start);
+         nread -= start;
+         start = 0;
+      }
+      if (server->buffersize < total) {
+         char *buffer = realloc(server->buffer, total);
+         if (buffer == 0) {
+            server_set_status(server, ClientOutOfMemory);
+            server_disconnect(server);
+            return -1;
          }
+         server->buffer = buffer;
+         server->buffersize = total;
+      }
+      if (nread - start < total) {
+         size_t missing = total - (nread - start);
+         if (server_receive(server, server->buffer + nread, missing, 0) != missing) {
+            return -1;
+         }
+         nread += missing;
+      }
+      data_ptr = server->buffer + start + linelen;
+      if (memcmp(data_ptr + elemsize, "\r\n", 2) != 0) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
+         return -1;
       }
 
-      // data
-      char *data = malloc(datalen);
+      if (item_reserve(curr_item, elemsize) == -1) {
+         server_set_status(server, ClientOutOfMemory);
+         server_disconnect(server);
+         return -1;
+      }
+      memcpy(curr_item->data, data_ptr, elemsize);
+      curr_item->flags = flag;
+      curr_item->cas_id = cas_id;
+      curr_item->status = Success;
+      curr_item->errmsg = status_messages[Success];
+      start += total;
+   }
 
-      if (data == NULL) {
-         server->errmsg = strdup("failed to allocate memory\n");
-         server_disconnect(server);      
+   if (start + 5 != nread) {
+      server_set_error(server, ProtocolError, "Out of sync with server...");
+      server_disconnect(server);
+      return -1;
+   }
+   return server_set_status(server, Success);
+}
+
+/* Position of the next unread response in the server buffer when a
+ * stream of responses is read in bulk, like the replies to a multi-get
+ * or to stats. A block is received as large as the buffer allows, and
+ * the frames that are complete in it are decoded without any further
+ * syscall */
+struct BinaryReader {
+   size_t start;
+   size_t offset;
+};
+
+/* A response header with its fields in host order, and its body, or the
+ * extras and key of the body, in the server buffer */
+struct BinaryFrame {
+   uint8_t opcode;
+   uint8_t extlen;
+   uint16_t keylen;
+   uint16_t status;
+   uint32_t bodylen;
+   uint32_t opaque;
+   uint64_t cas;
+   const char *body;
+};
+
+#if HAVE_PROTOCOL_BINARY
+static void binary_decode(const char *bytes, struct BinaryFrame *frame) {
+   protocol_binary_response_header header;
+   memcpy(header.bytes, bytes, sizeof(header.bytes));
+   frame->opcode = header.response.opcode;
+   frame->extlen = header.response.extlen;
+   frame->keylen = ntohs(header.response.keylen);
+   frame->status = ntohs(header.response.status);
+   frame->bodylen = ntohl(header.response.bodylen);
+   frame->opaque = header.response.opaque;
+   frame->cas = ntoh64(header.response.cas);
+}
+
+/* Decode the next response. Its extras and key, or the whole body if
+ * whole is set, are in the server buffer until the next call, which
+ * grows for a body that doesn't fit. Returns 0, or -1 on error */
+static int binary_next_frame(struct Server* server, struct BinaryReader* reader,
+                             struct BinaryFrame* frame, int whole) {
+   const size_t headsize = sizeof(protocol_binary_response_header);
+   while (1) {
+      size_t avail = reader->offset - reader->start;
+      size_t need = headsize;
+      if (avail >= headsize) {
+         binary_decode(server->buffer + reader->start, frame);
+         size_t prefix = frame->extlen + frame->keylen;
+         if (frame->bodylen < prefix) {
+            server_set_status(server, ProtocolError);
+            server_disconnect(server);
+            return -1;
+         }
+         need += whole ? frame->bodylen : prefix;
+         if (avail >= need) {
+            frame->body = server->buffer + reader->start + headsize;
+            reader->start += need;
+            return 0;
+         }
+      }
+
+      if (reader->start > 0) {
+         memmove(server->buffer, server->buffer + reader->start, avail);
+         reader->offset = avail;
+         reader->start = 0;
+      }
+      if (need > server->buffersize) {
+         char *buffer = realloc(server->buffer, need);
+         if (buffer == NULL) {
+            server_set_status(server, ClientOutOfMemory);
+            server_disconnect(server);
+            return -1;
+         }
+         server->buffer = buffer;
+         server->buffersize = need;
+      }
+
+      ssize_t nread = server_recv(server, server->buffer + reader->offset,
+                                  server->buffersize - reader->offset);
+      if (nread == -1) {
+         if (errno != EINTR) {
+            server_set_errno(server, "Failed to receive data from server");
+            server_disconnect(server);
+            return -1;
+         }
+      } else if (nread == 0) {
+         server_set_error(server, ConnectionError, "Lost contact with server");
+         server_disconnect(server);
          return -1;
+      } else {
+         reader->offset += nread;
       }
-      struct iovec iovecdata[1];
-      iovecdata[0].iov_base = data;
-      iovecdata[0].iov_len = datalen;
-      nread = readv(server->sock, iovecdata, 1);
-      if (nread < datalen) {
-         // partial read.. read the rest!
-         size_t left = datalen - nread;
-         if (server_receive(server, data + nread, left, 0) != left) {
-            abort();
+   }
+}
+
+/* Copy the value that follows a response to data, or skip it if data is
+ * NULL. What is buffered is used first, the rest is received directly */
+static int binary_read_data(struct Server* server, struct BinaryReader* reader,
+                            char* data, size_t size) {
+   size_t avail = reader->offset - reader->start;
+   size_t chunk = (size < avail) ? size : avail;
+   if ((data != NULL) && (chunk > 0)) {
+      memcpy(data, server->buffer + reader->start, chunk);
+   }
+   reader->start += chunk;
+   if (reader->start == reader->offset) {
+      reader->start = reader->offset = 0;
+   }
+   if (chunk == size) {
+      return 0;
+   }
+   if (data == NULL) {
+      return server_discard(server, size - chunk);
+   }
+   size -= chunk;
+   if (server_receive(server, data + chunk, size, 0) != size) {
+      return -1;
+   }
+   return 0;
+}
+#endif
+
+/* Check that nothing is left after the last response of a stream */
+static int binary_reader_done(struct Server* server, struct BinaryReader* reader) {
+   if (reader->start != reader->offset) {
+      server_set_error(server, ProtocolError, "Out of sync with server...");
+      server_disconnect(server);
+      return -1;
+   }
+   return 0;
+}
+
+static int binary_gets(struct Server* server, struct Item item[], int items) {
+   if (binary_gets_request(server, item, items) == -1) {
+      return -1;
+   }
+   return binary_gets_reply(server, item, items);
+}
+
+static int binary_gets_request(struct Server* server, struct Item item[], int items) {
+#if HAVE_PROTOCOL_BINARY
+   // send all the item requests as "get key quiet" and a noop, encoded
+   // into the server buffer and sent whenever it is full
+   const size_t headsize = sizeof(protocol_binary_request_header);
+   size_t length = 0;
+   for (int i=0; i<=items; i++) {
+      uint16_t keylen = (i < items) ? item[i].keylen : 0;
+      if (length + headsize + keylen > server->buffersize) {
+         if (server_send(server, server->buffer, length) == -1) {
+            return -1;
          }
+         length = 0;
       }
-      
+      // the header lands after the previous key, so it is built aligned
+      // and copied in
+      protocol_binary_request_header header;
+      if (i < items) {
+         binary_header(&header, PROTOCOL_BINARY_CMD_GETKQ, keylen, 0);
+         memcpy(server->buffer + length + headsize, item[i].key, keylen);
+      } else {
+         binary_header(&header, PROTOCOL_BINARY_CMD_NOOP, 0, 0);
+      }
+      memcpy(server->buffer + length, header.bytes, headsize);
+      length += headsize + keylen;
+   }
+   return server_send(server, server->buffer, length);
+#else
+   return -1;
+#endif
+}
+
+static int binary_gets_reply(struct Server* server, struct Item item[], int items) {
+#if HAVE_PROTOCOL_BINARY
+   for (int i=0; i<items; i++)
+   {
+      item[i].size = 0;
+      item[i].status = NotFound;
+      item[i].errmsg = status_messages[NotFound];
+   }
+
+   // receive the items that were found. They come in the order of the
+   // requests, so the search for the item starts after the last one found
+   struct BinaryReader reader = { 0, 0 };
+   int next = 0;
+   while (1) {
+      struct BinaryFrame frame;
+      if (binary_next_frame(server, &reader, &frame, 0) == -1) {
+         return -1;
+      }
+
+      uint32_t datalen = frame.bodylen - frame.extlen - frame.keylen;
+      if (frame.opcode == PROTOCOL_BINARY_CMD_NOOP) {
+         // no more items
+         break;
+      } else if ((frame.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
+                 (frame.extlen != sizeof(uint32_t))) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
+         return -1;
+      }
+
+      uint32_t flags;
+      memcpy(&flags, frame.body, sizeof(flags));
+      const char *key = frame.body + frame.extlen;
+
       //find the item
-      int found = 0;
-      for (int i=0; i<items; i++)
-      {
-         if ((keylen == item[i].keylen) && 
-             (!memcmp(item[i].key, key, keylen))) {
-            item[i].flags = ntohl(flags);
-            item[i].cas_id = swap64(response.message.header.response.cas);
-            item[i].data = data;
-            item[i].size = datalen;
-            found = 1;
+      struct Item *curr_item = NULL;
+      for (int n=0; n<items; n++) {
+         int i = (next + n) % items;
+         if ((frame.keylen == item[i].keylen) &&
+             (!memcmp(item[i].key, key, frame.keylen))) {
+            curr_item = &item[i];
+            next = i + 1;
             break;
          }
       }
-      if (!found)
-          free(data);
+
+      // data, from the buffer first and the rest straight from the socket
+      if (curr_item == NULL) {
+         if (binary_read_data(server, &reader, NULL, datalen) == -1) {
+            return -1;
+         }
+         continue;
+      }
+      if (item_reserve(curr_item, datalen) == -1) {
+         server_set_status(server, ClientOutOfMemory);
+         server_disconnect(server);
+         return -1;
+      }
+      if (binary_read_data(server, &reader, curr_item->data, datalen) == -1) {
+         return -1;
+      }
+      curr_item->flags = ntohl(flags);
+      curr_item->cas_id = frame.cas;
+      curr_item->status = Success;
+      curr_item->errmsg = status_messages[Success];
    }
-   return 0;
+   // nothing was sent after the noop
+   if (binary_reader_done(server, &reader) == -1) {
+      return -1;
+   }
+   return server_set_status(server, Success);
 #else
    return -1;
 #endif
@@ -1071,19 +2381,29 @@ static int binary_gets(struct Server* server, struct Item item[], int items) {
 static int textual_store(struct Server* server, 
                          enum StoreCommand cmd, 
                          struct Item *item)  {
+   if (textual_store_request(server, cmd, item) == -1) {
+      return -1;
+   }
+   return textual_reply(server);
+}
+
+static int textual_store_request(struct Server* server, 
+                                 enum StoreCommand cmd, 
+                                 struct Item *item)  {
    static const char* const commands[] = { "add ", "set ", "replace ", "cas " };
 
    uint32_t flags = item->flags;
    const void *dta = item->data;
    size_t size = item->size;
-   ssize_t len;
-   if (cmd == cas)
-      len = sprintf(server->buffer, " %d %ld %ld %lld\r\n", 
-           flags, (long)item->exptime, (long)item->size, item->cas_id);
-   else
-      len = sprintf(server->buffer, " %d %ld %ld\r\n", 
-           flags, (long)item->exptime, (long)item->size);
-   
+   char *end = put_field(server->buffer, flags);
+   end = put_field(end, item->exptime);
+   end = put_field(end, item->size);
+   if (cmd == cas) {
+      end = put_field(end, item->cas_id);
+   }
+   memcpy(end, "\r\n", 2);
+   size_t len = (end + 2) - server->buffer;
+
    struct iovec iovec[5];
    iovec[0].iov_base = (char*)commands[cmd];
    iovec[0].iov_len = strlen(commands[cmd]);
@@ -1096,70 +2416,7 @@ static int textual_store(struct Server* server,
    iovec[4].iov_base = (char*)"\r\n";
    iovec[4].iov_len = 2;
 
-   server_sendv(server, iovec, 5);
-
-   size_t offset = 0;
-   do {
-       len = recv(server->sock, (void*)(server->buffer + offset),
-               server->buffersize - offset, 0);
-
-      if (len == -1) {
-         if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to receive data from server: %s",
-                    strerror(errno));
-            server->errmsg = strdup(errmsg);
-            fprintf(stderr, "%s\n",server->errmsg);
-            fflush(stderr);
-            server_disconnect(server);
-            return -1;
-         }
-      } else if (len == 0) {
-         server->errmsg = strdup("Lost contact with server");
-         fprintf(stderr, "%s\n",server->errmsg);
-         fflush(stderr);
-         server_disconnect(server);
-         return -1;
-      } else {
-         offset += len;
-         if (strchr(server->buffer, '\r') != 0) {
-            if (strstr(server->buffer, "STORED\r\n") == server->buffer) {
-               item->errmsg = strdup("STORED");
-               return 0;
-            } else if (strstr(server->buffer,
-                              "NOT_STORED\r\n") == server->buffer) {
-               item->errmsg = strdup("NOT_STORED");
-               server->errmsg = strdup(item->errmsg);
-               return -1;
-            } else if (strstr(server->buffer,
-                              "SERVER_ERROR out of memory storing object\r\n") == server->buffer) {
-               item->errmsg = strdup("SERVER_ERROR out of memory storing object");
-               server->errmsg = strdup(item->errmsg);
-               return -1;
-            } else if (strstr(server->buffer,
-                              "SERVER_ERROR object too large for cache\r\n") == server->buffer) {
-               item->errmsg = strdup("SERVER_ERROR object too large for cache");
-               server->errmsg = strdup(item->errmsg);
-               return -1;
-            } else if (strstr(server->buffer,
-                              "EXISTS\r\n") == server->buffer) {
-               item->errmsg = strdup("EXISTS");
-               server->errmsg = strdup("Item NOT stored - wrong cas id");
-               return -1;
-            } else if (strstr(server->buffer,
-                              "NOT_FOUND\r\n") == server->buffer) {
-               item->errmsg = strdup("NOT_FOUND");
-               server->errmsg = strdup(item->errmsg);
-               return -1;
-            }
-         }
-      }
-      if (offset == server->buffersize) {
-         server->errmsg = strdup("Out of sync with server...");
-         server_disconnect(server);
-         return -1;
-      }
-   } while (1);
+   return server_sendv(server, iovec, 5);
 }
 
 int libmemc_incr(struct Memcache *handle, struct Item *item, uint64_t delta) {
@@ -1175,20 +2432,26 @@ static int libmemc_incr_decr(struct Memcache *handle,
                         struct Item *item,
                         uint64_t delta)
 {
+   near_forget(handle, item);
+   if (handle->replicas > 1) {
+      return replicated_incr_decr(handle, cmd, item, delta);
+   }
    struct Server* server = get_server(handle, item->key);
    if (server == NULL) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
       return -1;
    } else {
       if (server->sock == -1) {
          if (server_connect(server) == -1) {
-            return -1;
+            return item_set_status(item, server, -1);
          }
       }
       
       if (handle->protocol == Binary) {
-         return binary_incr_decr(server, cmd, item, delta);
+         return item_set_status(item, server, binary_incr_decr(server, cmd, item, delta));
       } else {
-         return textual_incr_decr(server, cmd, item, delta);
+         return item_set_status(item, server, textual_incr_decr(server, cmd, item, delta));
       }
    }
 }
@@ -1198,8 +2461,10 @@ static int textual_incr_decr(struct Server* server,
                             struct Item *item,
                             uint64_t delta) {
    static const char* const commands[] = { "incr ", "decr " };
-   ssize_t len = sprintf(server->buffer, " %ld\r\n", delta);
-    
+   char *end = put_field(server->buffer, delta);
+   memcpy(end, "\r\n", 2);
+   ssize_t len = (end + 2) - server->buffer;
+
    struct iovec iovec[3];
    iovec[0].iov_base = (char*)commands[cmd];
    iovec[0].iov_len = strlen(commands[cmd]);
@@ -1207,49 +2472,28 @@ static int textual_incr_decr(struct Server* server,
    iovec[1].iov_len = item->keylen;
    iovec[2].iov_base = server->buffer;
    iovec[2].iov_len = len;
-   server_sendv(server, iovec, 3);
+   if (server_sendv(server, iovec, 3) == -1) {
+      return -1;
+   }
 
-   size_t offset = 0;
-   do {
-      len = recv(server->sock, (void*)(server->buffer + offset),
-                 server->buffersize - offset, 0);
-      if (len == -1) {
-         if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to receive data from server: %s",
-                    strerror(errno));
-            server->errmsg = strdup(errmsg);
-            server_disconnect(server);
-            return -1;
-         }
-      } else if (len == 0) {
-         server->errmsg = strdup("Lost contact with server");
-         server_disconnect(server);
-         return -1;
-      } else {
-         offset += len;
-         if (strchr(server->buffer, '\r') != 0) {
-            } if (strstr(server->buffer,
-                              "NOT_FOUND\r\n") == server->buffer) {
-               server->errmsg = strdup("Item NOT found");
-               return -1;
-            } else if (strstr(server->buffer, "\r\n") != NULL) {
-               if (item->data != 0) {
-                  free(item->data);
-               }
-               item->data = malloc(offset - 2);
-               memcpy(item->data, server->buffer, offset - 2);
-			   item->size = offset - 2;
-
-               return 0;
-         }
-      }
-      if (offset == server->buffersize) {
-         server->errmsg = strdup("Out of sync with server...");
-         server_disconnect(server);
-         return -1;
+   len = textual_receive_line(server);
+   if (len == -1) {
+      return -1;
+   }
+
+   if ((len > 0) && (server->buffer[0] >= '0') && (server->buffer[0] <= '9')) {
+      if (item_reserve(item, len) == -1) {
+         return server_set_status(server, ClientOutOfMemory);
       }
-   } while (1);  
+      memcpy(item->data, server->buffer, len);
+      return server_set_status(server, Success);
+   }
+
+   enum Status status = textual_status(server->buffer, len);
+   if (status == ProtocolError) {
+      server_disconnect(server);
+   }
+   return server_set_status(server, status);
 }
 
 static int binary_incr_decr(struct Server* server,
@@ -1258,32 +2502,28 @@ static int binary_incr_decr(struct Server* server,
                            uint64_t delta)
 {
 #if HAVE_PROTOCOL_BINARY
-   protocol_binary_request_incr request = {.bytes= {0}};
-
-   request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+   protocol_binary_request_incr request;
 
+   uint8_t opcode;
    switch (cmd) {
    case incr :
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_INCREMENT; break;
+      opcode = PROTOCOL_BINARY_CMD_INCREMENT; break;
    case decr :
-      request.message.header.request.opcode = PROTOCOL_BINARY_CMD_DECREMENT; break;
+      opcode = PROTOCOL_BINARY_CMD_DECREMENT; break;
    default:
       abort();
    }
 
    uint16_t keylen = item->keylen;
-   request.message.header.request.keylen = htons(keylen);
-   request.message.header.request.extlen = 20;
-   request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-   request.message.header.request.bodylen = htonl(keylen + request.message.header.request.extlen);
-   request.message.body.delta = swap64(delta);
+   binary_header(&request.message.header, opcode, keylen, 0);
+   request.message.body.delta = hton64(delta);
 
    if ((item->data != NULL) && (item->size > 0)) {
-      char *tmp = malloc(item->size + 1);
-      memcpy(tmp, item->data, item->size);
-      memset(tmp + item->size, 0, 1);
-      request.message.body.initial = swap64(strtoull(tmp, NULL, 10));
-      free(tmp);
+      char tmp[32];
+      size_t len = (item->size < sizeof(tmp)) ? item->size : sizeof(tmp) - 1;
+      memcpy(tmp, item->data, len);
+      tmp[len] = '\0';
+      request.message.body.initial = hton64(strtoull(tmp, NULL, 10));
    } else {
        request.message.body.initial = 0;
    }
@@ -1304,72 +2544,78 @@ static int binary_incr_decr(struct Server* server,
                                  sizeof(protocol_binary_response_header), 0);
 
    if (nread != sizeof(protocol_binary_response_header)) {
-      server->errmsg = strdup("Protocol error");
+      if (nread != (size_t)-1) {
+         server_set_status(server, ProtocolError);
+      }
       server_disconnect(server);      
       return -1;
    }
    uint32_t bodylen = ntohl(response.message.header.response.bodylen);
-   char *buffer = malloc(bodylen + 1);
-   if (buffer == NULL) {
-       server->errmsg = strdup("failed to allocate memory\n");
-       server_disconnect(server);      
-       return -1;
-    }
-    buffer[bodylen] = '\0';
-    server_receive(server, buffer, bodylen, 0);
 
    if (response.message.header.response.status == 0) {
-      memcpy(&response.message.body.value, buffer, 8);
-
-      if (item->data != NULL) {
-         free(item->data);
-         item->data = NULL;   
+      if ((bodylen != sizeof(response.message.body.value)) ||
+          (server_receive(server, (char*)&response.message.body.value,
+                          bodylen, 0) != bodylen)) {
+         server_set_status(server, ProtocolError);
+         server_disconnect(server);
+         return -1;
       }
 
-      if (item->data == NULL) {
-         char tmp[50];
-         sprintf(tmp, "%llu", swap64(response.message.body.value));
-         item->size = strlen(tmp);
-         item->data = malloc(item->size);
-         if (item->data == NULL) {
-            server->errmsg = strdup("failed to allocate memory\n");
-            server_disconnect(server);      
-            return -1;
-         }
-         memcpy(item->data, tmp, item->size);
+      char tmp[50];
+      sprintf(tmp, "%llu", (unsigned long long)ntoh64(response.message.body.value));
+      if (item_reserve(item, strlen(tmp)) == -1) {
+         server_set_status(server, ClientOutOfMemory);
+         server_disconnect(server);      
+         return -1;
       }
+      memcpy(item->data, tmp, item->size);
+      return server_set_status(server, Success);
    } else {
-       server->errmsg = buffer;
+      server_set_status(server, binary_status(response.message.header.response.status));
+      server_receive_message(server, bodylen);
+      return -1;
    }
-
-   return (response.message.header.response.status == 0) ? 0 : -1;
 #else
   return -1;
 #endif
 }
 
 int libmemc_delete(struct Memcache *handle, struct Item *item) {
+   near_forget(handle, item);
+   if (handle->replicas > 1) {
+      return replicated_delete(handle, item);
+   }
    struct Server* server = get_server(handle, item->key);
    if (server == NULL) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
       return -1;
    } else {
       if (server->sock == -1) {
          if (server_connect(server) == -1) {
             fprintf(stderr, "%s\n", server->errmsg);
             fflush(stderr);
-            return -1;
+            return item_set_status(item, server, -1);
          }
       }
 
       if (handle->protocol == Binary) {
-         return binary_delete(server, item);
+         return item_set_status(item, server, binary_delete(server, item));
       } else {
-         return textual_delete(server, item);
+         return item_set_status(item, server, textual_delete(server, item));
       }
    }
 }
 
 static int textual_delete(struct Server* server, struct Item* item)
+{
+   if (textual_delete_request(server, item) == -1) {
+      return -1;
+   }
+   return textual_delete_reply(server);
+}
+
+static int textual_delete_request(struct Server* server, struct Item* item)
 {
    struct iovec iovec[3];
    iovec[0].iov_base = (char*)"delete ";
@@ -1378,147 +2624,97 @@ static int textual_delete(struct Server* server, struct Item* item)
    iovec[1].iov_len = item->keylen;
    iovec[2].iov_base = (char*)"\r\n";
    iovec[2].iov_len = 2;
-   server_sendv(server, iovec, 3);
+   return server_sendv(server, iovec, 3);
+}
 
-   size_t offset = 0;
-   do {
-      size_t len = recv(server->sock, (void*)(server->buffer + offset),
-                 server->buffersize - offset, 0);
-      if (len == -1) {
-         if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to receive data from server: %s",
-                    strerror(errno));
-            server->errmsg = strdup(errmsg);
-            item->errmsg = strdup(errmsg);
-            server_disconnect(server);
-            return -1;
-         }
-      } else if (len == 0) {
-          item->errmsg = strdup("Lost contact with server");
-          server->errmsg = strdup(item->errmsg);
-         server_disconnect(server);
-         return -1;
-      } else {
-         offset += len;
-         if (strchr(server->buffer, '\r') != 0) {
-            if (strstr(server->buffer, "DELETED\r\n") == server->buffer) {
-               item->errmsg = strdup("DELETED");
-               server->errmsg = strdup(item->errmsg);
-               return 0;
-            } else if (strstr(server->buffer,
-                              "NOT_FOUND\r\n") == server->buffer) {
-               item->errmsg = strdup("NOT_FOUND");
-               server->errmsg = strdup(item->errmsg);
-               return 0;
-            } else {
-               return -1;
-            }
-         }
-      }
-      if (offset == server->buffersize) {
-         item->errmsg = strdup("Out of sync with server...");
-         server->errmsg = strdup(item->errmsg);
-         server_disconnect(server);
-         return -1;
-      }
-   } while (1);
+static int textual_delete_reply(struct Server* server)
+{
+   if (textual_reply(server) == -1) {
+      return (server->status == NotFound) ? 0 : -1;
+   }
+   return 0;
 }
 
 static int binary_delete(struct Server* server, struct Item* item)
 {
-#if HAVE_PROTOCOL_BINARY
-   protocol_binary_request_delete request = {.bytes= {0}};
+   if (binary_delete_request(server, item) == -1) {
+      return -1;
+   }
+   return binary_delete_reply(server);
+}
 
-   request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-   request.message.header.request.opcode = PROTOCOL_BINARY_CMD_DELETE;
+static int binary_delete_request(struct Server* server, struct Item* item)
+{
+#if HAVE_PROTOCOL_BINARY
+   protocol_binary_request_delete request;
 
    uint16_t keylen = item->keylen;
-   request.message.header.request.keylen = htons(keylen);
-   request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-   request.message.header.request.bodylen = htonl(keylen);
+   binary_header(&request.message.header, PROTOCOL_BINARY_CMD_DELETE, keylen, 0);
 
    struct iovec iovec[2];
    iovec[0].iov_base = (void*)&request;
    iovec[0].iov_len = sizeof(protocol_binary_request_header);
    iovec[1].iov_base = (void*)item->key;
    iovec[1].iov_len = keylen;
-   server_sendv(server, iovec, 2);
+   return server_sendv(server, iovec, 2);
+#else
+  return -1;
+#endif
+}
 
+static int binary_delete_reply(struct Server* server)
+{
+#if HAVE_PROTOCOL_BINARY
    protocol_binary_response_delete response;
    size_t nread = server_receive(server, (char*)response.bytes,
                                  sizeof(protocol_binary_response_delete), 0);
 
    if (nread != sizeof(protocol_binary_response_delete)) {
-      item->errmsg = strdup("Protocol error");
-      server->errmsg = strdup(item->errmsg);
+      if (nread != (size_t)-1) {
+         server_set_status(server, ProtocolError);
+      }
       server_disconnect(server);      
       return -1;
    }
 
+   server_set_status(server, binary_status(response.message.header.response.status));
    uint32_t bodylen = ntohl(response.message.header.response.bodylen);
-   char *buffer = malloc(bodylen + 1);
-   if (buffer == NULL) {
-       item->errmsg = strdup("failed to allocate memory");
-       server->errmsg = strdup(item->errmsg);
-       server_disconnect(server);      
-       return -1;
-   }
-   buffer[bodylen] = '\0';
-   if (bodylen>0)
-      server_receive(server, buffer, bodylen, 0);
-   item->errmsg = strdup(buffer);
-   server->errmsg = strdup(item->errmsg);
-
-   return (response.message.header.response.status == 0) || 
-          (ntohs(response.message.header.response.status) == 1) ? 0 : -1;
+   if ((bodylen > 0) && (server_receive_message(server, bodylen) == -1)) {
+      return -1;
+   }
+
+   return (server->status == Success) || (server->status == NotFound) ? 0 : -1;
 #else
   return -1;
 #endif
 }
 
 int libmemc_flush_all(struct Memcache *handle, long exptime) {
+   int ret = 0;
    for (int i=0; i<handle->no_servers; i++) {
       if (handle->protocol == Textual) {
-         return textual_flush_all(handle->servers[i], exptime);
+         ret |= textual_flush_all(handle->servers[i], exptime);
       } else {	 
-         return binary_flush_all(handle->servers[i], exptime);
+         ret |= binary_flush_all(handle->servers[i], exptime);
       }
    }
+   near_clear(handle);
+   return ret;
 }
 
 static int textual_flush_all(struct Server *server, long exptime) {
    char sendbuffer[50];
-   if (exptime < 0)
-      sprintf(sendbuffer, "flush_all\r\n");
-   else
-      sprintf(sendbuffer, "flush_all %d\r\n", exptime);
-   ssize_t sent = send(server->sock, sendbuffer, strlen(sendbuffer), 0);
-   if (sent == -1) {
-      if (errno != EINTR) {
-         char errmsg[1024];
-         sprintf(errmsg, "Failed to send data to server: %s", strerror(errno));
-         server->errmsg = strdup(errmsg);
-         server_disconnect(server);
-         return -1;
-      }
-   } else {
-      char recvdata[4];
-      ssize_t nread = recv(server->sock, recvdata, 4, 0);
-      if (nread == -1) {
-         if (errno != EINTR) {
-            char errmsg[1024];
-            sprintf(errmsg, "Failed to receive data from server: %s", strerror(errno));
-            server->errmsg = strdup(errmsg);
-            server_disconnect(server);
-            return -1;
-         }
-      }
-      if (memcmp(recvdata, "OK\r\n", 4) != 0)
-         return -1;
+   char *end = sendbuffer + 9;
+   memcpy(sendbuffer, "flush_all", 9);
+   if (exptime >= 0) {
+      end = put_field(end, exptime);
+   }
+   memcpy(end, "\r\n", 2);
+   if (server_send(server, sendbuffer, (end + 2) - sendbuffer) == -1) {
+      return -1;
    }
 
-  return 0;
+   return textual_reply(server);
 }
 
 static int binary_flush_all(struct Server *server, long exptime)
@@ -1526,12 +2722,8 @@ static int binary_flush_all(struct Server *server, long exptime)
 #if HAVE_PROTOCOL_BINARY
    if (exptime < 0)
         exptime = 0;
-   protocol_binary_request_flush request = { .bytes = {0} };
-   request.message.header.request.magic = PROTOCOL_BINARY_REQ;
-   request.message.header.request.opcode = PROTOCOL_BINARY_CMD_FLUSH;
-   request.message.header.request.extlen = sizeof(request.message.body.expiration);
-   request.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-   request.message.header.request.bodylen = htonl(request.message.header.request.extlen);
+   protocol_binary_request_flush request;
+   binary_header(&request.message.header, PROTOCOL_BINARY_CMD_FLUSH, 0, 0);
    request.message.body.expiration = htonl(exptime);
    
    struct iovec iovec[1];
@@ -1545,18 +2737,20 @@ static int binary_flush_all(struct Server *server, long exptime)
    size_t nread = server_receive(server, (char*)response.bytes,
                                  sizeof(response.bytes), 0);
    if (nread != sizeof(response)) {
-      server->errmsg = strdup("Protocol error");
+      if (nread != (size_t)-1) {
+         server_set_status(server, ProtocolError);
+      }
       server_disconnect(server);      
       return -1;
    }
    if (response.message.header.response.status == 0 &&
        response.message.header.response.bodylen != 0) {
-      server->errmsg = strdup("Unexpected data returned\n");
+      server_set_error(server, ProtocolError, "Unexpected data returned\n");
       server_disconnect(server);      
       return -1;
    }
 
-   return (response.message.header.response.status == 0) ? 0 : -1;
+   return server_set_status(server, binary_status(response.message.header.response.status));
 #else
   return -1;
 #endif
@@ -1567,6 +2761,19 @@ enum Protocol libmemc_get_protocol(struct Memcache *handle)
     return handle->protocol;
 }
 
+enum Status libmemc_get_status(struct Server *server)
+{
+    return server->status;
+}
+
+const char* libmemc_strstatus(enum Status status)
+{
+    if ((status < Success) || (status > Timeout)) {
+        return "Unknown status";
+    }
+    return status_messages[status];
+}
+
 char* libmemc_stats(struct Server *server, enum Protocol protocol, const char* stats_type)
 {
     if (protocol == Textual) {
@@ -1576,101 +2783,3235 @@ char* libmemc_stats(struct Server *server, enum Protocol protocol, const char* s
     }
 }
 
+/**
+ * Parsed stats
+ */
+struct Stat {
+   size_t name;      /* offset of the name in Stats::strings */
+   size_t value;     /* offset of the value in Stats::strings */
+   int64_t number;
+   int numeric;
+};
+
+struct Stats {
+   struct Stat *stats;
+   int count;
+   int capacity;
+   char *strings;
+   size_t used;
+   size_t size;
+   int *index;       /* open addressing table of stats by name */
+   int indexsize;
+};
+
+static int grow(void **ptr, size_t *capacity, size_t needed, size_t elemsize) {
+   if (needed <= *capacity) {
+      return 0;
+   }
+   size_t newcapacity = (*capacity == 0) ? 64 : *capacity;
+   while (newcapacity < needed) {
+      newcapacity *= 2;
+   }
+   void *p = realloc(*ptr, newcapacity * elemsize);
+   if (p == NULL) {
+      return -1;
+   }
+   *ptr = p;
+   *capacity = newcapacity;
+   return 0;
+}
+
+/* Parse a stats value as a (possibly negative) decimal integer */
+static int parse_int64(const char *value, size_t len, int64_t *number) {
+   size_t i = (len > 0 && value[0] == '-') ? 1 : 0;
+   if (i == len) {
+      return -1;
+   }
+   uint64_t ret = 0;
+   for (; i < len; ++i) {
+      if (value[i] < '0' || value[i] > '9') {
+         return -1;
+      }
+      ret = ret * 10 + (value[i] - '0');
+   }
+   *number = (value[0] == '-') ? -(int64_t)ret : (int64_t)ret;
+   return 0;
+}
+
+static int stats_add(struct Stats *stats, const char *name, size_t namelen,
+                     const char *value, size_t valuelen) {
+   size_t capacity = stats->capacity;
+   size_t size = stats->size;
+   if (grow((void**)&stats->stats, &capacity, stats->count + 1, sizeof(struct Stat)) == -1 ||
+       grow((void**)&stats->strings, &size, stats->used + namelen + valuelen + 2, 1) == -1) {
+      return -1;
+   }
+   stats->capacity = capacity;
+   stats->size = size;
+
+   struct Stat *stat = &stats->stats[stats->count++];
+   stat->name = stats->used;
+   memcpy(stats->strings + stats->used, name, namelen);
+   stats->strings[stats->used + namelen] = '\0';
+   stats->used += namelen + 1;
+
+   stat->value = stats->used;
+   memcpy(stats->strings + stats->used, value, valuelen);
+   stats->strings[stats->used + valuelen] = '\0';
+   stats->used += valuelen + 1;
+
+   stat->numeric = (parse_int64(value, valuelen, &stat->number) == 0);
+   return 0;
+}
+
+static uint32_t stats_hash(const char *name) {
+   /* FNV-1a */
+   uint32_t hash = 2166136261U;
+   while (*name != '\0') {
+      hash = (hash ^ (unsigned char)*name++) * 16777619U;
+   }
+   return hash;
+}
+
+static int stats_build_index(struct Stats *stats) {
+   size_t size = 16;
+   while (size < (size_t)stats->count * 2) {
+      size *= 2;
+   }
+   if (size > stats->indexsize) {
+      int *index = realloc(stats->index, size * sizeof(int));
+      if (index == NULL) {
+         return -1;
+      }
+      stats->index = index;
+   } else {
+      size = stats->indexsize;
+   }
+   stats->indexsize = size;
+
+   for (int i = 0; i < stats->indexsize; ++i) {
+      stats->index[i] = -1;
+   }
+   for (int i = 0; i < stats->count; ++i) {
+      uint32_t slot = stats_hash(stats->strings + stats->stats[i].name);
+      slot &= stats->indexsize - 1;
+      while (stats->index[slot] != -1) {
+         slot = (slot + 1) & (stats->indexsize - 1);
+      }
+      stats->index[slot] = i;
+   }
+   return 0;
+}
+
+static const struct Stat* stats_find(const struct Stats *stats, const char *name) {
+   if (stats->count == 0) {
+      return NULL;
+   }
+   uint32_t slot = stats_hash(name) & (stats->indexsize - 1);
+   while (stats->index[slot] != -1) {
+      const struct Stat *stat = &stats->stats[stats->index[slot]];
+      if (strcmp(stats->strings + stat->name, name) == 0) {
+         return stat;
+      }
+      slot = (slot + 1) & (stats->indexsize - 1);
+   }
+   return NULL;
+}
+
+struct Stats* libmemc_stats_create(void)
+{
+   return calloc(1, sizeof(struct Stats));
+}
+
+void libmemc_stats_destroy(struct Stats *stats)
+{
+   if (stats != NULL) {
+      free(stats->stats);
+      free(stats->strings);
+      free(stats->index);
+      free(stats);
+   }
+}
+
+int libmemc_stats_count(const struct Stats *stats)
+{
+   return stats->count;
+}
+
+const char* libmemc_stats_name(const struct Stats *stats, int idx)
+{
+   if (idx < 0 || idx >= stats->count) {
+      return NULL;
+   }
+   return stats->strings + stats->stats[idx].name;
+}
+
+const char* libmemc_stats_value(const struct Stats *stats, const char *name)
+{
+   const struct Stat *stat = stats_find(stats, name);
+   return (stat == NULL) ? NULL : stats->strings + stat->value;
+}
+
+int libmemc_stats_int64(const struct Stats *stats, const char *name, int64_t *value)
+{
+   const struct Stat *stat = stats_find(stats, name);
+   if (stat == NULL || !stat->numeric) {
+      return -1;
+   }
+   *value = stat->number;
+   return 0;
+}
+
+/**
+ * Stats requests of the textual protocol
+ */
+static int textual_stats_request(struct Server *server, const char* stats_type)
+{
+   char sendbuffer[256];
+   size_t len = 5;
+   memcpy(sendbuffer, "stats", 5);
+   if (stats_type != NULL) {
+      size_t typelen = strlen(stats_type);
+      if (typelen > sizeof(sendbuffer) - 8) {
+         return server_set_status(server, InvalidArguments);
+      }
+      sendbuffer[len++] = ' ';
+      memcpy(sendbuffer + len, stats_type, typelen);
+      len += typelen;
+   }
+   memcpy(sendbuffer + len, "\r\n", 2);
+   return server_send(server, sendbuffer, len + 2);
+}
+
+/* The lines of the replies to "stats" that are followed by more lines,
+ * until "END". Any other first line (OK, RESET, errors) stands alone */
+static int textual_stats_line(const char *line, size_t len) {
+   return reply_is(line, len, "STAT ") || reply_is(line, len, "ITEM ") ||
+          reply_is(line, len, "PREFIX ");
+}
+
 static char* textual_stats(struct Server *server, const char* stats_type)
 {
-   char sendbuffer [100];
-   if (stats_type != NULL)
-       sprintf(sendbuffer, "stats %s\r\n", stats_type);
-   else
-       sprintf(sendbuffer, "stats\r\n");
+   if (textual_stats_request(server, stats_type) == -1) {
+      return NULL;
+   }
 
-   struct iovec iovec[3];
-   iovec[0].iov_base = sendbuffer;
-   iovec[0].iov_len = strlen(sendbuffer);
-   server_sendv(server, iovec, 1);
-   
-   char* recvbuffer = malloc(8192);
-   size_t nread = server_receive(server, recvbuffer, 8192, 1);
-   recvbuffer[nread] = 0;
+   size_t size = 8192;
+   size_t used = 0;
+   char *recvbuffer = malloc(size);
+   if (recvbuffer == NULL) {
+      server_set_status(server, ClientOutOfMemory);
+      return NULL;
+   }
+
+   struct LineReader reader = { 0, 0 };
+   int lines = 0;
+   while (1) {
+      size_t len;
+      char *line = textual_next_line(server, &reader, &len);
+      if (line == NULL) {
+         free(recvbuffer);
+         return NULL;
+      }
+      if (grow((void**)&recvbuffer, &size, used + len + 3, 1) == -1) {
+         free(recvbuffer);
+         server_set_status(server, ClientOutOfMemory);
+         return NULL;
+      }
+      memcpy(recvbuffer + used, line, len);
+      memcpy(recvbuffer + used + len, "\r\n", 2);
+      used += len + 2;
+
+      if (((len == 3) && (memcmp(line, "END", 3) == 0)) ||
+          ((lines++ == 0) && !textual_stats_line(line, len))) {
+         break;
+      }
+   }
+   recvbuffer[used] = '\0';
 
+   server_set_status(server, Success);
    return recvbuffer;
 }
 
-static char* binary_stats(struct Server *server, const char* stats_type)
+static int textual_stats_table(struct Server *server, const char* stats_type,
+                               struct Stats *stats)
+{
+   if (textual_stats_request(server, stats_type) == -1) {
+      return -1;
+   }
+
+   struct LineReader reader = { 0, 0 };
+   enum Status status = Success;
+   int lines = 0;
+   while (1) {
+      size_t len;
+      char *line = textual_next_line(server, &reader, &len);
+      if (line == NULL) {
+         return -1;
+      }
+      if ((len == 3) && (memcmp(line, "END", 3) == 0)) {
+         break;
+      }
+
+      if (!textual_stats_line(line, len)) {
+         if (lines > 0) {
+            server_set_status(server, ProtocolError);
+            server_disconnect(server);
+            return -1;
+         }
+         /* a reply without stats, like the one to "stats reset" */
+         status = textual_status(line, len);
+         if (status == ProtocolError) {
+            server_disconnect(server);
+         }
+         return server_set_status(server, status);
+      }
+      ++lines;
+
+      /* <keyword> <name> <value> */
+      const char *end = line + len;
+      const char *name = memchr(line, ' ', len) + 1;
+      const char *value = memchr(name, ' ', end - name);
+      size_t namelen = (value == NULL) ? end - name : value - name;
+      value = (value == NULL) ? end : value + 1;
+
+      if ((status == Success) &&
+          (stats_add(stats, name, namelen, value, end - value) == -1)) {
+         /* keep reading to stay in sync with the server */
+         status = ClientOutOfMemory;
+      }
+   }
+
+   return server_set_status(server, status);
+}
+
+/**
+ * Stats requests of the binary protocol
+ */
+static int binary_stats_request(struct Server *server, const char* stats_type)
 {
 #if HAVE_PROTOCOL_BINARY
-   protocol_binary_request_stats request= {.bytes = {0}};
-   request.message.header.request.magic= PROTOCOL_BINARY_REQ;
-   request.message.header.request.opcode= PROTOCOL_BINARY_CMD_STAT;
-   request.message.header.request.datatype= PROTOCOL_BINARY_RAW_BYTES;
+   protocol_binary_request_stats request;
+   binary_header(&request.message.header, PROTOCOL_BINARY_CMD_STAT, 0, 0);
 
+   struct iovec iovec[2];
+   iovec[0].iov_base = (void*)&request;
+   iovec[0].iov_len = sizeof(protocol_binary_request_header);
    if (stats_type != NULL) 
    {
       int len= strlen(stats_type);
-      request.message.header.request.keylen= htons((uint16_t)len);
-      request.message.header.request.bodylen= htonl(len);
-      
-      struct iovec iovec[2];
-      iovec[0].iov_base = (void*)&request;
-      iovec[0].iov_len = sizeof(protocol_binary_request_header);
+      binary_header(&request.message.header, PROTOCOL_BINARY_CMD_STAT, len, 0);
       iovec[1].iov_base = (void*)stats_type;
       iovec[1].iov_len = len;
 
-      server_sendv(server, iovec, 2);
-   } else {
-      struct iovec iovec[1];
-      iovec[0].iov_base = (void*)&request;
-      iovec[0].iov_len = sizeof(protocol_binary_request_header);
+      return server_sendv(server, iovec, 2);
+   }
 
-      server_sendv(server, iovec, 1);
+   return server_sendv(server, iovec, 1);
+#else
+   return server_set_status(server, UnknownCommand);
+#endif
+}
+
+/* Receive the next stat of the stream, whole, into the server buffer.
+ * Returns the length of the key, which is 0 for the packet that
+ * terminates the stats, or -1 */
+static ssize_t binary_stats_receive(struct Server *server, struct BinaryReader *reader,
+                                    struct BinaryFrame *frame)
+{
+#if HAVE_PROTOCOL_BINARY
+   if (binary_next_frame(server, reader, frame, 1) == -1) {
+      return -1;
+   }
+   if (frame->status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+      server_set_status(server, binary_status(htons(frame->status)));
+      server_copy_message(server, frame->body, frame->bodylen);
+      return 0;
    }
 
-   protocol_binary_response_stats response;
+   server_set_status(server, Success);
+   return frame->keylen;
+#else
+   return -1;
+#endif
+}
 
-   size_t keylen;
-   char* retvalue = malloc(8192);
-   memset(retvalue, 0, 8192);
-   char* ptr = retvalue;
-   do {
-      size_t nread = server_receive(server, (char*)response.bytes,
-                                 sizeof(response.bytes), 0);
+static char* binary_stats(struct Server *server, const char* stats_type)
+{
+   if (binary_stats_request(server, stats_type) == -1) {
+      return NULL;
+   }
 
-      if (nread != sizeof(response)) {
-         server->errmsg = strdup("Protocol error");
-         server_disconnect(server);      
+   size_t size = 8192;
+   size_t used = 0;
+   char* retvalue = malloc(size);
+   if (retvalue == NULL) {
+      server_set_status(server, ClientOutOfMemory);
+      return NULL;
+   }
+
+   struct BinaryReader reader = { 0, 0 };
+   struct BinaryFrame frame;
+   ssize_t keylen;
+   while ((keylen = binary_stats_receive(server, &reader, &frame)) > 0) {
+      size_t bodylen = frame.bodylen;
+      if (grow((void**)&retvalue, &size, used + bodylen + 4, 1) == -1) {
+         free(retvalue);
+         server_set_status(server, ClientOutOfMemory);
          return NULL;
       }
+      char *ptr = retvalue + used;
+      memcpy(ptr, frame.body, keylen);
+      ptr[keylen] = ' ';
+      memcpy(ptr + keylen + 1, frame.body + keylen, bodylen - keylen);
+      memcpy(ptr + bodylen + 1, "\r\n", 2);
+      used += bodylen + 3;
+   }
+   if ((keylen == -1) || (binary_reader_done(server, &reader) == -1)) {
+      free(retvalue);
+      return NULL;
+   }
+   retvalue[used] = '\0';
 
-      keylen = ntohs(response.message.header.response.keylen);
-      int bodylen = ntohl(response.message.header.response.bodylen);
-      char *stats = malloc(bodylen);
+   return retvalue;
+}
 
-      struct iovec iovecrecv[1];
-      iovecrecv[0].iov_base = stats;
-      iovecrecv[0].iov_len = bodylen;
-      nread = readv(server->sock, iovecrecv, 1);
+static int binary_stats_table(struct Server *server, const char* stats_type,
+                              struct Stats *stats)
+{
+   if (binary_stats_request(server, stats_type) == -1) {
+      return -1;
+   }
 
-      if (nread < bodylen) {
-         // partial read.. read the rest!
-         size_t left = bodylen - nread;
-         if (server_receive(server, stats + nread, left, 0) != left) {
-            abort();
+   struct BinaryReader reader = { 0, 0 };
+   struct BinaryFrame frame;
+   ssize_t keylen;
+   while ((keylen = binary_stats_receive(server, &reader, &frame)) > 0) {
+      if (stats_add(stats, frame.body, keylen, frame.body + keylen,
+                    frame.bodylen - keylen) == -1) {
+         server_set_status(server, ClientOutOfMemory);
+         /* read the rest of the stats to stay in sync */
+         while ((keylen = binary_stats_receive(server, &reader, &frame)) > 0) {
          }
+         return -1;
       }
+   }
+   if ((keylen == -1) || (binary_reader_done(server, &reader) == -1)) {
+      return -1;
+   }
+
+   return (server->status == Success) ? 0 : -1;
+}
+
+int libmemc_stats_fetch(struct Server *server, enum Protocol protocol,
+                        const char* stats_type, struct Stats *stats)
+{
+   stats->count = 0;
+   stats->used = 0;
+
+   if (server->sock == -1 && server_connect(server) == -1) {
+      return -1;
+   }
+
+   int ret;
+   if (protocol == Textual) {
+      ret = textual_stats_table(server, stats_type, stats);
+   } else {
+      ret = binary_stats_table(server, stats_type, stats);
+   }
+
+   if (stats_build_index(stats) == -1) {
+      stats->count = 0;
+      return server_set_status(server, ClientOutOfMemory);
+   }
+   return ret;
+}
+
+/**
+ * Bulk loading of a memory-mapped corpus file
+ */
+#define CORPUS_BATCH 128
+
+struct CorpusBatch {
+   struct Server *server;
+   int records;
+   ssize_t stored;
+   struct iovec iovec[3 * CORPUS_BATCH + 1];
+#if HAVE_PROTOCOL_BINARY
+   protocol_binary_request_set request[CORPUS_BATCH];
+#endif
+};
 
-      if (keylen > 0) {
-         memcpy(ptr, stats, keylen);
-	     memcpy(ptr + keylen, " ", 1);
-         memcpy(ptr + keylen + 1, stats + keylen, bodylen - keylen);
-	     memcpy(ptr + bodylen + 1, "\r\n", 2);
-	     ptr += bodylen + 3;
+/* The numbers of a record go into 32 bit fields, larger ones are an error */
+static int corpus_number(const char **ptr, const char *end, uint64_t *value) {
+   const char *p = *ptr;
+   uint64_t ret = 0;
+
+   while (p < end && *p == ' ') {
+      ++p;
+   }
+   const char *start = p;
+   while (p < end && *p >= '0' && *p <= '9') {
+      ret = ret * 10 + (*p - '0');
+      if (ret > UINT32_MAX) {
+         return -1;
       }
+      ++p;
+   }
+   if (p == start) {
+      return -1;
+   }
 
-      free(stats);
-   } while (keylen > 0);
+   *ptr = p;
+   *value = ret;
+   return 0;
+}
 
-   return retvalue;
+/* Read the replies for a pipelined batch of textual commands. Returns
+ * the number of replies that differ from the expected one, or -1 */
+static int textual_pipeline_replies(struct Server *server, int count,
+                                    const char *expected) {
+   struct LineReader reader = { 0, 0 };
+   size_t explen = strlen(expected);
+   int failed = 0;
+
+   while (count > 0) {
+      size_t len;
+      char *line = textual_next_line(server, &reader, &len);
+      if (line == NULL) {
+         return -1;
+      }
+      if ((len != explen) || (memcmp(line, expected, explen) != 0)) {
+         ++failed;
+      }
+      --count;
+   }
+
+   return failed;
+}
+
+/* Read the replies for a pipelined batch of quiet binary commands
+ * terminated by a noop. Returns the number of failed commands, or -1 */
+static int binary_pipeline_replies(struct Server *server) {
+#if HAVE_PROTOCOL_BINARY
+   struct BinaryReader reader = { 0, 0 };
+   int failed = 0;
+
+   while (1) {
+      struct BinaryFrame frame;
+      if (binary_next_frame(server, &reader, &frame, 0) == -1) {
+         return -1;
+      }
+
+      if (frame.opcode == PROTOCOL_BINARY_CMD_NOOP) {
+         return (binary_reader_done(server, &reader) == -1) ? -1 : failed;
+      }
+
+      // quiet commands only reply on failure, skip the error message
+      ++failed;
+      if (binary_read_data(server, &reader, NULL,
+                           frame.bodylen - frame.extlen - frame.keylen) == -1) {
+         return -1;
+      }
+   }
 #else
-  return NULL;
+   return -1;
 #endif
 }
+
+static int corpus_flush(struct CorpusBatch *batch, enum Protocol protocol) {
+   struct Server *server = batch->server;
+   int failed;
+
+   if (batch->records == 0) {
+      return 0;
+   }
+
+   if (server->sock == -1) {
+      if (server_connect(server) == -1) {
+         return -1;
+      }
+   }
+
+   if (protocol == Binary) {
+#if HAVE_PROTOCOL_BINARY
+      protocol_binary_request_noop noopreq;
+      binary_header(&noopreq.message.header, PROTOCOL_BINARY_CMD_NOOP, 0, 0);
+
+      int iovcnt = 3 * batch->records;
+      batch->iovec[iovcnt].iov_base = (void*)&noopreq;
+      batch->iovec[iovcnt].iov_len = sizeof(noopreq.bytes);
+      if (server_sendv(server, batch->iovec, iovcnt + 1) == -1) {
+         return -1;
+      }
+      failed = binary_pipeline_replies(server);
+#else
+      return -1;
+#endif
+   } else {
+      if (server_sendv(server, batch->iovec, 2 * batch->records) == -1) {
+         return -1;
+      }
+      failed = textual_pipeline_replies(server, batch->records, "STORED");
+   }
+
+   if ((failed == -1) || (server_zerocopy_wait(server) == -1)) {
+      return -1;
+   }
+
+   batch->stored += batch->records - failed;
+   batch->records = 0;
+   return 0;
+}
+
+static int corpus_add(struct CorpusBatch *batch, enum Protocol protocol,
+                      const char *record, size_t recordlen,
+                      const char *key, uint16_t keylen,
+                      uint32_t flags, uint32_t exptime,
+                      const char *data, size_t size) {
+   int ii = batch->records;
+
+   if (protocol == Binary) {
+#if HAVE_PROTOCOL_BINARY
+      protocol_binary_request_set *request = &batch->request[ii];
+      binary_header(&request->message.header, PROTOCOL_BINARY_CMD_SETQ, keylen, size);
+      request->message.body.flags = htonl(flags);
+      request->message.body.expiration = htonl(exptime);
+
+      batch->iovec[3 * ii].iov_base = (void*)request;
+      batch->iovec[3 * ii].iov_len = sizeof(protocol_binary_request_header) +
+                                     sizeof(request->message.body.flags) +
+                                     sizeof(request->message.body.expiration);
+      batch->iovec[3 * ii + 1].iov_base = (void*)key;
+      batch->iovec[3 * ii + 1].iov_len = keylen;
+      batch->iovec[3 * ii + 2].iov_base = (void*)data;
+      batch->iovec[3 * ii + 2].iov_len = size;
+#else
+      return -1;
+#endif
+   } else {
+      // the corpus record is already a valid "set" command line and body
+      batch->iovec[2 * ii].iov_base = (char*)"set ";
+      batch->iovec[2 * ii].iov_len = 4;
+      batch->iovec[2 * ii + 1].iov_base = (void*)record;
+      batch->iovec[2 * ii + 1].iov_len = recordlen;
+   }
+
+   if (++batch->records == CORPUS_BATCH) {
+      return corpus_flush(batch, protocol);
+   }
+   return 0;
+}
+
+ssize_t libmemc_load_corpus(struct Memcache *handle, const char *filename)
+{
+   if (handle->no_servers == 0) {
+      return -1;
+   }
+
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1) {
+      fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   struct stat st;
+   if (fstat(fd, &st) == -1) {
+      fprintf(stderr, "Failed to stat %s: %s\n", filename, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   if (st.st_size == 0) {
+      close(fd);
+      return 0;
+   }
+
+   char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+#ifdef MADV_SEQUENTIAL
+   (void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+   struct CorpusBatch *batches = calloc(handle->no_servers,
+                                        sizeof(struct CorpusBatch));
+   if (batches == NULL) {
+      munmap(map, st.st_size);
+      return -1;
+   }
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      batches[ii].server = handle->servers[ii];
+   }
+
+   const char *ptr = map;
+   const char *end = map + st.st_size;
+   int error = 0;
+
+   while (ptr < end && !error) {
+      // <key> <flags> <exptime> <bytes>\r\n<data>\r\n
+      const char *record = ptr;
+      const char *key = ptr;
+      while (ptr < end && *ptr != ' ') {
+         ++ptr;
+      }
+      size_t keylen = ptr - key;
+
+      uint64_t flags, exptime, size;
+      if ((keylen == 0) || (keylen > 250) ||
+          (corpus_number(&ptr, end, &flags) == -1) ||
+          (corpus_number(&ptr, end, &exptime) == -1) ||
+          (corpus_number(&ptr, end, &size) == -1) ||
+          (end - ptr < 4) || (memcmp(ptr, "\r\n", 2) != 0) ||
+          (size > (uint64_t)(end - ptr) - 4) ||
+          (memcmp(ptr + 2 + size, "\r\n", 2) != 0)) {
+         fprintf(stderr, "Corpus format error in %s at offset %ld\n",
+                 filename, (long)(record - map));
+         error = 1;
+         break;
+      }
+      const char *data = ptr + 2;
+      ptr = data + size + 2;
+
+      char keybuf[251];
+      memcpy(keybuf, key, keylen);
+      keybuf[keylen] = '\0';
+      struct CorpusBatch *batch = &batches[get_server_index(handle, keybuf)];
+
+      if (corpus_add(batch, handle->protocol, record, ptr - record,
+                     key, keylen, flags, exptime, data, size) == -1) {
+         error = 1;
+      }
+   }
+
+   ssize_t ret = 0;
+   for (int ii = 0; ii < handle->no_servers; ++ii) {
+      if (!error && corpus_flush(&batches[ii], handle->protocol) == -1) {
+         error = 1;
+      }
+      ret += batches[ii].stored;
+   }
+
+   free(batches);
+   munmap(map, st.st_size);
+   return error ? -1 : ret;
+}
+
+/**
+ * UDP transport
+ */
+#define UDP_HEADER_SIZE 8
+#define UDP_MAX_DATAGRAM 9216    /* a jumbo frame; memcached sends 1400 */
+#define UDP_WINDOW 256           /* requests in flight, a power of two */
+#define UDP_BATCH 32             /* datagrams per sendmmsg/recvmmsg */
+
+struct UdpFragment {
+   size_t offset;     /* in UdpRequest::data */
+   size_t length;
+   int received;
+};
+
+struct UdpRequest {
+   struct Item *item;
+   int busy;
+   uint16_t id;
+   unsigned char header[UDP_HEADER_SIZE];
+   int attempts;
+   uint64_t sent;       /* when the request was sent, in usec */
+   uint16_t packets;    /* 0 until the first packet arrives */
+   uint16_t received;
+   struct UdpFragment *fragments;
+   int fragmentsize;
+   char *data;          /* the fragments in arrival order */
+   size_t used;
+   size_t size;
+};
+
+struct UdpClient {
+   int sock;
+   uint16_t next_id;
+   int timeout;         /* msec before a request is sent again */
+   int retries;
+   int inflight;
+   struct UdpRequest requests[UDP_WINDOW];
+   /* requests waiting for the next sendmmsg */
+   struct UdpRequest *pending[UDP_BATCH];
+   int npending;
+   char *recvbuf;
+   char *reply;         /* a reassembled reply */
+   size_t replysize;
+   struct UdpCounters counters;
+};
+
+struct UdpClient* libmemc_udp_create(const char *host, in_port_t port)
+{
+   struct addrinfo *ai = lookuphost(host, port, SOCK_DGRAM);
+   if (ai == NULL) {
+      return NULL;
+   }
+
+   struct UdpClient *client = calloc(1, sizeof(struct UdpClient));
+   if (client == NULL) {
+      freeaddrinfo(ai);
+      return NULL;
+   }
+   client->timeout = 1000;
+   client->retries = 2;
+   client->recvbuf = malloc(UDP_BATCH * UDP_MAX_DATAGRAM);
+   client->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+   if ((client->recvbuf == NULL) || (client->sock == -1) ||
+       (connect(client->sock, ai->ai_addr, ai->ai_addrlen) == -1)) {
+      fprintf(stderr, "Failed to connect UDP socket: %s\n", strerror(errno));
+      freeaddrinfo(ai);
+      libmemc_udp_destroy(client);
+      return NULL;
+   }
+   freeaddrinfo(ai);
+
+   /* a flood of replies must not overflow the socket buffer */
+   int rcvbuf = 4 * 1024 * 1024;
+   (void)setsockopt(client->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   return client;
+}
+
+void libmemc_udp_destroy(struct UdpClient *client)
+{
+   if (client != NULL) {
+      if (client->sock != -1) {
+         (void)close(client->sock);
+      }
+      for (int ii = 0; ii < UDP_WINDOW; ++ii) {
+         free(client->requests[ii].fragments);
+         free(client->requests[ii].data);
+      }
+      free(client->recvbuf);
+      free(client->reply);
+      free(client);
+   }
+}
+
+void libmemc_udp_set_timeout(struct UdpClient *client, int msec, int retries)
+{
+   client->timeout = msec;
+   client->retries = retries;
+}
+
+void libmemc_udp_get_counters(struct UdpClient *client, struct UdpCounters *counters)
+{
+   *counters = client->counters;
+}
+
+static void udp_finish(struct UdpClient *client, struct UdpRequest *request,
+                       enum Status status) {
+   request->item->status = status;
+   request->item->errmsg = status_messages[status];
+   request->busy = 0;
+   request->item = NULL;
+   --client->inflight;
+}
+
+static int udp_send_pending(struct UdpClient *client) {
+   struct iovec iov[UDP_BATCH][4];
+   int sent = 0;
+
+   for (int ii = 0; ii < client->npending; ++ii) {
+      struct UdpRequest *request = client->pending[ii];
+      iov[ii][0].iov_base = request->header;
+      iov[ii][0].iov_len = UDP_HEADER_SIZE;
+      iov[ii][1].iov_base = (char*)"gets ";
+      iov[ii][1].iov_len = 5;
+      iov[ii][2].iov_base = (char*)request->item->key;
+      iov[ii][2].iov_len = request->item->keylen;
+      iov[ii][3].iov_base = (char*)"\r\n";
+      iov[ii][3].iov_len = 2;
+   }
+
+#ifdef __linux__
+   struct mmsghdr msgs[UDP_BATCH];
+   memset(msgs, 0, sizeof(msgs));
+   for (int ii = 0; ii < client->npending; ++ii) {
+      msgs[ii].msg_hdr.msg_iov = iov[ii];
+      msgs[ii].msg_hdr.msg_iovlen = 4;
+   }
+   while (sent < client->npending) {
+      int ret = sendmmsg(client->sock, msgs + sent, client->npending - sent, 0);
+      if (ret == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         break;
+      }
+      sent += ret;
+   }
+#else
+   for (; sent < client->npending; ++sent) {
+      struct msghdr msg = { .msg_iov = iov[sent], .msg_iovlen = 4 };
+      if (sendmsg(client->sock, &msg, 0) == -1) {
+         break;
+      }
+   }
+#endif
+   client->counters.requests += sent;
+
+   /* whatever we failed to send is lost, and the timeout resends it */
+   client->npending = 0;
+   return 0;
+}
+
+/* Send a request for the item with a request id that isn't in flight */
+static int udp_start(struct UdpClient *client, struct Item *item, int attempts) {
+   struct UdpRequest *request;
+   while (client->requests[client->next_id & (UDP_WINDOW - 1)].busy) {
+      ++client->next_id;
+   }
+   request = &client->requests[client->next_id & (UDP_WINDOW - 1)];
+   request->id = client->next_id++;
+   request->busy = 1;
+   request->item = item;
+   request->attempts = attempts;
+   request->packets = 0;
+   request->received = 0;
+   request->used = 0;
+   request->sent = now_usec();
+
+   uint16_t header[4] = { htons(request->id), htons(0), htons(1), htons(0) };
+   memcpy(request->header, header, UDP_HEADER_SIZE);
+   ++client->inflight;
+
+   client->pending[client->npending++] = request;
+   if (client->npending == UDP_BATCH) {
+      return udp_send_pending(client);
+   }
+   return 0;
+}
+
+/* Parse a reassembled reply to "gets <key>" */
+static enum Status udp_parse_reply(struct Item *item, char *reply, size_t len) {
+   if (reply_is(reply, len, "VALUE ")) {
+      uint32_t flags;
+      size_t size;
+      uint64_t cas_id;
+      char *data;
+      reply[len] = '\0';
+      if ((parse_value_line(reply + 6, &flags, &size, &cas_id, &data) == -1) ||
+          ((size_t)(reply + len - data) != size + 7) ||
+          (memcmp(data + size, "\r\nEND\r\n", 7) != 0)) {
+         return ProtocolError;
+      }
+      if (item_reserve(item, size) == -1) {
+         return ClientOutOfMemory;
+      }
+      memcpy(item->data, data, size);
+      item->flags = flags;
+      item->cas_id = cas_id;
+      return Success;
+   }
+
+   char *eol = memchr(reply, '\n', len);
+   if ((eol == NULL) || (eol == reply) || (eol[-1] != '\r')) {
+      return ProtocolError;
+   }
+   return textual_status(reply, (eol - 1) - reply);
+}
+
+static void udp_complete(struct UdpClient *client, struct UdpRequest *request) {
+   if (client->replysize < request->used + 1) {
+      char *reply = realloc(client->reply, request->used + 1);
+      if (reply == NULL) {
+         udp_finish(client, request, ClientOutOfMemory);
+         return;
+      }
+      client->reply = reply;
+      client->replysize = request->used + 1;
+   }
+
+   size_t len = 0;
+   for (int ii = 0; ii < request->packets; ++ii) {
+      struct UdpFragment *fragment = &request->fragments[ii];
+      memcpy(client->reply + len, request->data + fragment->offset, fragment->length);
+      len += fragment->length;
+   }
+
+   client->counters.replies++;
+   client->counters.latency += now_usec() - request->sent;
+   udp_finish(client, request, udp_parse_reply(request->item, client->reply, len));
+}
+
+static void udp_receive_packet(struct UdpClient *client, const char *packet, size_t len) {
+   uint16_t header[4];
+   if (len < UDP_HEADER_SIZE) {
+      return;
+   }
+   memcpy(header, packet, UDP_HEADER_SIZE);
+   uint16_t id = ntohs(header[0]);
+   uint16_t seq = ntohs(header[1]);
+   uint16_t packets = ntohs(header[2]);
+
+   client->counters.packets++;
+   struct UdpRequest *request = &client->requests[id & (UDP_WINDOW - 1)];
+   if (!request->busy || (request->id != id) || (seq >= packets) ||
+       ((request->packets != 0) && (request->packets != packets))) {
+      /* a late reply to a request we have given up on */
+      client->counters.stray++;
+      return;
+   }
+
+   if (request->packets == 0) {
+      if (request->fragmentsize < packets) {
+         struct UdpFragment *fragments = realloc(request->fragments,
+                                                 packets * sizeof(struct UdpFragment));
+         if (fragments == NULL) {
+            udp_finish(client, request, ClientOutOfMemory);
+            return;
+         }
+         request->fragments = fragments;
+         request->fragmentsize = packets;
+      }
+      memset(request->fragments, 0, packets * sizeof(struct UdpFragment));
+      request->packets = packets;
+   }
+
+   struct UdpFragment *fragment = &request->fragments[seq];
+   if (fragment->received) {
+      client->counters.stray++;
+      return;
+   }
+
+   len -= UDP_HEADER_SIZE;
+   if (request->used + len > request->size) {
+      size_t size = (request->size == 0) ? 2048 : request->size;
+      while (size < request->used + len) {
+         size *= 2;
+      }
+      char *data = realloc(request->data, size);
+      if (data == NULL) {
+         udp_finish(client, request, ClientOutOfMemory);
+         return;
+      }
+      request->data = data;
+      request->size = size;
+   }
+   memcpy(request->data + request->used, packet + UDP_HEADER_SIZE, len);
+   fragment->offset = request->used;
+   fragment->length = len;
+   fragment->received = 1;
+   request->used += len;
+
+   if (++request->received == request->packets) {
+      udp_complete(client, request);
+   }
+}
+
+/* Read every datagram that is waiting on the socket */
+static int udp_receive(struct UdpClient *client) {
+#ifdef __linux__
+   struct mmsghdr msgs[UDP_BATCH];
+   struct iovec iov[UDP_BATCH];
+   for (int ii = 0; ii < UDP_BATCH; ++ii) {
+      iov[ii].iov_base = client->recvbuf + ii * UDP_MAX_DATAGRAM;
+      iov[ii].iov_len = UDP_MAX_DATAGRAM;
+   }
+
+   while (1) {
+      memset(msgs, 0, sizeof(msgs));
+      for (int ii = 0; ii < UDP_BATCH; ++ii) {
+         msgs[ii].msg_hdr.msg_iov = &iov[ii];
+         msgs[ii].msg_hdr.msg_iovlen = 1;
+      }
+      int ret = recvmmsg(client->sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+      if (ret == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) ? 0 : -1;
+      }
+      for (int ii = 0; ii < ret; ++ii) {
+         if (!(msgs[ii].msg_hdr.msg_flags & MSG_TRUNC)) {
+            udp_receive_packet(client, iov[ii].iov_base, msgs[ii].msg_len);
+         }
+      }
+      if (ret < UDP_BATCH) {
+         return 0;
+      }
+   }
+#else
+   while (1) {
+      ssize_t len = recv(client->sock, client->recvbuf, UDP_MAX_DATAGRAM, MSG_DONTWAIT);
+      if (len == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) ? 0 : -1;
+      }
+      udp_receive_packet(client, client->recvbuf, len);
+   }
+#endif
+}
+
+/* Send the requests that timed out again, or give up on them */
+static int udp_expire(struct UdpClient *client, uint64_t now) {
+   for (int ii = 0; ii < UDP_WINDOW; ++ii) {
+      struct UdpRequest *request = &client->requests[ii];
+      if (!request->busy || (request->sent + client->timeout * 1000ULL > now)) {
+         continue;
+      }
+
+      client->counters.timeouts++;
+      client->counters.lost += (request->packets == 0) ? 1 : request->packets - request->received;
+      struct Item *item = request->item;
+      int attempts = request->attempts;
+      udp_finish(client, request, Timeout);
+      if (attempts <= client->retries) {
+         client->counters.retries++;
+         if (udp_start(client, item, attempts + 1) == -1) {
+            return -1;
+         }
+      }
+   }
+   return 0;
+}
+
+int libmemc_udp_gets(struct UdpClient *client, struct Item item[], int items)
+{
+   int next = 0;
+
+   while ((next < items) || (client->inflight > 0)) {
+      while ((next < items) && (client->inflight < UDP_WINDOW)) {
+         item[next].status = Timeout;
+         if (udp_start(client, &item[next++], 1) == -1) {
+            return -1;
+         }
+      }
+      if (client->npending > 0 && udp_send_pending(client) == -1) {
+         return -1;
+      }
+
+      /* wait for the oldest request to time out at the most */
+      uint64_t now = now_usec();
+      uint64_t oldest = now;
+      for (int ii = 0; ii < UDP_WINDOW; ++ii) {
+         if (client->requests[ii].busy && client->requests[ii].sent < oldest) {
+            oldest = client->requests[ii].sent;
+         }
+      }
+      int64_t wait = (int64_t)(oldest + client->timeout * 1000ULL - now) / 1000;
+      struct pollfd pfd = { .fd = client->sock, .events = POLLIN };
+      int ret = poll(&pfd, 1, (wait > 0) ? (int)wait + 1 : 0);
+      if (ret == -1 && errno != EINTR) {
+         return -1;
+      }
+      if ((ret > 0) && (udp_receive(client) == -1)) {
+         return -1;
+      }
+      if (udp_expire(client, now_usec()) == -1) {
+         return -1;
+      }
+   }
+
+   for (int ii = 0; ii < items; ++ii) {
+      if ((item[ii].status != Success) && (item[ii].status != NotFound)) {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/**
+ * Hedged gets
+ */
+#define HEDGE_BUCKETS 256
+#define HEDGE_WINDOW 256
+
+/* The latencies of recent gets in usec, in buckets of a quarter of a
+ * power of two. The deadline is updated every HEDGE_WINDOW gets */
+struct Hedging {
+   double percentile;
+   uint64_t min_delay;
+   uint64_t deadline;       /* 0 until there are enough samples */
+   uint32_t samples;
+   uint32_t buckets[HEDGE_BUCKETS];
+   uint64_t hedged;
+   uint64_t won;
+};
+
+static int hedge_bucket(uint64_t usec) {
+   if (usec < 4) {
+      return usec;
+   }
+   int msb = 2;
+   while ((usec >> (msb + 1)) != 0) {
+      ++msb;
+   }
+   return msb * 4 + ((usec >> (msb - 2)) & 3);
+}
+
+static uint64_t hedge_bucket_value(int index) {
+   if (index < 4) {
+      return index;
+   }
+   return (uint64_t)(4 + index % 4) << (index / 4 - 2);
+}
+
+static void hedge_record(struct Hedging *hedging, uint64_t usec) {
+   ++hedging->buckets[hedge_bucket(usec)];
+   if (++hedging->samples % HEDGE_WINDOW != 0) {
+      return;
+   }
+
+   uint64_t total = 0;
+   for (int ii = 0; ii < HEDGE_BUCKETS; ++ii) {
+      total += hedging->buckets[ii];
+   }
+   uint64_t rank = total * hedging->percentile / 100;
+   uint64_t seen = 0;
+   for (int ii = 0; ii < HEDGE_BUCKETS - 1; ++ii) {
+      uint64_t count = hedging->buckets[ii];
+      if (seen + count > rank) {
+         /* interpolate within the bucket */
+         uint64_t lower = hedge_bucket_value(ii);
+         uint64_t upper = hedge_bucket_value(ii + 1);
+         hedging->deadline = lower + (upper - lower) * (rank - seen) / count;
+         break;
+      }
+      seen += count;
+   }
+   if (hedging->deadline < hedging->min_delay) {
+      hedging->deadline = hedging->min_delay;
+   }
+
+   /* age the samples, so that the deadline follows the servers */
+   for (int ii = 0; ii < HEDGE_BUCKETS; ++ii) {
+      hedging->buckets[ii] /= 2;
+   }
+}
+
+/* Wait for a reply for up to usec, or for as long as it takes if < 0 */
+static int hedge_wait(struct pollfd *pfd, int nfds, int64_t usec) {
+   int ret;
+   do {
+#ifdef __linux__
+      struct timespec ts = { .tv_sec = usec / 1000000,
+                             .tv_nsec = (usec % 1000000) * 1000 };
+      ret = ppoll(pfd, nfds, (usec < 0) ? NULL : &ts, NULL);
+#else
+      ret = poll(pfd, nfds, (usec < 0) ? -1 : (int)((usec + 999) / 1000));
+#endif
+   } while ((ret == -1) && (errno == EINTR));
+   return ret;
+}
+
+/* The second connection to the server, that a slow get is sent again on */
+static struct Server *server_hedge(struct Server *server) {
+   if (server->hedge == NULL) {
+      struct Server *hedge = server_init(server->addrinfo, server->peername);
+      if (hedge == NULL) {
+         return NULL;
+      }
+      hedge->primary = server;
+      hedge->connect_timeout = server->connect_timeout;
+      hedge->read_timeout = server->read_timeout;
+      hedge->write_timeout = server->write_timeout;
+      server->hedge = hedge;
+   }
+   if ((server->hedge->sock == -1) && (server_connect(server->hedge) == -1)) {
+      return NULL;
+   }
+   return server->hedge;
+}
+
+/* Read and throw away the replies to the gets that lost a hedge, before
+ * the next request goes out on the connection. That request may be in
+ * the server buffer already, so they are read into a buffer of their own */
+static int server_drain(struct Server *server) {
+   char buffer[512];
+   while (server->owed > 0) {
+      size_t discard = 0;
+      if (server_receive(server, buffer, 1, 0) != 1) {
+         return -1;
+      }
+#if HAVE_PROTOCOL_BINARY
+      if ((uint8_t)buffer[0] == PROTOCOL_BINARY_RES) {
+         protocol_binary_response_header response;
+         response.bytes[0] = buffer[0];
+         if (server_receive(server, (char*)response.bytes + 1,
+                            sizeof(response.bytes) - 1, 0) != sizeof(response.bytes) - 1) {
+            return -1;
+         }
+         discard = ntohl(response.response.bodylen);
+         --server->owed;
+      } else
+#endif
+      {
+         /* a line at a time, so that nothing past the reply is read */
+         size_t len = 1;
+         while ((len < 2) || (buffer[len - 2] != '\r') || (buffer[len - 1] != '\n')) {
+            if (len == sizeof(buffer) - 1) {
+               server_set_status(server, ProtocolError);
+               server_disconnect(server);
+               return -1;
+            }
+            if (server_receive(server, buffer + len, 1, 0) != 1) {
+               return -1;
+            }
+            ++len;
+         }
+         buffer[len] = '\0';
+
+         uint32_t flags;
+         uint64_t cas_id;
+         char *data;
+         if ((len == 5) && (memcmp(buffer, "END\r\n", 5) == 0)) {
+            --server->owed;
+         } else if ((len > 6) && (memcmp(buffer, "VALUE ", 6) == 0) &&
+                    (parse_value_line(buffer + 6, &flags, &discard, &cas_id, &data) == 0)) {
+            discard += 2;
+         } else {
+            server_set_status(server, ProtocolError);
+            server_disconnect(server);
+            return -1;
+         }
+      }
+
+      while (discard > 0) {
+         size_t chunk = (discard > sizeof(buffer)) ? sizeof(buffer) : discard;
+         if (server_receive(server, buffer, chunk, 0) != chunk) {
+            return -1;
+         }
+         discard -= chunk;
+      }
+   }
+   return 0;
+}
+
+static int get_request(enum Protocol protocol, struct Server* server, struct Item* item) {
+   if (protocol == Binary) {
+      return binary_get_request(server, item);
+   } else {
+      return textual_get_request(server, item);
+   }
+}
+
+static int get_reply(enum Protocol protocol, struct Server* server, struct Item* item) {
+   if (protocol == Binary) {
+      return binary_get_reply(server, item);
+   } else {
+      return textual_get_reply(server, item);
+   }
+}
+
+/* Send a get that is slow to answer again, to the alternate server if
+ * there is one and else over a second connection to the same server */
+static int hedged_get(struct Memcache *handle, struct Server* server,
+                      struct Server* alternate, struct Item* item) {
+   struct Hedging *hedging = handle->hedging;
+   uint64_t start = now_usec();
+   if (get_request(handle->protocol, server, item) == -1) {
+      return item_set_status(item, server, -1);
+   }
+
+   struct pollfd pfd[2] = { { .fd = server->sock, .events = POLLIN },
+                            { .fd = -1, .events = POLLIN } };
+   /* the deadline counts from before the request went out, and is
+    * compared with the time until the reply starts to arrive */
+   struct Server *hedge = NULL;
+   uint64_t elapsed = now_usec() - start;
+   int64_t wait = (elapsed < hedging->deadline) ? hedging->deadline - elapsed : 0;
+   int ready = hedge_wait(pfd, 1, (hedging->deadline > 0) ? wait : -1);
+   uint64_t latency = now_usec() - start;
+   if (ready == 0) {
+      if (alternate == NULL) {
+         hedge = server_hedge(server);
+      } else if ((alternate->sock != -1) || (server_connect(alternate) == 0)) {
+         hedge = alternate;
+      }
+      if ((hedge != NULL) && (get_request(handle->protocol, hedge, item) == -1)) {
+         hedge = NULL;
+      }
+   }
+
+   struct Server *winner = server;
+   if (hedge != NULL) {
+      ++hedging->hedged;
+      pfd[1].fd = hedge->sock;
+      ready = hedge_wait(pfd, 2, (server->read_timeout > 0) ?
+                         server->read_timeout * 1000LL : -1);
+      latency = now_usec() - start;
+      if (ready == 0) {
+         ++hedge->owed;
+         server_set_status(server, Timeout);
+         server_disconnect(server);
+         return item_set_status(item, server, -1);
+      }
+      /* the primary wins a tie. The reply of the loser is read before
+       * its next request, so that its connection is kept */
+      if ((pfd[0].revents == 0) && (pfd[1].revents != 0)) {
+         winner = hedge;
+         ++hedging->won;
+         ++server->owed;
+      } else {
+         ++hedge->owed;
+      }
+   }
+
+   int ret = get_reply(handle->protocol, winner, item);
+   if ((ret == 0) || (winner->status == NotFound)) {
+      hedge_record(hedging, latency);
+   }
+   return item_set_status(item, winner, ret);
+}
+
+int libmemc_set_hedging(struct Memcache *handle, double percentile, int min_usec) {
+   if ((percentile < 0) || (percentile >= 100) || (min_usec < 0)) {
+      return -1;
+   }
+   if (percentile == 0) {
+      free(handle->hedging);
+      handle->hedging = NULL;
+      return 0;
+   }
+   if (handle->hedging == NULL) {
+      handle->hedging = calloc(1, sizeof(struct Hedging));
+      if (handle->hedging == NULL) {
+         return -1;
+      }
+   }
+   handle->hedging->percentile = percentile;
+   handle->hedging->min_delay = min_usec;
+   return 0;
+}
+
+void libmemc_hedge_counters(struct Memcache *handle, uint64_t *hedged, uint64_t *won) {
+   *hedged = (handle->hedging != NULL) ? handle->hedging->hedged : 0;
+   *won = (handle->hedging != NULL) ? handle->hedging->won : 0;
+}
+
+/**
+ * Replication
+ */
+#define MAX_REPLICAS 8
+#define REPLICA_PROBE 64
+
+/* The live servers that a key is stored on: the one it hashes to and the
+ * ones after it. A dead server is skipped, so there are still as many
+ * copies while it restarts */
+static int get_replicas(struct Memcache *handle, const char *key,
+                        struct Server **replicas) {
+   if (handle->no_servers == 0) {
+      return 0;
+   }
+   int first = get_server_index(handle, key);
+   int count = 0;
+   for (int ii = 0; (ii < handle->no_servers) && (count < handle->replicas); ++ii) {
+      struct Server *server = handle->servers[(first + ii) % handle->no_servers];
+      if (!server_dead(server)) {
+         replicas[count++] = server;
+      }
+   }
+   return count;
+}
+
+static int write_request(enum Protocol protocol, struct Server* server,
+                         enum StoreCommand cmd, int delete, struct Item* item) {
+   if ((server->sock == -1) && (server_connect(server) == -1)) {
+      return -1;
+   }
+   if (protocol == Binary) {
+      return delete ? binary_delete_request(server, item) :
+         binary_store_request(server, cmd, item);
+   } else {
+      return delete ? textual_delete_request(server, item) :
+         textual_store_request(server, cmd, item);
+   }
+}
+
+static int write_reply(enum Protocol protocol, struct Server* server, int delete) {
+   int ret;
+   if (protocol == Binary) {
+      ret = delete ? binary_delete_reply(server) : binary_store_reply(server);
+   } else {
+      ret = delete ? textual_delete_reply(server) : textual_reply(server);
+   }
+   if ((server->zerocopy_done != server->zerocopy_sent) &&
+       (server_zerocopy_wait(server) == -1)) {
+      ret = -1;
+   }
+   return ret;
+}
+
+/* Send the write to all the replicas before reading any of the replies,
+ * so it takes a single round trip. The item gets the reply of the first
+ * replica that took the write, or else the one of the first replica */
+static int replicated_write(struct Memcache *handle, struct Server **replicas,
+                            int count, enum StoreCommand cmd, int delete,
+                            struct Item *item) {
+   int ret[MAX_REPLICAS];
+   for (int ii = 0; ii < count; ++ii) {
+      ret[ii] = write_request(handle->protocol, replicas[ii], cmd, delete, item);
+   }
+
+   int winner = -1;
+   for (int ii = 0; ii < count; ++ii) {
+      if (ret[ii] == 0) {
+         ret[ii] = write_reply(handle->protocol, replicas[ii], delete);
+      }
+      if ((winner == -1) && (ret[ii] == 0)) {
+         winner = ii;
+      }
+   }
+   if (winner == -1) {
+      winner = 0;
+   }
+   return item_set_status(item, replicas[winner], ret[winner]);
+}
+
+static int replicated_store(struct Memcache* handle, enum StoreCommand cmd,
+                            struct Item *item) {
+   struct Server *replicas[MAX_REPLICAS];
+   int count = get_replicas(handle, item->key, replicas);
+   if (count == 0) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
+      return -1;
+   }
+   if (cmd != cas) {
+      return replicated_write(handle, replicas, count, cmd, 0, item);
+   }
+
+   /* every replica has cas ids of its own, so the first one checks it and
+    * the others get the value that it took */
+   int ret = replicated_write(handle, replicas, 1, cas, 0, item);
+   if ((ret == 0) && (count > 1)) {
+      struct Item copy = *item;
+      copy.cas_id = 0;
+      (void)replicated_write(handle, replicas + 1, count - 1, set, 0, &copy);
+   }
+   return ret;
+}
+
+static int replicated_delete(struct Memcache* handle, struct Item *item) {
+   struct Server *replicas[MAX_REPLICAS];
+   int count = get_replicas(handle, item->key, replicas);
+   if (count == 0) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
+      return -1;
+   }
+   return replicated_write(handle, replicas, count, set, 1, item);
+}
+
+/* The counters change on one replica after the other, the first one last,
+ * so that the item ends up with its value */
+static int replicated_incr_decr(struct Memcache* handle, enum IncrDecrCommand cmd,
+                                struct Item *item, uint64_t delta) {
+   struct Server *replicas[MAX_REPLICAS];
+   int count = get_replicas(handle, item->key, replicas);
+   if (count == 0) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
+      return -1;
+   }
+
+   int ret = -1;
+   for (int ii = count - 1; ii >= 0; --ii) {
+      struct Server *server = replicas[ii];
+      if ((server->sock == -1) && (server_connect(server) == -1)) {
+         ret = item_set_status(item, server, -1);
+      } else if (handle->protocol == Binary) {
+         ret = item_set_status(item, server, binary_incr_decr(server, cmd, item, delta));
+      } else {
+         ret = item_set_status(item, server, textual_incr_decr(server, cmd, item, delta));
+      }
+   }
+   return ret;
+}
+
+/* Read from the replica with the lowest average latency. Every
+ * REPLICA_PROBE-th get goes to the others in turn instead, to keep their
+ * averages current. A miss falls back to the other replicas, since one
+ * that just restarted has lost its items */
+static int replicated_get(struct Memcache* handle, struct Item *item) {
+   struct Server *replicas[MAX_REPLICAS];
+   int count = get_replicas(handle, item->key, replicas);
+   if (count == 0) {
+      item->status = ConnectionError;
+      item->errmsg = "No server available";
+      return -1;
+   }
+
+   int first = 0;
+   if (++handle->reads % REPLICA_PROBE == 0) {
+      first = (handle->reads / REPLICA_PROBE) % count;
+   } else {
+      for (int ii = 1; ii < count; ++ii) {
+         if (replicas[ii]->latency < replicas[first]->latency) {
+            first = ii;
+         }
+      }
+   }
+
+   int ret = -1;
+   for (int ii = 0; ii < count; ++ii) {
+      struct Server *server = replicas[(first + ii) % count];
+      if ((server->sock == -1) && (server_connect(server) == -1)) {
+         ret = item_set_status(item, server, -1);
+         continue;
+      }
+
+      uint64_t start = now_usec();
+      if (handle->hedging != NULL) {
+         struct Server *alternate = (count > 1) ?
+            replicas[(first + ii + 1) % count] : NULL;
+         ret = hedged_get(handle, server, alternate, item);
+      } else if (handle->protocol == Binary) {
+         ret = item_set_status(item, server, binary_get(server, item));
+      } else {
+         ret = item_set_status(item, server, textual_get(server, item));
+      }
+      if ((ret == 0) || (item->status == NotFound)) {
+         uint64_t usec = now_usec() - start;
+         server->latency = (server->latency == 0) ? usec :
+            (server->latency * 7 + usec) / 8;
+      }
+      if (ret == 0) {
+         break;
+      }
+   }
+   return ret;
+}
+
+int libmemc_set_replicas(struct Memcache *handle, int replicas) {
+   if ((replicas < 1) || (replicas > MAX_REPLICAS)) {
+      return -1;
+   }
+   handle->replicas = replicas;
+   return 0;
+}
+
+/**
+ * Near cache
+ */
+#define NEAR_SHARDS 16
+#define MAX_RELATIVE_EXPTIME (60 * 60 * 24 * 30)
+
+struct NearEntry {
+   struct NearEntry *next;  /* in the bucket */
+   uint32_t hash;
+   int slot;                /* on the clock */
+   int referenced;          /* since the hand last came by */
+   uint32_t flags;
+   uint64_t cas_id;         /* 0 if stored by us and not read back yet */
+   uint64_t expires;        /* ms, 0 if the item does not expire */
+   uint64_t validated;      /* ms, 0 if it has to be read again */
+   size_t size;
+   int keylen;
+   char key[];              /* followed by the value */
+};
+
+/* Every shard has a lock of its own, a chained hash table and a CLOCK of
+ * the entries it holds. The hand clears the referenced bit of the entries
+ * it passes, and evicts the first entry that was not used since */
+struct NearShard {
+   pthread_mutex_t lock;
+   struct NearEntry **buckets;
+   struct NearEntry **clock;
+   uint32_t mask;           /* of the buckets */
+   int capacity;            /* of the clock */
+   int hand;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t revalidations;
+};
+
+struct NearCache {
+   int ttl;
+   size_t max_value;
+   struct NearShard shard[NEAR_SHARDS];
+};
+
+static uint32_t near_hash(const char *key, int keylen) {
+   uint32_t hash = 2166136261u;
+   for (int ii = 0; ii < keylen; ++ii) {
+      hash = (hash ^ (unsigned char)key[ii]) * 16777619u;
+   }
+   return hash;
+}
+
+static struct NearShard *near_shard(struct NearCache *cache, uint32_t hash) {
+   return &cache->shard[hash >> 28];
+}
+
+static struct NearEntry *near_find(struct NearShard *shard, uint32_t hash,
+                                   const char *key, int keylen) {
+   struct NearEntry *entry = shard->buckets[hash & shard->mask];
+   while ((entry != NULL) && ((entry->hash != hash) || (entry->keylen != keylen) ||
+                              (memcmp(entry->key, key, keylen) != 0))) {
+      entry = entry->next;
+   }
+   return entry;
+}
+
+static void near_remove(struct NearShard *shard, struct NearEntry *entry) {
+   struct NearEntry **prev = &shard->buckets[entry->hash & shard->mask];
+   while (*prev != entry) {
+      prev = &(*prev)->next;
+   }
+   *prev = entry->next;
+   shard->clock[entry->slot] = NULL;
+   free(entry);
+}
+
+/* A free slot on the clock, made by evicting an entry if need be */
+static int near_slot(struct NearShard *shard) {
+   for (;;) {
+      int slot = shard->hand;
+      shard->hand = (shard->hand + 1) % shard->capacity;
+      struct NearEntry *entry = shard->clock[slot];
+      if (entry == NULL) {
+         return slot;
+      }
+      if (entry->referenced) {
+         entry->referenced = 0;
+      } else {
+         near_remove(shard, entry);
+         return slot;
+      }
+   }
+}
+
+/* Replace the entry of the item with its current value */
+static void near_insert(struct NearShard *shard, uint32_t hash, const struct Item *item,
+                        uint64_t expires, uint64_t validated) {
+   struct NearEntry *entry = near_find(shard, hash, item->key, item->keylen);
+   if (entry != NULL) {
+      near_remove(shard, entry);
+   }
+   entry = malloc(sizeof(*entry) + item->keylen + item->size);
+   if (entry == NULL) {
+      return;
+   }
+   entry->hash = hash;
+   entry->slot = near_slot(shard);
+   entry->referenced = 0;
+   entry->flags = item->flags;
+   entry->cas_id = item->cas_id;
+   entry->expires = expires;
+   entry->validated = validated;
+   entry->size = item->size;
+   entry->keylen = item->keylen;
+   memcpy(entry->key, item->key, item->keylen);
+   memcpy(entry->key + item->keylen, item->data, item->size);
+   entry->next = shard->buckets[hash & shard->mask];
+   shard->buckets[hash & shard->mask] = entry;
+   shard->clock[entry->slot] = entry;
+}
+
+/* When an item stored with the given exptime expires, in ms on the
+ * monotonic clock, or 1 if it already has. Like the server, values of up
+ * to 30 days are relative */
+static uint64_t near_expires(size_t exptime) {
+   if (exptime == 0) {
+      return 0;
+   }
+   if (exptime <= MAX_RELATIVE_EXPTIME) {
+      return now_msec() + (uint64_t)exptime * 1000;
+   }
+   time_t now = time(NULL);
+   if ((time_t)exptime <= now) {
+      return 1;
+   }
+   return now_msec() + (uint64_t)(exptime - now) * 1000;
+}
+
+/* Serve the item from the cache if it was read from the server less than
+ * ttl ms ago, and else read it again with a gets. The expiry of an entry
+ * is only known when it was stored through the cache, and is kept as long
+ * as the cas id shows that the value is still the one stored */
+static int near_get(struct Memcache* handle, struct Item *item) {
+   struct NearCache *cache = handle->near;
+   uint32_t hash = near_hash(item->key, item->keylen);
+   struct NearShard *shard = near_shard(cache, hash);
+
+   pthread_mutex_lock(&shard->lock);
+   uint64_t now = now_msec();
+   struct NearEntry *entry = near_find(shard, hash, item->key, item->keylen);
+   if ((entry != NULL) && (entry->expires != 0) && (now >= entry->expires)) {
+      near_remove(shard, entry);
+      entry = NULL;
+   }
+   if ((entry != NULL) && (entry->validated != 0) &&
+       (now - entry->validated < (uint64_t)cache->ttl) &&
+       (item_reserve(item, entry->size) == 0)) {
+      entry->referenced = 1;
+      item->flags = entry->flags;
+      item->cas_id = entry->cas_id;
+      item->size = entry->size;
+      memcpy(item->data, entry->key + entry->keylen, entry->size);
+      ++shard->hits;
+      pthread_mutex_unlock(&shard->lock);
+      item->status = Success;
+      item->errmsg = status_messages[Success];
+      return 0;
+   }
+   int known = (entry != NULL);
+   uint64_t cas_id = known ? entry->cas_id : 0;
+   uint64_t expires = known ? entry->expires : 0;
+   if (known) {
+      ++shard->revalidations;
+   } else {
+      ++shard->misses;
+   }
+   pthread_mutex_unlock(&shard->lock);
+
+   int ret = remote_get(handle, item);
+
+   pthread_mutex_lock(&shard->lock);
+   if ((ret == 0) && (item->size <= cache->max_value)) {
+      if (!known || ((cas_id != 0) && (cas_id != item->cas_id))) {
+         expires = 0;
+      }
+      near_insert(shard, hash, item, expires, now_msec());
+   } else if ((entry = near_find(shard, hash, item->key, item->keylen)) != NULL) {
+      near_remove(shard, entry);
+   }
+   pthread_mutex_unlock(&shard->lock);
+   return ret;
+}
+
+/* A stored item is kept for its expiry, and read back on the next get
+ * for its cas id */
+static int near_stored(struct Memcache* handle, struct Item *item, int ret) {
+   struct NearCache *cache = handle->near;
+   if (cache == NULL) {
+      return ret;
+   }
+   uint32_t hash = near_hash(item->key, item->keylen);
+   struct NearShard *shard = near_shard(cache, hash);
+   pthread_mutex_lock(&shard->lock);
+   struct NearEntry *entry = near_find(shard, hash, item->key, item->keylen);
+   if (entry != NULL) {
+      near_remove(shard, entry);
+   }
+   uint64_t expires = near_expires(item->exptime);
+   if ((ret == 0) && (item->size <= cache->max_value) && (expires != 1)) {
+      struct Item stored = *item;
+      stored.cas_id = 0;
+      near_insert(shard, hash, &stored, expires, 0);
+   }
+   pthread_mutex_unlock(&shard->lock);
+   return ret;
+}
+
+static void near_forget(struct Memcache* handle, struct Item *item) {
+   struct NearCache *cache = handle->near;
+   if (cache == NULL) {
+      return;
+   }
+   uint32_t hash = near_hash(item->key, item->keylen);
+   struct NearShard *shard = near_shard(cache, hash);
+   pthread_mutex_lock(&shard->lock);
+   struct NearEntry *entry = near_find(shard, hash, item->key, item->keylen);
+   if (entry != NULL) {
+      near_remove(shard, entry);
+   }
+   pthread_mutex_unlock(&shard->lock);
+}
+
+/* After a flush none of the entries is valid any more */
+static void near_clear(struct Memcache* handle) {
+   struct NearCache *cache = handle->near;
+   if (cache == NULL) {
+      return;
+   }
+   for (int ii = 0; ii < NEAR_SHARDS; ++ii) {
+      struct NearShard *shard = &cache->shard[ii];
+      pthread_mutex_lock(&shard->lock);
+      for (int jj = 0; jj < shard->capacity; ++jj) {
+         if (shard->clock[jj] != NULL) {
+            near_remove(shard, shard->clock[jj]);
+         }
+      }
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
+struct NearCache *libmemc_near_cache_create(int entries, size_t max_value, int ttl) {
+   if ((entries < 1) || (ttl < 1)) {
+      return NULL;
+   }
+   struct NearCache *cache = calloc(1, sizeof(struct NearCache));
+   if (cache == NULL) {
+      return NULL;
+   }
+   cache->ttl = ttl;
+   cache->max_value = max_value;
+
+   int capacity = (entries + NEAR_SHARDS - 1) / NEAR_SHARDS;
+   uint32_t buckets = 1;
+   while (buckets < (uint32_t)capacity) {
+      buckets <<= 1;
+   }
+   for (int ii = 0; ii < NEAR_SHARDS; ++ii) {
+      pthread_mutex_init(&cache->shard[ii].lock, NULL);
+   }
+   for (int ii = 0; ii < NEAR_SHARDS; ++ii) {
+      struct NearShard *shard = &cache->shard[ii];
+      shard->capacity = capacity;
+      shard->mask = buckets - 1;
+      shard->buckets = calloc(buckets, sizeof(struct NearEntry*));
+      shard->clock = calloc(capacity, sizeof(struct NearEntry*));
+      if ((shard->buckets == NULL) || (shard->clock == NULL)) {
+         libmemc_near_cache_destroy(cache);
+         return NULL;
+      }
+   }
+   return cache;
+}
+
+void libmemc_near_cache_destroy(struct NearCache *cache) {
+   for (int ii = 0; ii < NEAR_SHARDS; ++ii) {
+      struct NearShard *shard = &cache->shard[ii];
+      if (shard->clock != NULL) {
+         for (int jj = 0; jj < shard->capacity; ++jj) {
+            free(shard->clock[jj]);
+         }
+      }
+      free(shard->clock);
+      free(shard->buckets);
+      pthread_mutex_destroy(&shard->lock);
+   }
+   free(cache);
+}
+
+void libmemc_set_near_cache(struct Memcache *handle, struct NearCache *cache) {
+   handle->near = cache;
+}
+
+void libmemc_near_cache_counters(struct NearCache *cache, uint64_t *hits,
+                                 uint64_t *misses, uint64_t *revalidations) {
+   *hits = *misses = *revalidations = 0;
+   for (int ii = 0; ii < NEAR_SHARDS; ++ii) {
+      struct NearShard *shard = &cache->shard[ii];
+      pthread_mutex_lock(&shard->lock);
+      *hits += shard->hits;
+      *misses += shard->misses;
+      *revalidations += shard->revalidations;
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
+/**
+ * Single-flight gets
+ */
+#define FLIGHT_SHARDS 16
+
+/* A get on its way to the server. The first thread to miss on a key
+ * sends it, the others that get the same key meanwhile join it and
+ * wait. The last one out frees it */
+struct Flight {
+   struct Flight *next;
+   uint32_t hash;
+   const char *key;         /* the one of the sender, while in the list */
+   int keylen;
+   int waiters;
+   int done;
+   int ret;
+   enum Status status;      /* the message of the sender may be in its server */
+   uint32_t flags;
+   uint64_t cas_id;
+   size_t size;
+   void *data;              /* copy of the value for the waiters */
+};
+
+struct FlightShard {
+   pthread_mutex_t lock;
+   pthread_cond_t landed;
+   struct Flight *flights;
+   uint64_t sent;
+   uint64_t joined;
+};
+
+struct SingleFlight {
+   struct FlightShard shard[FLIGHT_SHARDS];
+};
+
+static struct Flight *flight_find(struct FlightShard *shard, uint32_t hash,
+                                  const char *key, int keylen) {
+   struct Flight *flight = shard->flights;
+   while ((flight != NULL) && ((flight->hash != hash) || (flight->keylen != keylen) ||
+                               (memcmp(flight->key, key, keylen) != 0))) {
+      flight = flight->next;
+   }
+   return flight;
+}
+
+static void flight_remove(struct FlightShard *shard, struct Flight *flight) {
+   struct Flight **prev = &shard->flights;
+   while (*prev != flight) {
+      prev = &(*prev)->next;
+   }
+   *prev = flight->next;
+}
+
+/* Hand the outcome of the get over to the waiters */
+static void flight_land(struct Flight *flight, struct Item *item, int ret) {
+   flight->ret = ret;
+   flight->status = item->status;
+   if ((ret == 0) && (flight->waiters > 0)) {
+      flight->data = malloc(item->size);
+      if (flight->data == NULL) {
+         flight->ret = -1;
+         flight->status = ClientOutOfMemory;
+      } else {
+         memcpy(flight->data, item->data, item->size);
+         flight->flags = item->flags;
+         flight->cas_id = item->cas_id;
+         flight->size = item->size;
+      }
+   }
+   flight->done = 1;
+}
+
+static int flight_copy(struct Flight *flight, struct Item *item) {
+   if ((flight->ret == 0) && (item_reserve(item, flight->size) == -1)) {
+      item->status = ClientOutOfMemory;
+      item->errmsg = status_messages[ClientOutOfMemory];
+      return -1;
+   }
+   if (flight->ret == 0) {
+      memcpy(item->data, flight->data, flight->size);
+      item->flags = flight->flags;
+      item->cas_id = flight->cas_id;
+      item->size = flight->size;
+   }
+   item->status = flight->status;
+   item->errmsg = status_messages[flight->status];
+   return flight->ret;
+}
+
+static int flight_get(struct Memcache* handle, struct Item *item) {
+   uint32_t hash = near_hash(item->key, item->keylen);
+   struct FlightShard *shard = &handle->flights->shard[hash >> 28];
+
+   pthread_mutex_lock(&shard->lock);
+   struct Flight *flight = flight_find(shard, hash, item->key, item->keylen);
+   if (flight != NULL) {
+      ++flight->waiters;
+      ++shard->joined;
+      while (!flight->done) {
+         pthread_cond_wait(&shard->landed, &shard->lock);
+      }
+      int ret = flight_copy(flight, item);
+      if (--flight->waiters == 0) {
+         free(flight->data);
+         free(flight);
+      }
+      pthread_mutex_unlock(&shard->lock);
+      return ret;
+   }
+
+   flight = calloc(1, sizeof(struct Flight));
+   if (flight != NULL) {
+      flight->hash = hash;
+      flight->key = item->key;
+      flight->keylen = item->keylen;
+      flight->next = shard->flights;
+      shard->flights = flight;
+      ++shard->sent;
+   }
+   pthread_mutex_unlock(&shard->lock);
+
+   int ret = fetch_item(handle, item);
+   if (flight == NULL) {
+      return ret;
+   }
+
+   pthread_mutex_lock(&shard->lock);
+   flight_remove(shard, flight);
+   flight_land(flight, item, ret);
+   if (flight->waiters == 0) {
+      free(flight);
+   } else {
+      pthread_cond_broadcast(&shard->landed);
+   }
+   pthread_mutex_unlock(&shard->lock);
+   return ret;
+}
+
+struct SingleFlight *libmemc_single_flight_create(void) {
+   struct SingleFlight *flights = calloc(1, sizeof(struct SingleFlight));
+   if (flights != NULL) {
+      for (int ii = 0; ii < FLIGHT_SHARDS; ++ii) {
+         pthread_mutex_init(&flights->shard[ii].lock, NULL);
+         pthread_cond_init(&flights->shard[ii].landed, NULL);
+      }
+   }
+   return flights;
+}
+
+void libmemc_single_flight_destroy(struct SingleFlight *flights) {
+   for (int ii = 0; ii < FLIGHT_SHARDS; ++ii) {
+      pthread_mutex_destroy(&flights->shard[ii].lock);
+      pthread_cond_destroy(&flights->shard[ii].landed);
+   }
+   free(flights);
+}
+
+void libmemc_set_single_flight(struct Memcache *handle, struct SingleFlight *flights) {
+   handle->flights = flights;
+}
+
+void libmemc_single_flight_counters(struct SingleFlight *flights, uint64_t *sent,
+                                    uint64_t *joined) {
+   *sent = *joined = 0;
+   for (int ii = 0; ii < FLIGHT_SHARDS; ++ii) {
+      struct FlightShard *shard = &flights->shard[ii];
+      pthread_mutex_lock(&shard->lock);
+      *sent += shard->sent;
+      *joined += shard->joined;
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
+/**
+ * Compression
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MF_LIMIT 12       /* no match starts in the last 12 bytes */
+#define LZ_LAST_LITERALS 5   /* and the last 5 are always literals */
+#define LZ_MAX_OFFSET 65535
+#define LZ_MAX_RATIO 255     /* a byte of input makes at most 255 of output */
+
+static uint32_t lz_read32(const unsigned char *ptr) {
+   uint32_t value;
+   memcpy(&value, ptr, sizeof(value));
+   return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+   return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* A length of 15 or more goes on after the token in bytes of 255 */
+static unsigned char *lz_length(unsigned char *op, size_t len) {
+   while (len >= 255) {
+      *op++ = 255;
+      len -= 255;
+   }
+   *op++ = (unsigned char)len;
+   return op;
+}
+
+static unsigned char *lz_literals(unsigned char *op, const unsigned char *src,
+                                  size_t literals, unsigned char *token) {
+   *token = ((literals >= 15) ? 15 : literals) << 4;
+   if (literals >= 15) {
+      op = lz_length(op, literals - 15);
+   }
+   memcpy(op, src, literals);
+   return op + literals;
+}
+
+/* Compress into the LZ4 block format, greedily matching the last position
+ * with the same hash of its next 4 bytes. The step grows while nothing
+ * matches, so incompressible data is passed over quickly. Returns the
+ * compressed size, or 0 if it does not fit in capacity */
+static size_t lz_compress(const unsigned char *src, size_t size,
+                          unsigned char *dst, size_t capacity) {
+   uint32_t table[1 << LZ_HASH_BITS];   /* position + 1, 0 for none */
+   memset(table, 0, sizeof(table));
+   unsigned char *op = dst;
+   unsigned char *end = dst + capacity;
+   size_t anchor = 0;
+   size_t ip = 0;
+
+   while (size > LZ_MF_LIMIT && ip < size - LZ_MF_LIMIT) {
+      uint32_t sequence = lz_read32(src + ip);
+      uint32_t hash = lz_hash(sequence);
+      size_t ref = table[hash];
+      table[hash] = ip + 1;
+      if ((ref == 0) || (ip + 1 - ref > LZ_MAX_OFFSET) ||
+          (lz_read32(src + ref - 1) != sequence)) {
+         ip += 1 + ((ip - anchor) >> 6);
+         continue;
+      }
+      --ref;
+
+      size_t len = LZ_MIN_MATCH;
+      size_t limit = size - LZ_LAST_LITERALS - ip;
+      while ((len + 8 <= limit) && (memcmp(src + ref + len, src + ip + len, 8) == 0)) {
+         len += 8;
+      }
+      while ((len < limit) && (src[ref + len] == src[ip + len])) {
+         ++len;
+      }
+      size_t literals = ip - anchor;
+      size_t extra = len - LZ_MIN_MATCH;
+      if ((size_t)(end - op) < 1 + literals / 255 + 1 + literals + 2 + extra / 255 + 1) {
+         return 0;
+      }
+      unsigned char *token = op;
+      op = lz_literals(op + 1, src + anchor, literals, token);
+      *op++ = (ip - ref) & 0xff;
+      *op++ = (ip - ref) >> 8;
+      *token |= (extra >= 15) ? 15 : extra;
+      if (extra >= 15) {
+         op = lz_length(op, extra - 15);
+      }
+      ip += len;
+      anchor = ip;
+   }
+
+   size_t literals = size - anchor;
+   if ((size_t)(end - op) < 1 + literals / 255 + 1 + literals) {
+      return 0;
+   }
+   op = lz_literals(op + 1, src + anchor, literals, op);
+   return op - dst;
+}
+
+/* Returns the size of the output, or -1 if the input is corrupt or does
+ * not fit in capacity */
+static ssize_t lz_decompress(const unsigned char *src, size_t size,
+                             unsigned char *dst, size_t capacity) {
+   const unsigned char *ip = src;
+   const unsigned char *iend = src + size;
+   unsigned char *op = dst;
+   unsigned char *oend = dst + capacity;
+
+   while (ip < iend) {
+      unsigned int token = *ip++;
+      size_t literals = token >> 4;
+      if (literals == 15) {
+         unsigned char byte;
+         do {
+            if (ip == iend) {
+               return -1;
+            }
+            byte = *ip++;
+            literals += byte;
+         } while (byte == 255);
+      }
+      if ((literals > (size_t)(iend - ip)) || (literals > (size_t)(oend - op))) {
+         return -1;
+      }
+      memcpy(op, ip, literals);
+      op += literals;
+      ip += literals;
+      if (ip == iend) {
+         break;   /* the last sequence has no match */
+      }
+
+      if (iend - ip < 2) {
+         return -1;
+      }
+      size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      size_t len = token & 15;
+      if (len == 15) {
+         unsigned char byte;
+         do {
+            if (ip == iend) {
+               return -1;
+            }
+            byte = *ip++;
+            len += byte;
+         } while (byte == 255);
+      }
+      len += LZ_MIN_MATCH;
+      if ((offset == 0) || (offset > (size_t)(op - dst)) ||
+          (len > (size_t)(oend - op))) {
+         return -1;
+      }
+      /* a match that overlaps what it copies repeats a pattern, which
+       * doubles with every copy */
+      const unsigned char *match = op - offset;
+      while (len > 0) {
+         size_t chunk = ((size_t)(op - match) < len) ? (size_t)(op - match) : len;
+         memcpy(op, match, chunk);
+         op += chunk;
+         len -= chunk;
+      }
+   }
+   return op - dst;
+}
+
+static int pool_reserve(struct Memcache* handle, size_t size) {
+   if (size > handle->poolsize) {
+      free(handle->pool);
+      handle->pool = malloc(size);
+      if (handle->pool == NULL) {
+         handle->poolsize = 0;
+         return -1;
+      }
+      handle->poolsize = size;
+   }
+   return 0;
+}
+
+/* Compress the value into the pool, behind its size in 4 bytes. Fails
+ * unless that is smaller than the value */
+static int pack_item(struct Memcache* handle, struct Item *item) {
+   if ((item->size <= 4 + LZ_MF_LIMIT) || (item->size > UINT32_MAX) ||
+       (item->flags & LIBMEMC_COMPRESSED) || (pool_reserve(handle, item->size) == -1)) {
+      return -1;
+   }
+   unsigned char *pool = (unsigned char*)handle->pool;
+   size_t size = lz_compress(item->data, item->size, pool + 4, item->size - 4);
+   if (size == 0) {
+      return -1;
+   }
+   pool[0] = item->size >> 24;
+   pool[1] = item->size >> 16;
+   pool[2] = item->size >> 8;
+   pool[3] = item->size;
+   item->data = pool;
+   item->size = size + 4;
+   item->flags |= LIBMEMC_COMPRESSED;
+   return 0;
+}
+
+/* The compressed value moves to the pool, to be uncompressed into the
+ * buffer of the item */
+static int unpack_item(struct Memcache* handle, struct Item *item) {
+   const unsigned char *data = item->data;
+   size_t size = 0;
+   if (item->size >= 4) {
+      size = ((size_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+   }
+   if ((item->size < 4) || (size > (item->size - 4) * LZ_MAX_RATIO)) {
+      item->status = ProtocolError;
+      item->errmsg = "Corrupt compressed value";
+      return -1;
+   }
+   size_t packed = item->size - 4;
+   if (pool_reserve(handle, packed) == 0) {
+      memcpy(handle->pool, data + 4, packed);
+   }
+   if ((handle->pool == NULL) || (item_reserve(item, size) == -1)) {
+      item->status = ClientOutOfMemory;
+      item->errmsg = status_messages[ClientOutOfMemory];
+      return -1;
+   }
+   if (lz_decompress((unsigned char*)handle->pool, packed, item->data, size) != (ssize_t)size) {
+      item->status = ProtocolError;
+      item->errmsg = "Corrupt compressed value";
+      return -1;
+   }
+   item->size = size;
+   item->flags &= ~LIBMEMC_COMPRESSED;
+   return 0;
+}
+
+void libmemc_set_compression(struct Memcache *handle, size_t threshold) {
+   handle->compress = threshold;
+}
+
+/**
+ * Chunked values
+ */
+#define CHUNK_MAGIC 0x4c4d4331   /* "LMC1" */
+#define CHUNK_MANIFEST 32
+#define CHUNK_KEY 288            /* a key of 250 bytes, the version and index */
+#define CHUNK_REQUEST 80         /* the header of a set of a chunk */
+#define MAX_KEY 250
+
+/* The value of a chunked item is a manifest of the magic, the number of
+ * chunks, the size of the value, the version, the checksum of the value
+ * and the size of a chunk. The value itself is in the chunks, stored as
+ * <key>:<version>:<index>. A new value gets chunks of a new version, and
+ * a reader only sees them once the manifest points to them */
+struct Manifest {
+   uint32_t chunks;
+   uint64_t size;
+   uint64_t version;
+   uint32_t checksum;
+   uint32_t chunk_size;
+};
+
+static void put32(unsigned char *ptr, uint32_t value) {
+   ptr[0] = value >> 24;
+   ptr[1] = value >> 16;
+   ptr[2] = value >> 8;
+   ptr[3] = value;
+}
+
+static uint32_t get32(const unsigned char *ptr) {
+   return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+      ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+static uint32_t chunk_checksum(const unsigned char *data, size_t size) {
+   uint32_t hash = 2166136261u;
+   for (size_t ii = 0; ii < size; ++ii) {
+      hash = (hash ^ data[ii]) * 16777619u;
+   }
+   return hash;
+}
+
+static void manifest_encode(const struct Manifest *manifest, unsigned char *ptr) {
+   put32(ptr, CHUNK_MAGIC);
+   put32(ptr + 4, manifest->chunks);
+   put32(ptr + 8, manifest->size >> 32);
+   put32(ptr + 12, manifest->size);
+   put32(ptr + 16, manifest->version >> 32);
+   put32(ptr + 20, manifest->version);
+   put32(ptr + 24, manifest->checksum);
+   put32(ptr + 28, manifest->chunk_size);
+}
+
+static int manifest_decode(struct Manifest *manifest, const struct Item *item) {
+   const unsigned char *ptr = item->data;
+   if ((item->size != CHUNK_MANIFEST) || (get32(ptr) != CHUNK_MAGIC)) {
+      return -1;
+   }
+   manifest->chunks = get32(ptr + 4);
+   manifest->size = ((uint64_t)get32(ptr + 8) << 32) | get32(ptr + 12);
+   manifest->version = ((uint64_t)get32(ptr + 16) << 32) | get32(ptr + 20);
+   manifest->checksum = get32(ptr + 24);
+   manifest->chunk_size = get32(ptr + 28);
+   if ((manifest->chunk_size == 0) ||
+       (manifest->chunks != (manifest->size + manifest->chunk_size - 1) / manifest->chunk_size)) {
+      return -1;
+   }
+   return 0;
+}
+
+/* Point the items at the chunk keys, written to keys */
+static int chunk_items(const struct Item *item, const struct Manifest *manifest,
+                       struct Item *chunk, char *keys) {
+   for (uint32_t ii = 0; ii < manifest->chunks; ++ii) {
+      char *key = keys + ii * CHUNK_KEY;
+      int keylen = snprintf(key, CHUNK_KEY, "%.*s:%016llx:%u", item->keylen, item->key,
+                            (unsigned long long)manifest->version, ii);
+      if (keylen > MAX_KEY) {
+         return -1;
+      }
+      chunk[ii].key = key;
+      chunk[ii].keylen = keylen;
+      chunk[ii].exptime = item->exptime;
+   }
+   return 0;
+}
+
+/* The server that a chunk is read from */
+static struct Server *chunk_server(struct Memcache *handle, const char *key) {
+   struct Server *replicas[MAX_REPLICAS];
+   if (handle->replicas > 1) {
+      return (get_replicas(handle, key, replicas) > 0) ? replicas[0] : NULL;
+   }
+   return get_server(handle, key);
+}
+
+/* Put the request storing or deleting a chunk in iovec, with its header
+ * in buffer. Binary requests are quiet, a noop after the last one gets
+ * the reply. Returns the number of vectors used */
+static int chunk_request(enum Protocol protocol, int delete, const struct Item *chunk,
+                         char *buffer, struct iovec *iovec) {
+   if (protocol == Binary) {
+#if HAVE_PROTOCOL_BINARY
+      protocol_binary_request_set *request = (protocol_binary_request_set*)buffer;
+      if (delete) {
+         binary_header(&request->message.header, PROTOCOL_BINARY_CMD_DELETEQ,
+                       chunk->keylen, 0);
+         iovec[0].iov_base = (void*)request;
+         iovec[0].iov_len = sizeof(protocol_binary_request_header);
+         iovec[1].iov_base = (void*)chunk->key;
+         iovec[1].iov_len = chunk->keylen;
+         return 2;
+      }
+      binary_header(&request->message.header, PROTOCOL_BINARY_CMD_SETQ,
+                    chunk->keylen, chunk->size);
+      request->message.body.flags = htonl(chunk->flags);
+      request->message.body.expiration = htonl(chunk->exptime);
+      iovec[0].iov_base = (void*)request;
+      iovec[0].iov_len = sizeof(protocol_binary_request_header) +
+                         sizeof(request->message.body.flags) +
+                         sizeof(request->message.body.expiration);
+      iovec[1].iov_base = (void*)chunk->key;
+      iovec[1].iov_len = chunk->keylen;
+      iovec[2].iov_base = chunk->data;
+      iovec[2].iov_len = chunk->size;
+      return 3;
+#else
+      return 0;
+#endif
+   }
+
+   if (delete) {
+      iovec[0].iov_base = (char*)"delete ";
+      iovec[0].iov_len = 7;
+      iovec[1].iov_base = (char*)chunk->key;
+      iovec[1].iov_len = chunk->keylen;
+      iovec[2].iov_base = (char*)"\r\n";
+      iovec[2].iov_len = 2;
+      return 3;
+   }
+   char *end = put_field(buffer, chunk->flags);
+   end = put_field(end, chunk->exptime);
+   end = put_field(end, chunk->size);
+   memcpy(end, "\r\n", 2);
+   iovec[0].iov_base = (char*)"set ";
+   iovec[0].iov_len = 4;
+   iovec[1].iov_base = (char*)chunk->key;
+   iovec[1].iov_len = chunk->keylen;
+   iovec[2].iov_base = buffer;
+   iovec[2].iov_len = (end + 2) - buffer;
+   iovec[3].iov_base = chunk->data;
+   iovec[3].iov_len = chunk->size;
+   iovec[4].iov_base = (char*)"\r\n";
+   iovec[4].iov_len = 2;
+   return 5;
+}
+
+/* Store or delete the chunks on every replica. The chunks of a server go
+ * in one pipelined write, and every server gets its write before any
+ * reply is read, so it all takes a single round trip. Nothing more is
+ * sent after a write fails, the replies to the writes sent are still
+ * read */
+static int chunks_write(struct Memcache *handle, struct Item *chunk, uint32_t chunks,
+                        int delete, struct Item *item) {
+   int servers = handle->no_servers;
+   size_t total = (size_t)chunks * MAX_REPLICAS;
+   int *owner = calloc(total, sizeof(int));
+   uint32_t *index = calloc(total, sizeof(uint32_t));
+   uint32_t *grouped = calloc(total, sizeof(uint32_t));
+   size_t *start = calloc(servers + 1, sizeof(size_t));
+   size_t *next = calloc(servers + 1, sizeof(size_t));
+   struct iovec *iovec = calloc(5 * total + servers, sizeof(struct iovec));
+   char *headers = malloc(total * CHUNK_REQUEST);
+   if ((owner == NULL) || (index == NULL) || (grouped == NULL) || (start == NULL) ||
+       (next == NULL) || (iovec == NULL) || (headers == NULL)) {
+      free(owner);
+      free(index);
+      free(grouped);
+      free(start);
+      free(next);
+      free(iovec);
+      free(headers);
+      item->status = ClientOutOfMemory;
+      item->errmsg = status_messages[ClientOutOfMemory];
+      return -1;
+   }
+
+   // group the chunks by server, in the order of the chunks
+   int ret = 0;
+   size_t pending = 0;
+   for (uint32_t ii = 0; (ii < chunks) && (ret == 0); ++ii) {
+      struct Server *replicas[MAX_REPLICAS];
+      int count = 1;
+      if (handle->replicas > 1) {
+         count = get_replicas(handle, chunk[ii].key, replicas);
+      } else {
+         replicas[0] = get_server(handle, chunk[ii].key);
+      }
+      if ((count == 0) || (replicas[0] == NULL)) {
+         item->status = ConnectionError;
+         item->errmsg = "No server available";
+         ret = -1;
+      }
+      for (int jj = 0; (jj < count) && (ret == 0); ++jj) {
+         int kk = 0;
+         while (handle->servers[kk] != replicas[jj]) {
+            ++kk;
+         }
+         owner[pending] = kk;
+         index[pending++] = ii;
+         ++start[kk + 1];
+      }
+   }
+   for (int jj = 0; jj < servers; ++jj) {
+      start[jj + 1] += start[jj];
+      next[jj] = start[jj];
+   }
+   for (size_t ii = 0; ii < pending; ++ii) {
+      grouped[next[owner[ii]]++] = index[ii];
+   }
+
+#if HAVE_PROTOCOL_BINARY
+   protocol_binary_request_noop noopreq;
+   binary_header(&noopreq.message.header, PROTOCOL_BINARY_CMD_NOOP, 0, 0);
+#endif
+   for (int jj = 0; jj < servers; ++jj) {
+      // next marks the servers that were written to
+      next[jj] = 0;
+      if ((ret != 0) || (start[jj] == start[jj + 1])) {
+         continue;
+      }
+      struct Server *server = handle->servers[jj];
+      struct iovec *vec = iovec + 5 * start[jj] + jj;
+      int iovcnt = 0;
+      for (size_t kk = start[jj]; kk < start[jj + 1]; ++kk) {
+         iovcnt += chunk_request(handle->protocol, delete, &chunk[grouped[kk]],
+                                 headers + kk * CHUNK_REQUEST, vec + iovcnt);
+      }
+#if HAVE_PROTOCOL_BINARY
+      if (handle->protocol == Binary) {
+         vec[iovcnt].iov_base = (void*)&noopreq;
+         vec[iovcnt++].iov_len = sizeof(noopreq.bytes);
+      }
+#endif
+      if (((server->sock == -1) && (server_connect(server) == -1)) ||
+          (server_sendv(server, vec, iovcnt) == -1)) {
+         ret = item_set_status(item, server, -1);
+      } else {
+         next[jj] = 1;
+      }
+   }
+
+   for (int jj = 0; jj < servers; ++jj) {
+      if (next[jj] == 0) {
+         continue;
+      }
+      struct Server *server = handle->servers[jj];
+      int failed = (handle->protocol == Binary) ?
+         binary_pipeline_replies(server) :
+         textual_pipeline_replies(server, start[jj + 1] - start[jj],
+                                  delete ? "DELETED" : "STORED");
+      if ((failed == -1) || (server_zerocopy_wait(server) == -1)) {
+         if (ret == 0) {
+            ret = item_set_status(item, server, -1);
+         }
+      } else if ((failed > 0) && (ret == 0)) {
+         item->status = delete ? NotFound : NotStored;
+         item->errmsg = delete ? "Chunk not deleted" : "Chunk not stored";
+         ret = -1;
+      }
+   }
+
+   free(owner);
+   free(index);
+   free(grouped);
+   free(start);
+   free(next);
+   free(iovec);
+   free(headers);
+   return ret;
+}
+
+/* Delete the chunks of a manifest, nothing points to them any more. This
+ * is best effort, chunks that are left behind are evicted in time */
+static void chunks_delete(struct Memcache *handle, const struct Item *item,
+                          const struct Manifest *manifest) {
+   struct Item *chunk = calloc(manifest->chunks, sizeof(struct Item));
+   char *keys = malloc((size_t)manifest->chunks * CHUNK_KEY);
+   struct Item status = { 0 };
+   if ((chunk != NULL) && (keys != NULL) &&
+       (chunk_items(item, manifest, chunk, keys) == 0)) {
+      chunks_write(handle, chunk, manifest->chunks, 1, &status);
+   }
+   free(chunk);
+   free(keys);
+}
+
+static int chunked_store(struct Memcache* handle, enum StoreCommand cmd,
+                         struct Item *item) {
+   struct Manifest manifest;
+   manifest.chunk_size = handle->chunk;
+   manifest.size = item->size;
+   manifest.chunks = (item->size + handle->chunk - 1) / handle->chunk;
+   manifest.version = (now_usec() << 16) ^ ((uint64_t)getpid() << 40) ^ ++handle->versions;
+   manifest.checksum = chunk_checksum(item->data, item->size);
+
+   struct Item *chunk = calloc(manifest.chunks, sizeof(struct Item));
+   char *keys = malloc((size_t)manifest.chunks * CHUNK_KEY);
+   int ret = -1;
+   int written = 0;
+   if ((chunk == NULL) || (keys == NULL)) {
+      item->status = ClientOutOfMemory;
+      item->errmsg = status_messages[ClientOutOfMemory];
+   } else if (chunk_items(item, &manifest, chunk, keys) == -1) {
+      item->status = InvalidArguments;
+      item->errmsg = "Key too long to chunk";
+   } else {
+      for (uint32_t ii = 0; ii < manifest.chunks; ++ii) {
+         size_t offset = (size_t)ii * handle->chunk;
+         chunk[ii].data = (char*)item->data + offset;
+         chunk[ii].size = (item->size - offset < handle->chunk) ?
+            item->size - offset : handle->chunk;
+      }
+      ret = chunks_write(handle, chunk, manifest.chunks, 0, item);
+      written = 1;
+   }
+
+   /* the manifest goes last, with the command and cas id of the item. The
+    * one it replaces is read first, so that its chunks can be deleted */
+   struct Item replaced = { 0 };
+   struct Manifest old;
+   int cleanup = 0;
+   if ((ret == 0) && (cmd != add)) {
+      replaced.key = item->key;
+      replaced.keylen = item->keylen;
+      cleanup = (read_item(handle, &replaced) == 0) &&
+         (replaced.flags & LIBMEMC_CHUNKED) && (manifest_decode(&old, &replaced) == 0);
+   }
+   if (ret == 0) {
+      unsigned char data[CHUNK_MANIFEST];
+      manifest_encode(&manifest, data);
+      struct Item stored = *item;
+      stored.data = data;
+      stored.size = CHUNK_MANIFEST;
+      stored.flags |= LIBMEMC_CHUNKED;
+      ret = store_item(handle, cmd, &stored);
+      item->status = stored.status;
+      item->errmsg = stored.errmsg;
+   }
+
+   // no manifest points to the new chunks when it was not stored
+   if ((ret == 0) && cleanup && (old.version != manifest.version)) {
+      chunks_delete(handle, item, &old);
+   } else if ((ret != 0) && written) {
+      chunks_delete(handle, item, &manifest);
+   }
+   free(replaced.data);
+   free(chunk);
+   free(keys);
+   return ret;
+}
+
+/* Read the chunks with a multi-get over the servers that have them */
+static int chunks_read(struct Memcache *handle, struct Item *chunk, uint32_t chunks,
+                       struct Item *item) {
+   if (multi_get_items(handle, chunk, chunks) == -1) {
+      for (uint32_t ii = 0; ii < chunks; ++ii) {
+         if ((chunk[ii].status != Success) && (chunk[ii].status != NotFound)) {
+            item->status = chunk[ii].status;
+            item->errmsg = chunk[ii].errmsg;
+            return -1;
+         }
+      }
+   }
+   return 0;
+}
+
+/* Put the value together from the chunks. A chunk that is gone makes it
+ * a miss */
+static int chunks_join(struct Item *item, const struct Manifest *manifest,
+                       struct Item *chunk) {
+   for (uint32_t ii = 0; ii < manifest->chunks; ++ii) {
+      uint64_t offset = (uint64_t)ii * manifest->chunk_size;
+      uint64_t expected = (manifest->size - offset < manifest->chunk_size) ?
+         manifest->size - offset : manifest->chunk_size;
+      if ((chunk[ii].status != Success) || (chunk[ii].size != expected)) {
+         item->status = NotFound;
+         item->errmsg = "Chunk missing";
+         return -1;
+      }
+   }
+   if (item_reserve(item, manifest->size) == -1) {
+      item->status = ClientOutOfMemory;
+      item->errmsg = status_messages[ClientOutOfMemory];
+      return -1;
+   }
+   for (uint32_t ii = 0; ii < manifest->chunks; ++ii) {
+      memcpy((char*)item->data + (size_t)ii * manifest->chunk_size, chunk[ii].data,
+             chunk[ii].size);
+   }
+   if (chunk_checksum(item->data, manifest->size) != manifest->checksum) {
+      item->status = ProtocolError;
+      item->errmsg = "Chunk checksum mismatch";
+      return -1;
+   }
+   item->size = manifest->size;
+   item->flags &= ~LIBMEMC_CHUNKED;
+   return 0;
+}
+
+static int chunked_read(struct Memcache* handle, struct Item *item) {
+   struct Manifest manifest;
+   if (manifest_decode(&manifest, item) == -1) {
+      item->status = ProtocolError;
+      item->errmsg = "Corrupt chunk manifest";
+      return -1;
+   }
+
+   struct Item *chunk = calloc(manifest.chunks, sizeof(struct Item));
+   char *keys = malloc((size_t)manifest.chunks * CHUNK_KEY);
+   int ret = -1;
+   if ((chunk == NULL) || (keys == NULL)) {
+      item->status = ClientOutOfMemory;
+      item->errmsg = status_messages[ClientOutOfMemory];
+   } else if (chunk_items(item, &manifest, chunk, keys) == -1) {
+      item->status = ProtocolError;
+      item->errmsg = "Corrupt chunk manifest";
+   } else if (chunks_read(handle, chunk, manifest.chunks, item) == 0) {
+      ret = chunks_join(item, &manifest, chunk);
+   }
+
+   if (chunk != NULL) {
+      for (uint32_t ii = 0; ii < manifest.chunks; ++ii) {
+         free(chunk[ii].data);
+      }
+   }
+   free(chunk);
+   free(keys);
+   return ret;
+}
+
+int libmemc_set_chunking(struct Memcache *handle, size_t chunk_size) {
+   /* the manifest has 32 bits for it */
+   if (chunk_size > UINT32_MAX) {
+      return -1;
+   }
+   handle->chunk = chunk_size;
+   return 0;
+}
+
+/**
+ * Multi-gets
+ */
+#define MULTI_GET_BATCH 100
+
+static int multi_get_request(struct Memcache *handle, struct Server *server,
+                             struct Item item[], int items) {
+   if (server->sock == -1) {
+      if (server_connect(server) == -1) {
+         fprintf(stderr, "%s\n", server->errmsg);
+         fflush(stderr);
+         return -1;
+      }
+   }
+   if (handle->protocol == Binary) {
+      return binary_gets_request(server, item, items);
+   }
+   return textual_gets_request(server, item, items);
+}
+
+/* The items from first to end were not read, as their server failed.
+ * The items from first to decoded were in the reply that broke off, and
+ * those of them that were found before it did keep their value */
+static int multi_get_fail(struct Server *server, struct Item item[], int first,
+                          int decoded, int end) {
+   for (int ii = first; ii < end; ++ii) {
+      if ((ii >= decoded) || (item[ii].status != Success)) {
+         item_set_status(&item[ii], server, -1);
+      }
+   }
+   return -1;
+}
+
+/* Fetch the items from their servers. The items of a server are read in
+ * batches of at most MULTI_GET_BATCH keys, so neither the request nor the
+ * search for the keys of the reply grows with the number of items. Every
+ * round sends the next batch to each server before any reply is read, so
+ * the servers work on their batches at the same time while no more than
+ * one request is outstanding on a server. A server that fails gets no
+ * more batches, and its items take its status */
+static int multi_get_items(struct Memcache *handle, struct Item item[], int items) {
+   if (items <= 0) {
+      return 0;
+   }
+   int servers = handle->no_servers;
+   struct Item *grouped = calloc(items, sizeof(struct Item));
+   int *index = calloc(items, sizeof(int));
+   int *owner = calloc(items, sizeof(int));
+   int *start = calloc(servers + 1, sizeof(int));
+   int *next = calloc(servers + 1, sizeof(int));
+   int *count = calloc(servers + 1, sizeof(int));
+   if ((grouped == NULL) || (index == NULL) || (owner == NULL) || (start == NULL) ||
+       (next == NULL) || (count == NULL)) {
+      for (int ii = 0; ii < items; ++ii) {
+         item[ii].status = ClientOutOfMemory;
+         item[ii].errmsg = status_messages[ClientOutOfMemory];
+      }
+      free(grouped);
+      free(index);
+      free(owner);
+      free(start);
+      free(next);
+      free(count);
+      return -1;
+   }
+
+   // group the items by server, in the order they were given
+   int ret = 0;
+   for (int ii = 0; ii < items; ++ii) {
+      struct Server *server = chunk_server(handle, item[ii].key);
+      owner[ii] = -1;
+      for (int jj = 0; (server != NULL) && (jj < servers); ++jj) {
+         if (handle->servers[jj] == server) {
+            owner[ii] = jj;
+            break;
+         }
+      }
+      if (owner[ii] == -1) {
+         item[ii].status = ConnectionError;
+         item[ii].errmsg = "No server available";
+         ret = -1;
+      } else {
+         ++start[owner[ii] + 1];
+      }
+   }
+   for (int jj = 0; jj < servers; ++jj) {
+      start[jj + 1] += start[jj];
+      next[jj] = start[jj];
+   }
+   for (int ii = 0; ii < items; ++ii) {
+      if (owner[ii] != -1) {
+         grouped[next[owner[ii]]] = item[ii];
+         index[next[owner[ii]]++] = ii;
+      }
+   }
+   memcpy(next, start, servers * sizeof(int));
+
+   int pending = 1;
+   while (pending) {
+      pending = 0;
+      for (int jj = 0; jj < servers; ++jj) {
+         count[jj] = start[jj + 1] - next[jj];
+         if (count[jj] > MULTI_GET_BATCH) {
+            count[jj] = MULTI_GET_BATCH;
+         }
+         if ((count[jj] > 0) &&
+             (multi_get_request(handle, handle->servers[jj], grouped + next[jj], count[jj]) == -1)) {
+            ret = multi_get_fail(handle->servers[jj], grouped, next[jj], next[jj],
+                                 start[jj + 1]);
+            next[jj] = start[jj + 1];
+            count[jj] = 0;
+         }
+      }
+      for (int jj = 0; jj < servers; ++jj) {
+         if (count[jj] == 0) {
+            continue;
+         }
+         struct Server *server = handle->servers[jj];
+         int done = (handle->protocol == Binary) ?
+            binary_gets_reply(server, grouped + next[jj], count[jj]) :
+            textual_gets_reply(server, grouped + next[jj], count[jj]);
+         if (done == -1) {
+            ret = multi_get_fail(server, grouped, next[jj], next[jj] + count[jj],
+                                 start[jj + 1]);
+            next[jj] = start[jj + 1];
+         } else {
+            next[jj] += count[jj];
+         }
+         if (next[jj] < start[jj + 1]) {
+            pending = 1;
+         }
+      }
+   }
+
+   for (int kk = 0; kk < start[servers]; ++kk) {
+      item[index[kk]] = grouped[kk];
+   }
+   free(grouped);
+   free(index);
+   free(owner);
+   free(start);
+   free(next);
+   free(count);
+   return ret;
+}
+
+int libmemc_multi_get(struct Memcache *handle, struct Item item[], int items) {
+   int ret = multi_get_items(handle, item, items);
+   for (int ii = 0; ii < items; ++ii) {
+      if (item[ii].status != Success) {
+         continue;
+      }
+      int done = 0;
+      if ((handle->chunk > 0) && (item[ii].flags & LIBMEMC_CHUNKED)) {
+         done = chunked_read(handle, &item[ii]);
+      }
+      if ((done == 0) && (handle->compress > 0) && (item[ii].flags & LIBMEMC_COMPRESSED)) {
+         done = unpack_item(handle, &item[ii]);
+      }
+      if ((done == -1) && (item[ii].status != NotFound)) {
+         ret = -1;
+      }
+   }
+   return ret;
+}
+
+/**
+ * Thread-per-core runtime
+ */
+#define SHARD_QUEUE 1024
+#define SHARD_SPIN 1000
+#define CACHELINE 64
+
+#ifdef __GNUC__
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+/* membar_consumer() keeps the later loads after the load, and
+ * membar_exit() the later stores. Before a store, membar_exit() keeps
+ * every earlier load and store ahead of it */
+static unsigned load_acquire(volatile unsigned *p) {
+   unsigned value = *p;
+   membar_consumer();
+   membar_exit();
+   return value;
+}
+
+static void store_release(volatile unsigned *p, unsigned value) {
+   membar_exit();
+   *p = value;
+}
+#endif
+
+/* A ring of requests with a single producer and a single consumer. The
+ * indices only grow, and each of them has a cache line of its own */
+struct SpscQueue {
+   unsigned head;
+   char pad1[CACHELINE - sizeof(unsigned)];
+   unsigned tail;
+   char pad2[CACHELINE - sizeof(unsigned)];
+   struct ShardRequest *slots[SHARD_QUEUE];
+};
+
+struct Shard {
+   struct SpscQueue requests;  /* from the submitter */
+   struct SpscQueue done;      /* and back again */
+   struct Shards *shards;
+   int core;
+   unsigned state;             /* 0 starting, 1 running, 2 failed */
+   pthread_t thread;
+};
+
+struct ShardServer {
+   char *name;                 /* host, or the path of a unix socket */
+   in_port_t port;             /* 0 for a unix socket */
+};
+
+struct Shards {
+   enum Protocol protocol;
+   int cores;
+   struct Shard **shard;
+   struct ShardServer *servers;
+   int no_servers;
+   int started;                /* threads to join */
+   unsigned stop;
+   int next;                   /* core whose completions come first */
+};
+
+static int spsc_push(struct SpscQueue *queue, struct ShardRequest *request) {
+   unsigned tail = queue->tail;
+   if (tail - load_acquire(&queue->head) == SHARD_QUEUE) {
+      return -1;
+   }
+   queue->slots[tail & (SHARD_QUEUE - 1)] = request;
+   store_release(&queue->tail, tail + 1);
+   return 0;
+}
+
+static struct ShardRequest* spsc_pop(struct SpscQueue *queue) {
+   unsigned head = queue->head;
+   if (head == load_acquire(&queue->tail)) {
+      return NULL;
+   }
+   struct ShardRequest *request = queue->slots[head & (SHARD_QUEUE - 1)];
+   store_release(&queue->head, head + 1);
+   return request;
+}
+
+static void shard_execute(struct Memcache *memcache, struct ShardRequest *request) {
+   switch (request->command) {
+   case ShardGet:
+      request->ret = libmemc_get(memcache, request->item);
+      break;
+   case ShardSet:
+      request->ret = libmemc_set(memcache, request->item);
+      break;
+   case ShardDelete:
+      request->ret = libmemc_delete(memcache, request->item);
+      break;
+   default:
+      request->item->status = InvalidArguments;
+      request->item->errmsg = status_messages[InvalidArguments];
+      request->ret = -1;
+   }
+}
+
+static void *shard_main(void *arg) {
+   struct Shard *shard = arg;
+   struct Shards *shards = shard->shards;
+
+#ifdef __linux__
+   /* best effort, we may be confined to fewer cpus */
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(shard->core % ((cpus > 0) ? cpus : 1), &set);
+   (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+
+   /* the connections and their buffers are allocated here, so that they
+    * come from the malloc arena of this thread and the memory of its node */
+   struct Memcache *memcache = libmemc_create(shards->protocol);
+   int ret = (memcache == NULL) ? -1 : 0;
+   for (int ii = 0; ii < shards->no_servers && ret == 0; ++ii) {
+      struct ShardServer *server = &shards->servers[ii];
+      if (server->port == 0) {
+         ret = libmemc_add_server_unix(memcache, server->name);
+      } else {
+         ret = libmemc_add_server(memcache, server->name, server->port);
+      }
+   }
+   store_release(&shard->state, (ret == 0) ? 1 : 2);
+
+   int idle = 0;
+   while (ret == 0 && !load_acquire(&shards->stop)) {
+      struct ShardRequest *request = spsc_pop(&shard->requests);
+      if (request == NULL) {
+         if (++idle > SHARD_SPIN) {
+            sched_yield();
+         }
+         continue;
+      }
+      idle = 0;
+      shard_execute(memcache, request);
+      while (spsc_push(&shard->done, request) == -1 &&
+             !load_acquire(&shards->stop)) {
+         sched_yield();
+      }
+   }
+
+   if (memcache != NULL) {
+      libmemc_destroy(memcache);
+   }
+   return NULL;
+}
+
+struct Shards* libmemc_shards_create(enum Protocol protocol, int cores) {
+   if (cores < 1) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      cores = (cpus > 0) ? cpus : 1;
+   }
+
+   struct Shards *shards = calloc(1, sizeof(struct Shards));
+   if (shards == NULL) {
+      return NULL;
+   }
+   /* pick the protocol once, like libmemc_create() */
+   struct Memcache *memcache = libmemc_create(protocol);
+   if (memcache == NULL) {
+      free(shards);
+      return NULL;
+   }
+   shards->protocol = memcache->protocol;
+   libmemc_destroy(memcache);
+
+   shards->cores = cores;
+   shards->shard = calloc(cores, sizeof(struct Shard*));
+   if (shards->shard == NULL) {
+      free(shards);
+      return NULL;
+   }
+   for (int ii = 0; ii < cores; ++ii) {
+      void *shard;
+      if (posix_memalign(&shard, CACHELINE, sizeof(struct Shard)) != 0) {
+         libmemc_shards_destroy(shards);
+         return NULL;
+      }
+      memset(shard, 0, sizeof(struct Shard));
+      shards->shard[ii] = shard;
+      shards->shard[ii]->shards = shards;
+      shards->shard[ii]->core = ii;
+   }
+   return shards;
+}
+
+void libmemc_shards_destroy(struct Shards *shards) {
+   if (shards == NULL) {
+      return;
+   }
+   /* requests still in the queues are dropped */
+   store_release(&shards->stop, 1);
+   for (int ii = 0; ii < shards->started; ++ii) {
+      pthread_join(shards->shard[ii]->thread, NULL);
+   }
+   for (int ii = 0; ii < shards->cores; ++ii) {
+      free(shards->shard[ii]);
+   }
+   for (int ii = 0; ii < shards->no_servers; ++ii) {
+      free(shards->servers[ii].name);
+   }
+   free(shards->servers);
+   free(shards->shard);
+   free(shards);
+}
+
+static int shards_add(struct Shards *shards, const char *name, in_port_t port) {
+   if (shards->started > 0) {
+      return -1;
+   }
+   struct ShardServer *servers = realloc(shards->servers,
+                                         sizeof(struct ShardServer) * (shards->no_servers + 1));
+   if (servers == NULL) {
+      return -1;
+   }
+   shards->servers = servers;
+   servers[shards->no_servers].name = strdup(name);
+   if (servers[shards->no_servers].name == NULL) {
+      return -1;
+   }
+   servers[shards->no_servers++].port = port;
+   return 0;
+}
+
+int libmemc_shards_add_server(struct Shards *shards, const char *host, in_port_t port) {
+   if (port == 0) {
+      return -1;
+   }
+   return shards_add(shards, host, port);
+}
+
+int libmemc_shards_add_server_unix(struct Shards *shards, const char *path) {
+   return shards_add(shards, path, 0);
+}
+
+/* Start a thread per core and wait for them to set up their connections */
+int libmemc_shards_start(struct Shards *shards) {
+   if (shards->started > 0 || shards->no_servers == 0) {
+      return -1;
+   }
+   for (int ii = 0; ii < shards->cores; ++ii) {
+      if (pthread_create(&shards->shard[ii]->thread, NULL, shard_main,
+                         shards->shard[ii]) != 0) {
+         return -1;
+      }
+      ++shards->started;
+   }
+
+   int ret = 0;
+   for (int ii = 0; ii < shards->cores; ++ii) {
+      unsigned state;
+      while ((state = load_acquire(&shards->shard[ii]->state)) == 0) {
+         sched_yield();
+      }
+      if (state != 1) {
+         ret = -1;
+      }
+   }
+   return ret;
+}
+
+int libmemc_shards_submit(struct Shards *shards, struct ShardRequest *request) {
+   if (shards->started != shards->cores) {
+      return -1;
+   }
+   int core = (shards->cores > 1) ? simplehash(request->item->key) % shards->cores : 0;
+   /* a core that failed to start has no thread to take the request */
+   if (load_acquire(&shards->shard[core]->state) != 1) {
+      return -1;
+   }
+   return spsc_push(&shards->shard[core]->requests, request);
+}
+
+/* Collect up to max finished requests without waiting. The cores take
+ * turns at going first, so a busy one can't starve the others */
+int libmemc_shards_complete(struct Shards *shards, struct ShardRequest *done[], int max) {
+   int count = 0;
+   for (int ii = 0; ii < shards->cores && count < max; ++ii) {
+      struct Shard *shard = shards->shard[(shards->next + ii) % shards->cores];
+      struct ShardRequest *request;
+      while (count < max && (request = spsc_pop(&shard->done)) != NULL) {
+         done[count++] = request;
+      }
+   }
+   shards->next = (shards->next + 1) % shards->cores;
+   return count;
+}
@@ -31,6 +31,27 @@
 extern "C"  {
 #endif
 
+/*
+ * The outcome of an operation, covering the replies of both the textual
+ * and the binary protocol. libmemc_strstatus() gives a short description.
+ */
+enum Status {
+   Success = 0,        /* STORED, DELETED, OK, a value or a counter */
+   NotFound,           /* NOT_FOUND, a get miss */
+   Exists,             /* EXISTS, cas id mismatch */
+   NotStored,          /* NOT_STORED */
+   TooLarge,           /* object too large for cache */
+   InvalidArguments,   /* CLIENT_ERROR */
+   NonNumeric,         /* incr or decr of a non-numeric value */
+   UnknownCommand,     /* ERROR */
+   ServerOutOfMemory,  /* out of memory storing object */
+   ServerError,        /* any other SERVER_ERROR */
+   ProtocolError,      /* malformed or unexpected reply */
+   ConnectionError,    /* failed to connect, send or receive */
+   ClientOutOfMemory,  /* failed to allocate memory in the client */
+   Timeout             /* no reply in time */
+};
+
 struct Item {
    uint64_t cas_id;
    const char *key;
@@ -38,8 +59,11 @@ struct Item {
    uint32_t flags;
    void *data;
    size_t size;
+   size_t capacity;  /* allocated size of data, reused by later gets. A
+                      * malloc'ed buffer of the caller may be passed in */
    size_t exptime;
-   const char *errmsg;
+   enum Status status;
+   const char *errmsg;  /* static or owned by the server, never freed */
 };
 
 enum Protocol { Automatic = 0, Binary = 1, Textual = 2 };
@@ -47,23 +71,230 @@ enum Protocol { Automatic = 0, Binary = 1, Textual = 2 };
 struct Memcache* libmemc_create(enum Protocol protocol);
 void libmemc_destroy(struct Memcache* handle);
 int libmemc_add_server(struct Memcache *handle, const char *host, in_port_t port);
+int libmemc_add_server_unix(struct Memcache *handle, const char *path);
 struct Server* libmemc_get_server_no(struct Memcache *handle, int server_no);
 int libmemc_get_socket(struct Server *server);
 int libmemc_set_socket(struct Server *server, int socket);
+
+/*
+ * Timeouts in milliseconds for connecting to a server and for every send
+ * and receive, 0 to wait for as long as it takes (the default). An
+ * operation that times out fails with Timeout and closes the connection.
+ * Servers added later get them as well.
+ */
+int libmemc_set_timeouts(struct Memcache *handle, int connect, int read, int write);
+
+/*
+ * Take a server out after the given number of connection errors and
+ * timeouts in a row, for backoff ms at first and twice as long after each
+ * further failure, up to max_backoff ms. Its keys go to the other servers
+ * meanwhile, and the first request for it after the backoff tries it
+ * again. A reply resets the count. 0 failures keeps every server in (the
+ * default).
+ */
+int libmemc_set_failover(struct Memcache *handle, int failures, int backoff,
+                         int max_backoff);
+
+/*
+ * Hedge the gets. A get without a reply after the given percentile of the
+ * latencies of recent gets, and at least min_usec, is sent again over a
+ * second connection to the server, and the first reply wins. The other
+ * connection is closed, since its reply is still on the way. 0 turns it
+ * off. libmemc_hedge_counters() tells how many gets were sent again, and
+ * how many of them the second request won.
+ */
+int libmemc_set_hedging(struct Memcache *handle, double percentile, int min_usec);
+void libmemc_hedge_counters(struct Memcache *handle, uint64_t *hedged, uint64_t *won);
+
+/*
+ * Store every key on the given number of servers, up to 8: the one it
+ * hashes to and the ones after it. Sets, adds, replaces and deletes go out
+ * to all of them before any reply is read, and succeed when one of them
+ * took the write. A cas is checked by the first of them only, and the new
+ * value is then set on the others. Gets read from the replica that
+ * answered fastest lately, try the others on a miss, and hedge to the next
+ * replica when hedging is on. 1 turns it off (the default).
+ */
+int libmemc_set_replicas(struct Memcache *handle, int replicas);
+
+/*
+ * Near cache of recently read items in the process, for up to the given
+ * number of entries with values of up to max_value bytes. A get of an
+ * item that was read from the server less than ttl ms ago is answered
+ * from the cache, and an older entry is read again with a gets. Writes
+ * through a handle update the cache, while writes by others show after
+ * at most ttl ms. An item stored through the cache is dropped when its
+ * exptime has passed. The cache is split in shards with a lock each, so
+ * handles on different threads may share it, and evicts the entries that
+ * were not used for a whole turn of a CLOCK. Handles do not own the cache:
+ * destroy it after the handles that use it. NULL stops using a cache.
+ */
+struct NearCache;
+struct NearCache *libmemc_near_cache_create(int entries, size_t max_value, int ttl);
+void libmemc_near_cache_destroy(struct NearCache *cache);
+void libmemc_set_near_cache(struct Memcache *handle, struct NearCache *cache);
+void libmemc_near_cache_counters(struct NearCache *cache, uint64_t *hits,
+                                 uint64_t *misses, uint64_t *revalidations);
+
+/*
+ * Merge concurrent gets of the same key. A get of a key that another
+ * handle sharing the SingleFlight is already getting waits for that get
+ * and takes a copy of its outcome, instead of asking the server as well.
+ * With a near cache, only the gets it cannot answer are merged. Like a
+ * near cache, it is shared by handles on several threads and destroyed
+ * after them. libmemc_single_flight_counters() tells how many gets went
+ * to the servers and how many joined one of them.
+ */
+struct SingleFlight;
+struct SingleFlight *libmemc_single_flight_create(void);
+void libmemc_single_flight_destroy(struct SingleFlight *flights);
+void libmemc_set_single_flight(struct Memcache *handle, struct SingleFlight *flights);
+void libmemc_single_flight_counters(struct SingleFlight *flights, uint64_t *sent,
+                                    uint64_t *joined);
+
+/*
+ * Compress values of at least threshold bytes with a built-in LZ4 block
+ * codec, when that makes them smaller. A compressed value is stored with
+ * LIBMEMC_COMPRESSED set in its flags, and gets of the handle uncompress
+ * it and clear the bit again, so the bit is not free for other uses. The
+ * item passed to a store is left as it is. 0 turns it off (the default).
+ */
+#define LIBMEMC_COMPRESSED 0x80000000u
+void libmemc_set_compression(struct Memcache *handle, size_t threshold);
+
+/*
+ * Split values larger than chunk_size into chunks, so that values above
+ * the item size limit of the server can be stored. The chunks are stored
+ * under keys of their own with a version that is new for every store,
+ * written to the different servers in parallel. The item itself then gets
+ * a manifest with the version and a checksum of the value, with
+ * LIBMEMC_CHUNKED set in its flags. Add, replace and cas apply to the
+ * manifest, so a cas only replaces the value it read. Gets of the handle
+ * read the chunks with one multi-get per server and check them against
+ * the manifest. A chunk that has been evicted makes a miss. The chunks of
+ * a replaced value are deleted once the new manifest is stored, and those
+ * of a manifest that is not stored right away. 0 turns it off (the
+ * default). Returns -1 for a chunk size of 4 GB or more.
+ */
+#define LIBMEMC_CHUNKED 0x40000000u
+int libmemc_set_chunking(struct Memcache *handle, size_t chunk_size);
+
+/*
+ * Send values of at least threshold bytes with MSG_ZEROCOPY, so the
+ * kernel sends them straight from the item instead of copying them first.
+ * Stores wait for the kernel to release the item before they return.
+ * 0 turns it off. Returns -1 if a server falls back to copying because
+ * the system or the socket doesn't support it.
+ */
+int libmemc_set_zerocopy(struct Memcache *handle, size_t threshold);
 enum Protocol libmemc_get_protocol(struct Memcache *handle);
+enum Status libmemc_get_status(struct Server *server);
+const char* libmemc_strstatus(enum Status status);
 int libmemc_add(struct Memcache *handle, struct Item *item);
 int libmemc_set(struct Memcache *handle, struct Item *item);
 int libmemc_replace(struct Memcache *handle, struct Item *item);
 int libmemc_cas(struct Memcache *handle, struct Item *item);
 int libmemc_get(struct Memcache *handle, struct Item *item);
 int libmemc_gets(struct Server *server, enum Protocol protocol, struct Item item[], int items);
+
+/*
+ * Get many items from the servers of the handle. The keys are grouped by
+ * the server they map to and read in batches of a bounded number of
+ * keys, with a batch in flight on every server at once. Each item gets
+ * its own status, like with libmemc_get(). Chunked and compressed values
+ * are put together again. With replicas, the first replica of a key is
+ * read. The near cache and the merging of gets are not used. Returns -1
+ * if an item could not be read for another reason than a miss.
+ */
+int libmemc_multi_get(struct Memcache *handle, struct Item item[], int items);
+
 int libmemc_incr(struct Memcache *handle, struct Item *item, uint64_t delta);
 int libmemc_decr(struct Memcache *handle, struct Item *item, uint64_t delta);
 int libmemc_delete(struct Memcache *handle, struct Item *item);
 int libmemc_flush_all(struct Memcache *handle, long exptime);
 char* libmemc_stats(struct Server *server, enum Protocol protocol, const char* stats_type);
+
+/*
+ * A table of stats parsed from a "stats" reply. The same table may be
+ * passed to libmemc_stats_fetch() again and again, and reuses its memory.
+ * Names and values returned are valid until the next fetch.
+ */
+struct Stats;
+struct Stats* libmemc_stats_create(void);
+void libmemc_stats_destroy(struct Stats *stats);
+int libmemc_stats_fetch(struct Server *server, enum Protocol protocol,
+                        const char* stats_type, struct Stats *stats);
+int libmemc_stats_count(const struct Stats *stats);
+const char* libmemc_stats_name(const struct Stats *stats, int idx);
+const char* libmemc_stats_value(const struct Stats *stats, const char *name);
+int libmemc_stats_int64(const struct Stats *stats, const char *name, int64_t *value);
 int libmemc_connect_server(const char *hostname, in_port_t port);
 
+/*
+ * Load a corpus file into the servers with pipelined sets. The file is
+ * mapped into memory and the values are sent straight from the mapping.
+ * Each record has the same layout as the body of a textual "set":
+ *    <key> <flags> <exptime> <bytes>\r\n<data>\r\n
+ * Returns the number of records stored, or -1 on error.
+ */
+ssize_t libmemc_load_corpus(struct Memcache *handle, const char *filename);
+
+/*
+ * A client for the UDP port of a single server. Gets are sent as textual
+ * "gets" requests, each with its own request id, and up to 256 of them
+ * are kept in flight. Replies that span several datagrams are put back
+ * together by sequence number. A request that gets no complete reply
+ * within the timeout is sent again with a new request id, and the item
+ * gets the status Timeout once the retries are used up.
+ */
+struct UdpClient;
+
+struct UdpCounters {
+   uint64_t requests;   /* request datagrams sent, retries included */
+   uint64_t replies;    /* replies reassembled */
+   uint64_t packets;    /* reply datagrams received */
+   uint64_t stray;      /* duplicate or late reply datagrams */
+   uint64_t timeouts;   /* requests without a complete reply in time */
+   uint64_t retries;
+   uint64_t lost;       /* reply datagrams missing when requests timed out */
+   uint64_t latency;    /* total usec from request to reassembled reply */
+};
+
+struct UdpClient* libmemc_udp_create(const char *host, in_port_t port);
+void libmemc_udp_destroy(struct UdpClient *client);
+void libmemc_udp_set_timeout(struct UdpClient *client, int msec, int retries);
+void libmemc_udp_get_counters(struct UdpClient *client, struct UdpCounters *counters);
+int libmemc_udp_gets(struct UdpClient *client, struct Item item[], int items);
+
+/*
+ * Thread-per-core runtime. Every core runs a pinned thread with its own
+ * connections to all the servers, and a request goes to the core picked
+ * by the hash of its key, so the cores share no state. One thread submits
+ * the requests and collects them once they are done, through lock-free
+ * single producer, single consumer queues. The servers are added before
+ * the runtime is started. libmemc_shards_submit() returns -1 when the
+ * queue of the core is full; collect some requests and try again. It
+ * also returns -1 for the requests of a core that failed to start.
+ */
+struct Shards;
+
+enum ShardCommand { ShardGet, ShardSet, ShardDelete };
+
+struct ShardRequest {
+   enum ShardCommand command;
+   struct Item *item;
+   int ret;          /* what libmemc_get(), _set() or _delete() returned */
+   void *cookie;     /* for the caller */
+};
+
+struct Shards* libmemc_shards_create(enum Protocol protocol, int cores);
+void libmemc_shards_destroy(struct Shards *shards);
+int libmemc_shards_add_server(struct Shards *shards, const char *host, in_port_t port);
+int libmemc_shards_add_server_unix(struct Shards *shards, const char *path);
+int libmemc_shards_start(struct Shards *shards);
+int libmemc_shards_submit(struct Shards *shards, struct ShardRequest *request);
+int libmemc_shards_complete(struct Shards *shards, struct ShardRequest *done[], int max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include "libmemc.h"
+#include "libmemcbench.h"
+
+uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucket_index(uint64_t usec)
+{
+    if (usec < 2 * BENCH_SUB_BUCKETS) {
+        return usec;
+    }
+#ifdef __GNUC__
+    int msb = 63 - __builtin_clzll(usec);
+#else
+    int msb = 6;
+    while ((usec >> (msb + 1)) != 0) {
+        ++msb;
+    }
+#endif
+    int shift = msb - 5;
+    int index = (shift + 1) * BENCH_SUB_BUCKETS + (usec >> shift) - BENCH_SUB_BUCKETS;
+    return (index < BENCH_BUCKETS) ? index : BENCH_BUCKETS - 1;
+}
+
+static uint64_t bucket_value(int index)
+{
+    if (index < 2 * BENCH_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / BENCH_SUB_BUCKETS - 1;
+    return (uint64_t)(index % BENCH_SUB_BUCKETS + BENCH_SUB_BUCKETS) << shift;
+}
+
+void bench_histogram_add(struct bench_histogram *histogram, uint64_t usec)
+{
+    histogram->count++;
+    histogram->sum += usec;
+    if (usec > histogram->max)
+        histogram->max = usec;
+    histogram->buckets[bucket_index(usec)]++;
+}
+
+void bench_histogram_merge(struct bench_histogram *to,
+                           const struct bench_histogram *from)
+{
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+    for (int i=0; i<BENCH_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+}
+
+uint64_t bench_histogram_percentile(const struct bench_histogram *histogram,
+                                    double percentile)
+{
+    uint64_t rank = (uint64_t)(histogram->count * percentile / 100.0);
+    uint64_t seen = 0;
+    for (int i=0; i<BENCH_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+            return bucket_value(i);
+    }
+    return histogram->max;
+}
+
+void bench_report(FILE *out, const char *name, uint64_t elapsed,
+                  const struct bench_histogram *histogram)
+{
+    double seconds = elapsed / 1000000.0;
+    fprintf(out, "%-12s ops %llu  ops/s %.0f  avg %.1f us  "
+            "p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu us\n",
+            name, (unsigned long long)histogram->count,
+            (seconds > 0) ? histogram->count / seconds : 0.0,
+            histogram->count ? (double)histogram->sum / histogram->count : 0.0,
+            (unsigned long long)bench_histogram_percentile(histogram, 50),
+            (unsigned long long)bench_histogram_percentile(histogram, 90),
+            (unsigned long long)bench_histogram_percentile(histogram, 99),
+            (unsigned long long)bench_histogram_percentile(histogram, 99.9),
+            (unsigned long long)histogram->max);
+    fflush(out);
+}
+
+/* Connect to the unix socket of the configuration if there is one, or
+ * else to its host and port */
+struct Memcache *bench_connect(const struct bench_config *config)
+{
+    struct Memcache *memcache = libmemc_create(config->protocol);
+    if (memcache == NULL)
+        return NULL;
+
+    int ret;
+    if (config->unixpath != NULL)
+        ret = libmemc_add_server_unix(memcache, config->unixpath);
+    else
+        ret = libmemc_add_server(memcache, config->host, config->port);
+    if (ret == -1) {
+        fprintf(stderr, "Could not add server\n");
+        libmemc_destroy(memcache);
+        return NULL;
+    }
+    if (config->zerocopy > 0 && libmemc_set_zerocopy(memcache, config->zerocopy) == -1)
+        fprintf(stderr, "MSG_ZEROCOPY is not supported, copying instead\n");
+    if (config->compress > 0)
+        libmemc_set_compression(memcache, config->compress);
+    if (config->hedge > 0 && libmemc_set_hedging(memcache, config->hedge, 0) == -1)
+        fprintf(stderr, "Could not hedge the gets\n");
+    if (config->nearcache != NULL)
+        libmemc_set_near_cache(memcache, config->nearcache);
+    if (config->flights != NULL)
+        libmemc_set_single_flight(memcache, config->flights);
+    return memcache;
+}
+
+/**
+ * Stats sampler
+ */
+struct bench_sampler {
+    struct Memcache *memcache;
+    struct Stats *general;
+    struct Stats *slabs;
+    struct Stats *items;
+    FILE *out;
+    int interval;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* The counters we report a rate for, and the value of the last sample */
+struct sample {
+    uint64_t time;
+    int64_t get_hits;
+    int64_t evictions;
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t items_evicted;
+};
+
+static int64_t stat_or_zero(const struct Stats *stats, const char *name)
+{
+    int64_t value = 0;
+    libmemc_stats_int64(stats, name, &value);
+    return value;
+}
+
+/* Sum the per slab class "items:<class>:evicted" counters */
+static int64_t items_evicted(const struct Stats *stats)
+{
+    int64_t total = 0;
+    for (int i=0; i<libmemc_stats_count(stats); i++) {
+        const char *name = libmemc_stats_name(stats, i);
+        const char *suffix = strrchr(name, ':');
+        if (suffix != NULL && !strcmp(suffix, ":evicted")) {
+            total += stat_or_zero(stats, name);
+        }
+    }
+    return total;
+}
+
+static int sampler_poll(struct bench_sampler *sampler, struct sample *sample)
+{
+    struct Server *server = libmemc_get_server_no(sampler->memcache, 0);
+    enum Protocol protocol = libmemc_get_protocol(sampler->memcache);
+
+    if (libmemc_stats_fetch(server, protocol, NULL, sampler->general) == -1 ||
+        libmemc_stats_fetch(server, protocol, "slabs", sampler->slabs) == -1 ||
+        libmemc_stats_fetch(server, protocol, "items", sampler->items) == -1) {
+        return -1;
+    }
+
+    sample->time = bench_now();
+    sample->get_hits = stat_or_zero(sampler->general, "get_hits");
+    sample->evictions = stat_or_zero(sampler->general, "evictions");
+    sample->bytes_read = stat_or_zero(sampler->general, "bytes_read");
+    sample->bytes_written = stat_or_zero(sampler->general, "bytes_written");
+    sample->items_evicted = items_evicted(sampler->items);
+    return 0;
+}
+
+static void *sampler_main(void *arg)
+{
+    struct bench_sampler *sampler = arg;
+    struct sample prev;
+    struct sample cur;
+
+    if (sampler_poll(sampler, &prev) == -1) {
+        fprintf(stderr, "stats sampler: %s\n",
+                libmemc_strstatus(libmemc_get_status(
+                    libmemc_get_server_no(sampler->memcache, 0))));
+        return NULL;
+    }
+    uint64_t start = prev.time;
+
+    fprintf(sampler->out, "# time get_hits/s evictions/s bytes_read/s "
+            "bytes_written/s curr_connections total_malloced items_evicted/s\n");
+
+    pthread_mutex_lock(&sampler->lock);
+    while (!sampler->stop) {
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        uint64_t usec = now.tv_usec + (uint64_t)sampler->interval * 1000;
+        deadline.tv_sec = now.tv_sec + usec / 1000000;
+        deadline.tv_nsec = (usec % 1000000) * 1000;
+        pthread_cond_timedwait(&sampler->cond, &sampler->lock, &deadline);
+        if (sampler->stop)
+            break;
+        pthread_mutex_unlock(&sampler->lock);
+
+        if (sampler_poll(sampler, &cur) == 0) {
+            double seconds = (cur.time - prev.time) / 1000000.0;
+            fprintf(sampler->out, "%.3f %.0f %.0f %.0f %.0f %lld %lld %.0f\n",
+                    (cur.time - start) / 1000000.0,
+                    (cur.get_hits - prev.get_hits) / seconds,
+                    (cur.evictions - prev.evictions) / seconds,
+                    (cur.bytes_read - prev.bytes_read) / seconds,
+                    (cur.bytes_written - prev.bytes_written) / seconds,
+                    (long long)stat_or_zero(sampler->general, "curr_connections"),
+                    (long long)stat_or_zero(sampler->slabs, "total_malloced"),
+                    (cur.items_evicted - prev.items_evicted) / seconds);
+            fflush(sampler->out);
+            prev = cur;
+        }
+
+        pthread_mutex_lock(&sampler->lock);
+    }
+    pthread_mutex_unlock(&sampler->lock);
+
+    return NULL;
+}
+
+struct bench_sampler *bench_sampler_start(const struct bench_config *config,
+                                          FILE *out)
+{
+    struct bench_sampler *sampler = calloc(1, sizeof(*sampler));
+    if (sampler == NULL)
+        return NULL;
+
+    sampler->memcache = libmemc_create(config->protocol);
+    sampler->general = libmemc_stats_create();
+    sampler->slabs = libmemc_stats_create();
+    sampler->items = libmemc_stats_create();
+    if (sampler->memcache == NULL || sampler->general == NULL ||
+        sampler->slabs == NULL || sampler->items == NULL ||
+        libmemc_add_server(sampler->memcache, config->host, config->port) == -1) {
+        bench_sampler_stop(sampler);
+        return NULL;
+    }
+    sampler->out = out;
+    sampler->interval = config->interval;
+    pthread_mutex_init(&sampler->lock, NULL);
+    pthread_cond_init(&sampler->cond, NULL);
+
+    if (pthread_create(&sampler->thread, NULL, sampler_main, sampler) != 0) {
+        fprintf(stderr, "Failed to start stats sampler: %s\n", strerror(errno));
+        pthread_mutex_destroy(&sampler->lock);
+        pthread_cond_destroy(&sampler->cond);
+        sampler->interval = 0;
+        bench_sampler_stop(sampler);
+        return NULL;
+    }
+
+    return sampler;
+}
+
+void bench_sampler_stop(struct bench_sampler *sampler)
+{
+    if (sampler == NULL)
+        return;
+
+    if (sampler->interval > 0) {
+        pthread_mutex_lock(&sampler->lock);
+        sampler->stop = 1;
+        pthread_cond_signal(&sampler->cond);
+        pthread_mutex_unlock(&sampler->lock);
+        pthread_join(sampler->thread, NULL);
+        pthread_mutex_destroy(&sampler->lock);
+        pthread_cond_destroy(&sampler->cond);
+    }
+
+    if (sampler->memcache != NULL)
+        libmemc_destroy(sampler->memcache);
+    libmemc_stats_destroy(sampler->general);
+    libmemc_stats_destroy(sampler->slabs);
+    libmemc_stats_destroy(sampler->items);
+    free(sampler);
+}
+
+/**
+ * Work-stealing scheduler
+ */
+
+// Ranges are halved down to the grain, so a deque holds one per level
+#define BENCH_DEQUE 64
+
+struct bench_range {
+    uint64_t begin;
+    uint64_t end;
+};
+
+// The owner pushes and pops at the bottom, thieves take from the top
+struct bench_deque {
+    pthread_mutex_t lock;
+    int top;
+    int bottom;
+    struct bench_range ranges[BENCH_DEQUE];
+};
+
+struct bench_worker {
+    struct bench_scheduler *scheduler;
+    int id;
+    pthread_t thread;
+    void *local;
+    unsigned int seed;
+    uint64_t tasks;
+    uint64_t steals;
+    struct bench_deque deque;
+};
+
+struct bench_scheduler {
+    int workers;
+    struct bench_worker *worker;
+    void *(*setup)(int worker, void *arg);
+    void (*teardown)(void *local);
+    void *setup_arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int phase;          // bumped for every run
+    int ready;          // workers that are set up
+    int finished;       // workers done with the current phase
+    int quit;
+
+    bench_task_fn task;
+    void *arg;
+    uint64_t grain;
+    uint64_t remaining; // keys or requests of the phase not run yet, under lock
+};
+
+static int deque_push(struct bench_deque *deque, struct bench_range range)
+{
+    int ret = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom < BENCH_DEQUE) {
+        deque->ranges[deque->bottom++] = range;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+static int deque_pop(struct bench_deque *deque, struct bench_range *range)
+{
+    int ret = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *range = deque->ranges[--deque->bottom];
+        ret = 0;
+    }
+    if (deque->bottom == deque->top)
+        deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+static int deque_steal(struct bench_deque *deque, struct bench_range *range)
+{
+    int ret = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *range = deque->ranges[deque->top++];
+        ret = 0;
+    }
+    if (deque->bottom == deque->top)
+        deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+// Try the other workers in a random order until one has a range to spare
+static int steal(struct bench_worker *worker, struct bench_range *range)
+{
+    struct bench_scheduler *scheduler = worker->scheduler;
+    int first = rand_r(&worker->seed) % scheduler->workers;
+    for (int i=0; i<scheduler->workers; i++) {
+        struct bench_worker *victim = &scheduler->worker[(first + i) % scheduler->workers];
+        if (victim != worker && deque_steal(&victim->deque, range) == 0) {
+            worker->steals++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void run_range(struct bench_worker *worker, struct bench_range range)
+{
+    struct bench_scheduler *scheduler = worker->scheduler;
+    while (range.end - range.begin > scheduler->grain) {
+        uint64_t mid = range.begin + (range.end - range.begin) / 2;
+        struct bench_range upper = { mid, range.end };
+        if (deque_push(&worker->deque, upper) == -1)
+            break;
+        range.end = mid;
+    }
+    scheduler->task(worker->local, range.begin, range.end, scheduler->arg);
+    worker->tasks++;
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->remaining -= range.end - range.begin;
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+static uint64_t phase_remaining(struct bench_scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    uint64_t remaining = scheduler->remaining;
+    pthread_mutex_unlock(&scheduler->lock);
+    return remaining;
+}
+
+static void *scheduler_main(void *arg)
+{
+    struct bench_worker *worker = arg;
+    struct bench_scheduler *scheduler = worker->scheduler;
+
+    worker->local = scheduler->setup(worker->id, scheduler->setup_arg);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->ready++;
+    pthread_cond_broadcast(&scheduler->done);
+    int phase = 0;
+    for (;;) {
+        while (scheduler->phase == phase && !scheduler->quit)
+            pthread_cond_wait(&scheduler->start, &scheduler->lock);
+        if (scheduler->quit)
+            break;
+        phase = scheduler->phase;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        while (phase_remaining(scheduler) > 0) {
+            struct bench_range range;
+            if (deque_pop(&worker->deque, &range) == 0 || steal(worker, &range) == 0)
+                run_range(worker, range);
+            else
+                sched_yield();
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        if (++scheduler->finished == scheduler->workers)
+            pthread_cond_signal(&scheduler->done);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if (scheduler->teardown != NULL)
+        scheduler->teardown(worker->local);
+    return NULL;
+}
+
+struct bench_scheduler *bench_scheduler_create(int workers,
+                                               void *(*setup)(int worker, void *arg),
+                                               void (*teardown)(void *local),
+                                               void *arg)
+{
+    struct bench_scheduler *scheduler = calloc(1, sizeof(*scheduler));
+    if (scheduler == NULL)
+        return NULL;
+    scheduler->worker = calloc(workers, sizeof(struct bench_worker));
+    if (scheduler->worker == NULL) {
+        free(scheduler);
+        return NULL;
+    }
+    scheduler->setup = setup;
+    scheduler->teardown = teardown;
+    scheduler->setup_arg = arg;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->start, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+
+    uint64_t seed = bench_now();
+    for (int i=0; i<workers; i++) {
+        struct bench_worker *worker = &scheduler->worker[i];
+        worker->scheduler = scheduler;
+        worker->id = i;
+        worker->seed = seed + i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        if (pthread_create(&worker->thread, NULL, scheduler_main, worker) != 0) {
+            fprintf(stderr, "Failed to start worker: %s\n", strerror(errno));
+            bench_scheduler_destroy(scheduler);
+            return NULL;
+        }
+        scheduler->workers++;
+    }
+
+    // wait for the workers to connect
+    pthread_mutex_lock(&scheduler->lock);
+    while (scheduler->ready < scheduler->workers)
+        pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return scheduler;
+}
+
+void bench_scheduler_run(struct bench_scheduler *scheduler, bench_task_fn task,
+                         void *arg, uint64_t begin, uint64_t end, uint64_t grain)
+{
+    if (end <= begin)
+        return;
+
+    scheduler->task = task;
+    scheduler->arg = arg;
+    scheduler->grain = (grain > 0) ? grain : 1;
+    scheduler->remaining = end - begin;
+
+    // an even share to start with, the stealing takes care of the rest
+    uint64_t share = (end - begin) / scheduler->workers;
+    for (int i=0; i<scheduler->workers; i++) {
+        struct bench_range range = { begin + i * share, begin + (i + 1) * share };
+        if (i == scheduler->workers - 1)
+            range.end = end;
+        if (range.end > range.begin)
+            deque_push(&scheduler->worker[i].deque, range);
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->finished = 0;
+    scheduler->phase++;
+    pthread_cond_broadcast(&scheduler->start);
+    while (scheduler->finished < scheduler->workers)
+        pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void *bench_scheduler_local(struct bench_scheduler *scheduler, int worker)
+{
+    return scheduler->worker[worker].local;
+}
+
+void bench_scheduler_counters(struct bench_scheduler *scheduler,
+                              uint64_t *tasks, uint64_t *steals)
+{
+    *tasks = 0;
+    *steals = 0;
+    for (int i=0; i<scheduler->workers; i++) {
+        *tasks += scheduler->worker[i].tasks;
+        *steals += scheduler->worker[i].steals;
+    }
+}
+
+void bench_scheduler_destroy(struct bench_scheduler *scheduler)
+{
+    if (scheduler == NULL)
+        return;
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->quit = 1;
+    pthread_cond_broadcast(&scheduler->start);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (int i=0; i<scheduler->workers; i++) {
+        pthread_join(scheduler->worker[i].thread, NULL);
+        pthread_mutex_destroy(&scheduler->worker[i].deque.lock);
+    }
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->start);
+    pthread_cond_destroy(&scheduler->done);
+    free(scheduler->worker);
+    free(scheduler);
+}
@@ -0,0 +1,112 @@
+#ifndef LIBMEMCBENCH_H
+#define	LIBMEMCBENCH_H
+
+#ifdef __cplusplus
+extern "C"  {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include "libmemc.h"
+
+struct bench_config {
+    const char *mode;   /* "tcp", "udp", "udpflood", "unix", "large", "shards"
+                         * or "phases" */
+    const char *host;
+    int port;
+    int udpport;
+    const char *unixpath; /* used instead of host and port when set */
+    enum Protocol protocol;
+    int threads;        /* or cores in the shards mode */
+    int duration;       /* seconds */
+    int keys;
+    size_t valuesize;
+    size_t zerocopy;    /* MSG_ZEROCOPY threshold, 0 to copy everything */
+    size_t compress;    /* values of at least this size are compressed, 0 none */
+    double hedge;       /* percentile of the get latency to hedge at, 0 not to */
+    struct NearCache *nearcache; /* shared by the connections, NULL for none */
+    struct SingleFlight *flights; /* likewise, merges concurrent gets of a key */
+    int getratio;       /* percentage of the requests that are gets */
+    int batch;          /* gets per multi-get in the udp modes, requests
+                         * in flight in the shards mode */
+    int udptimeout;     /* ms before a udp get is sent again or dropped */
+    int udpretries;
+    int packets;        /* udpflood runs values of 1 to packets datagrams */
+    int operations;     /* requests in the measure phase of the phases mode */
+    int grain;          /* smallest task of the phases mode */
+    int interval;       /* stats sampling interval in ms, 0 disables it */
+    const char *output; /* results file, the stats go to <output>.stats */
+};
+
+/* Latency histogram in microseconds, with 32 linear sub-buckets for
+ * every power of two. The relative error is below 1/32 */
+#define BENCH_SUB_BUCKETS 32
+#define BENCH_BUCKETS (60 * BENCH_SUB_BUCKETS)
+
+struct bench_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[BENCH_BUCKETS];
+};
+
+uint64_t bench_now(void);
+
+struct Memcache *bench_connect(const struct bench_config *config);
+
+void bench_histogram_add(struct bench_histogram *histogram, uint64_t usec);
+
+void bench_histogram_merge(struct bench_histogram *to,
+                           const struct bench_histogram *from);
+
+uint64_t bench_histogram_percentile(const struct bench_histogram *histogram,
+                                    double percentile);
+
+void bench_report(FILE *out, const char *name, uint64_t elapsed,
+                  const struct bench_histogram *histogram);
+
+/*
+ * Background sampler that polls the general, slabs and items stats over
+ * its own connection and writes the per-second rates as one line per
+ * interval.
+ */
+struct bench_sampler;
+
+struct bench_sampler *bench_sampler_start(const struct bench_config *config,
+                                          FILE *out);
+
+void bench_sampler_stop(struct bench_sampler *sampler);
+
+/*
+ * Work-stealing scheduler. A phase is a range of keys or requests that is
+ * first split evenly across the workers. A worker splits a range it picks
+ * up in halves, keeps the lower half and pushes the upper one on its own
+ * deque, until the range is down to the grain. Idle workers steal the
+ * oldest, and so largest, range from the deque of a random other worker.
+ * Each worker calls setup once on its own thread for the state that it
+ * passes to the tasks, such as its connection.
+ */
+struct bench_scheduler;
+
+typedef void (*bench_task_fn)(void *local, uint64_t begin, uint64_t end, void *arg);
+
+struct bench_scheduler *bench_scheduler_create(int workers,
+                                               void *(*setup)(int worker, void *arg),
+                                               void (*teardown)(void *local),
+                                               void *arg);
+
+void bench_scheduler_run(struct bench_scheduler *scheduler, bench_task_fn task,
+                         void *arg, uint64_t begin, uint64_t end, uint64_t grain);
+
+void *bench_scheduler_local(struct bench_scheduler *scheduler, int worker);
+
+void bench_scheduler_counters(struct bench_scheduler *scheduler,
+                              uint64_t *tasks, uint64_t *steals);
+
+void bench_scheduler_destroy(struct bench_scheduler *scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* LIBMEMCBENCH_H */
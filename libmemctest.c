@@ -50,33 +50,34 @@ void setItem(struct Item *item,
     item->key = key;
     item->keylen = keylen;
     item->flags = flags;
-    if (item->data != NULL) {
-        free(item->data);
-    }
-    item->data = NULL;
     item->errmsg = 0;
     item->exptime = exptime;
     
     if (size > 0) {
-        item->data = malloc(size);
+        // reuse the current buffer if it is big enough
+        if (size > item->capacity) {
+            free(item->data);
+            item->data = malloc(size);
+            item->capacity = (item->data != NULL) ? size : 0;
+        }
         if (item->data != NULL) {
             memcpy(item->data, data, size);
             item->size = size;
-            item->errmsg = 0;
         } else {
             item->size = 0;
-            char errmsg2[200];
             char key2[100];
             int k = keylen > 99 ? 99 : keylen;
             memcpy(key2, key, k);
             memset(key2 + k, 0 ,1);
-            sprintf(errmsg2, "(libmemctest.c) setItem function: malloc failed for key: %s\n", key2);
-            fprintf(stderr, errmsg2);
+            fprintf(stderr, "(libmemctest.c) setItem function: malloc failed for key: %s\n", key2);
             fflush(stderr);
-            item->errmsg = strdup(errmsg2);
+            item->errmsg = "setItem function: malloc failed";
         }        
     } else {
+        free(item->data);
+        item->data = NULL;
         item->size = 0;
+        item->capacity = 0;
     }
 }
 
@@ -107,14 +108,16 @@ int mem_get_is(struct Memcache* mc, const struct Item *item,
     struct Item item_recv = {0};
     item_recv.key = item->key;
     item_recv.keylen = item->keylen;
-    int ret_get = libmemc_get(mc, &item_recv);
+    libmemc_get(mc, &item_recv);
 
-    return ok_test(
+    int ret = ok_test(
             ((item_recv.size == item->size) && 
             (item_recv.flags == item->flags) &&
             (!memcmp(item_recv.data, item->data, item->size))) ||
             ((item_recv.size == 0) && (item->data == NULL)),
             msg_ok, msg_not_ok);
+    free(item_recv.data);
+    return ret;
 }
 
 int mem_gets_is(struct Memcache* mc, const struct Item *item,
@@ -125,13 +128,15 @@ int mem_gets_is(struct Memcache* mc, const struct Item *item,
     item_recv.keylen = item->keylen;
 
     libmemc_get(mc, &item_recv);
-    return ok_test(
+    int ret = ok_test(
             ((item_recv.size == item->size) && 
             (item_recv.flags == item->flags) &&
             (item_recv.cas_id == item->cas_id) &&
             (!memcmp(item_recv.data, item->data, item->size))) ||
             ((item_recv.size == 0) && (item->data == NULL)),
             msg_ok, msg_not_ok);
+    free(item_recv.data);
+    return ret;
 }
 
 static struct addrinfo *lookuphost(const char *hostname, in_port_t port,
@@ -51,12 +51,13 @@ int main(int argc, char **argv)
     mem_get_is(memcache, &item, "big found", "big not found");
 
     // no evictions yet
-    char *stats = libmemc_stats(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), NULL);
-    char *ptr_evictions = (!stats) ? NULL : strstr(stats, "evictions");
-    if (!ptr_evictions) {
+    struct Stats *stats = libmemc_stats_create();
+    int64_t evictions;
+    if (libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), NULL, stats) == -1 ||
+        libmemc_stats_int64(stats, "evictions", &evictions) == -1) {
         fprintf(stderr,"Could not find evictions in stats\n");
     } else {
-        ok_test(atoi(ptr_evictions + strlen("evictions")+1) == 0, "no evictions to start", "evictions to start");
+        ok_test(evictions == 0, "no evictions to start", "evictions to start");
     }
 
     // set many big items, enough to get evictions
@@ -72,13 +73,13 @@ int main(int argc, char **argv)
     }
 
     // some evictions should have happened
-    stats = libmemc_stats(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), NULL);
-    ptr_evictions = (!stats) ? NULL : strstr(stats, "evictions");
-    if (!ptr_evictions) {
+    if (libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), NULL, stats) == -1 ||
+        libmemc_stats_int64(stats, "evictions", &evictions) == -1) {
         fprintf(stderr,"Could not find evictions in stats\n");
     } else {
-        ok_test(atoi(ptr_evictions + strlen("evictions")+1) == 37, "some evictions happened", "wrong number of evictions happened");
+        ok_test(evictions == 37, "some evictions happened", "wrong number of evictions happened");
     }
+    libmemc_stats_destroy(stats);
 
     // the first big value should be gone
     setItem(&item, 0, "big", 3, 0, NULL, 0, 0);
@@ -0,0 +1,979 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+#include "libmemcbench.h"
+
+/* Reply bytes per datagram, a little under the 1400 of memcached */
+#define UDP_PAYLOAD 1390
+
+/* The queue of a core holds 1024 requests */
+#define SHARD_INFLIGHT 1024
+
+/* Opcodes and header size of the binary protocol, for the decode mode */
+#define BINARY_GETKQ 0x0d
+#define BINARY_NOOP 0x0a
+#define BINARY_HEADER 24
+
+struct worker {
+    const struct bench_config *config;
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t deadline;
+    uint64_t errors;
+    uint64_t hedged;
+    uint64_t won;
+    struct bench_histogram gets;
+    struct bench_histogram sets;
+    struct UdpCounters udp;
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mcbench [-t|-b] [-m tcp|udp|udpflood|unix|large|shards|phases|decode]\n"
+            "               [-p memcached path]\n"
+            "               [-H host -P port -U udp port -u unix socket]\n"
+            "               [-c threads] [-d seconds]\n"
+            "               [-k keys] [-s value size] [-g get percentage]\n"
+            "               [-B udp batch] [-T udp timeout ms] [-N max packets]\n"
+            "               [-n requests] [-G grain]\n"
+            "               [-z zerocopy threshold] [-e hedge percentile]\n"
+            "               [-L near cache entries] [-F] [-C compression threshold]\n"
+            "               [-i stats interval ms] [-o results]\n");
+    exit(1);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    const struct bench_config *config = worker->config;
+
+    struct Memcache *memcache = bench_connect(config);
+    if (memcache == NULL)
+        return NULL;
+
+    char *value = malloc(config->valuesize);
+    memset(value, 'x', config->valuesize);
+    struct Item item = {0};
+    char key[32];
+
+    while (bench_now() < worker->deadline) {
+        item.keylen = sprintf(key, "bench_%d", rand_r(&worker->seed) % config->keys);
+        item.key = key;
+
+        uint64_t start = bench_now();
+        int ret;
+        if (rand_r(&worker->seed) % 100 < config->getratio) {
+            ret = libmemc_get(memcache, &item);
+            bench_histogram_add(&worker->gets, bench_now() - start);
+        } else {
+            void *data = item.data;
+            size_t capacity = item.capacity;
+            item.data = value;
+            item.size = config->valuesize;
+            item.cas_id = 0;
+            ret = libmemc_set(memcache, &item);
+            bench_histogram_add(&worker->sets, bench_now() - start);
+            item.data = data;
+            item.capacity = capacity;
+        }
+        if (ret == -1 && item.status != NotFound)
+            worker->errors++;
+    }
+
+    libmemc_hedge_counters(memcache, &worker->hedged, &worker->won);
+    free(item.data);
+    free(value);
+    libmemc_destroy(memcache);
+    return NULL;
+}
+
+/* Multi-gets of random keys over UDP. The latency is that of a whole
+ * batch, the per request latency is in the UDP counters */
+static void *udp_worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    const struct bench_config *config = worker->config;
+
+    struct UdpClient *udp = libmemc_udp_create(config->host, config->udpport);
+    if (udp == NULL) {
+        fprintf(stderr, "Could not create UDP client\n");
+        return NULL;
+    }
+    libmemc_udp_set_timeout(udp, config->udptimeout, config->udpretries);
+
+    struct Item *items = calloc(config->batch, sizeof(struct Item));
+    char (*keys)[32] = malloc(config->batch * sizeof(*keys));
+
+    while (bench_now() < worker->deadline) {
+        for (int i=0; i<config->batch; i++) {
+            items[i].keylen = sprintf(keys[i], "bench_%d", rand_r(&worker->seed) % config->keys);
+            items[i].key = keys[i];
+        }
+
+        uint64_t start = bench_now();
+        libmemc_udp_gets(udp, items, config->batch);
+        bench_histogram_add(&worker->gets, bench_now() - start);
+        for (int i=0; i<config->batch; i++) {
+            if (items[i].status != Success && items[i].status != NotFound)
+                worker->errors++;
+        }
+    }
+    libmemc_udp_get_counters(udp, &worker->udp);
+
+    for (int i=0; i<config->batch; i++) {
+        free(items[i].data);
+    }
+    free(items);
+    free(keys);
+    libmemc_udp_destroy(udp);
+    return NULL;
+}
+
+/* A request kept in flight through the thread-per-core runtime. The
+ * item has its own buffer for gets, and sets point it at the value */
+struct shard_slot {
+    struct ShardRequest request;
+    struct Item item;
+    char key[32];
+    void *data;
+    size_t capacity;
+    uint64_t start;
+};
+
+static void shard_issue(const struct bench_config *config, struct Shards *shards,
+                        struct shard_slot *slot, char *value, unsigned int *seed)
+{
+    slot->item.keylen = sprintf(slot->key, "bench_%d", rand_r(seed) % config->keys);
+    slot->item.key = slot->key;
+    slot->request.item = &slot->item;
+    if (rand_r(seed) % 100 < config->getratio) {
+        slot->request.command = ShardGet;
+    } else {
+        slot->request.command = ShardSet;
+        slot->item.data = value;
+        slot->item.size = config->valuesize;
+        slot->item.cas_id = 0;
+    }
+    slot->start = bench_now();
+    while (libmemc_shards_submit(shards, &slot->request) == -1)
+        sched_yield();
+}
+
+/* One thread keeps -B requests in flight, spread over -c cores that each
+ * have their own connection */
+static void run_shards(const struct bench_config *config, FILE *results)
+{
+    struct Shards *shards = libmemc_shards_create(config->protocol, config->threads);
+    int ret = (shards == NULL) ? -1 : 0;
+    if (ret == 0 && config->unixpath != NULL)
+        ret = libmemc_shards_add_server_unix(shards, config->unixpath);
+    else if (ret == 0)
+        ret = libmemc_shards_add_server(shards, config->host, config->port);
+    if (ret == -1 || libmemc_shards_start(shards) == -1) {
+        fprintf(stderr, "Could not start the cores\n");
+        exit(1);
+    }
+
+    int inflight = config->batch < SHARD_INFLIGHT ? config->batch : SHARD_INFLIGHT;
+    struct shard_slot *slots = calloc(inflight, sizeof(struct shard_slot));
+    struct ShardRequest **done = calloc(inflight, sizeof(struct ShardRequest *));
+    struct bench_histogram *gets = calloc(1, sizeof(*gets));
+    struct bench_histogram *sets = calloc(1, sizeof(*sets));
+    char *value = malloc(config->valuesize);
+    memset(value, 'x', config->valuesize);
+    uint64_t errors = 0;
+
+    uint64_t start = bench_now();
+    uint64_t deadline = start + config->duration * 1000000ULL;
+    unsigned int seed = start;
+    for (int i=0; i<inflight; i++) {
+        slots[i].request.cookie = &slots[i];
+        shard_issue(config, shards, &slots[i], value, &seed);
+    }
+
+    int pending = inflight;
+    while (pending > 0) {
+        int count = libmemc_shards_complete(shards, done, inflight);
+        uint64_t now = bench_now();
+        for (int i=0; i<count; i++) {
+            struct shard_slot *slot = done[i]->cookie;
+            if (slot->request.command == ShardSet) {
+                bench_histogram_add(sets, now - slot->start);
+                slot->item.data = slot->data;
+                slot->item.capacity = slot->capacity;
+            } else {
+                bench_histogram_add(gets, now - slot->start);
+                slot->data = slot->item.data;
+                slot->capacity = slot->item.capacity;
+            }
+            if (slot->request.ret == -1 && slot->item.status != NotFound)
+                errors++;
+            if (now < deadline)
+                shard_issue(config, shards, slot, value, &seed);
+            else
+                pending--;
+        }
+        if (count == 0)
+            sched_yield();
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    fprintf(results, "# %s protocol, %d cores, %d requests in flight, %d keys, "
+            "%zu byte values, %d%% gets\n",
+            config->protocol == Textual ? "textual" : "binary",
+            config->threads, inflight, config->keys, config->valuesize,
+            config->getratio);
+    bench_report(results, "get", elapsed, gets);
+    bench_report(results, "set", elapsed, sets);
+    fprintf(results, "errors %llu\n", (unsigned long long)errors);
+    fflush(results);
+
+    libmemc_shards_destroy(shards);
+    for (int i=0; i<inflight; i++)
+        free(slots[i].data);
+    free(slots);
+    free(done);
+    free(gets);
+    free(sets);
+    free(value);
+}
+
+/* Append a binary response to the reply of the decode mode */
+static char *put_response(char *ptr, int opcode, const char *key, size_t keylen,
+                          size_t valuesize, uint64_t cas)
+{
+    int extlen = (opcode == BINARY_GETKQ) ? 4 : 0;
+    uint16_t netkeylen = htons(keylen);
+    uint32_t bodylen = htonl(extlen + keylen + valuesize);
+    uint32_t cashigh = htonl(cas >> 32);
+    uint32_t caslow = htonl(cas);
+
+    memset(ptr, 0, BINARY_HEADER + extlen);
+    ptr[0] = (char)0x81;
+    ptr[1] = opcode;
+    memcpy(ptr + 2, &netkeylen, 2);
+    ptr[4] = extlen;
+    memcpy(ptr + 8, &bodylen, 4);
+    memcpy(ptr + 16, &cashigh, 4);
+    memcpy(ptr + 20, &caslow, 4);
+    ptr += BINARY_HEADER + extlen;
+    memcpy(ptr, key, keylen);
+    memset(ptr + keylen, 'x', valuesize);
+    return ptr + keylen + valuesize;
+}
+
+struct responder {
+    int sock;
+    size_t requestsize;
+    const char *reply;
+    size_t replysize;
+};
+
+/* Answer every multi-get with the same reply, read from memory */
+static void *responder_main(void *arg)
+{
+    struct responder *responder = arg;
+    char *buffer = malloc(responder->requestsize);
+
+    while (1) {
+        size_t offset = 0;
+        while (offset < responder->requestsize) {
+            ssize_t nread = recv(responder->sock, buffer + offset,
+                                 responder->requestsize - offset, 0);
+            if (nread <= 0) {
+                free(buffer);
+                return NULL;
+            }
+            offset += nread;
+        }
+        if (send(responder->sock, responder->reply, responder->replysize, 0) == -1)
+            break;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Append a value of the textual reply of the decode mode */
+static char *put_value(char *ptr, const char *key, size_t valuesize, uint64_t cas)
+{
+    ptr += sprintf(ptr, "VALUE %s 0 %zu %llu\r\n", key, valuesize,
+                   (unsigned long long)cas);
+    memset(ptr, 'x', valuesize);
+    memcpy(ptr + valuesize, "\r\n", 2);
+    return ptr + valuesize + 2;
+}
+
+/* Multi-gets of -B keys against a responder thread that replays a
+ * prepared reply over a socketpair, so that the time is the one spent in
+ * the client encoding the requests and decoding the responses */
+static void run_decode(const struct bench_config *config, FILE *results)
+{
+    int batch = config->batch;
+    int binary = (config->protocol != Textual);
+    struct Item *items = calloc(batch, sizeof(struct Item));
+    char (*keys)[32] = calloc(batch, sizeof(*keys));
+    char *reply = malloc((size_t)batch * (BINARY_HEADER + 64 + config->valuesize) +
+                         BINARY_HEADER);
+    char *ptr = reply;
+    size_t requestsize = binary ? BINARY_HEADER : strlen("gets\r\n");
+    for (int i=0; i<batch; i++) {
+        items[i].keylen = sprintf(keys[i], "decode_%d", i);
+        items[i].key = keys[i];
+        if (binary) {
+            ptr = put_response(ptr, BINARY_GETKQ, keys[i], items[i].keylen,
+                               config->valuesize, i + 1);
+            requestsize += BINARY_HEADER + items[i].keylen;
+        } else {
+            ptr = put_value(ptr, keys[i], config->valuesize, i + 1);
+            requestsize += 1 + items[i].keylen;
+        }
+    }
+    if (binary) {
+        ptr = put_response(ptr, BINARY_NOOP, NULL, 0, 0, 0);
+    } else {
+        memcpy(ptr, "END\r\n", 5);
+        ptr += 5;
+    }
+
+    int fds[2];
+    struct Memcache *memcache = libmemc_create(config->protocol);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1 ||
+        libmemc_add_server(memcache, "127.0.0.1", 11211) == -1) {
+        fprintf(stderr, "Could not set up the decode mode\n");
+        exit(1);
+    }
+    struct Server *server = libmemc_get_server_no(memcache, 0);
+    libmemc_set_socket(server, fds[0]);
+
+    struct responder responder = { fds[1], requestsize, reply, ptr - reply };
+    pthread_t thread;
+    pthread_create(&thread, NULL, responder_main, &responder);
+
+    struct bench_histogram *gets = calloc(1, sizeof(*gets));
+    uint64_t errors = 0;
+    uint64_t start = bench_now();
+    uint64_t deadline = start + config->duration * 1000000ULL;
+    uint64_t now = start;
+    while (now < deadline) {
+        if (libmemc_gets(server, config->protocol, items, batch) == -1 ||
+            items[batch - 1].status != Success)
+            errors++;
+        uint64_t end = bench_now();
+        bench_histogram_add(gets, end - now);
+        now = end;
+    }
+    uint64_t elapsed = now - start;
+
+    fprintf(results, "# decode, %s protocol, %d keys per multi-get, %zu byte values\n",
+            binary ? "binary" : "textual", batch, config->valuesize);
+    bench_report(results, "multiget", elapsed, gets);
+    fprintf(results, "keys/s %.0f ns/key %.1f\n",
+            (double)gets->count * batch * 1000000.0 / elapsed,
+            (double)elapsed * 1000.0 / ((double)gets->count * batch));
+    fprintf(results, "errors %llu\n", (unsigned long long)errors);
+    fflush(results);
+
+    libmemc_destroy(memcache);
+    pthread_join(thread, NULL);
+    close(fds[1]);
+    for (int i=0; i<batch; i++)
+        free(items[i].data);
+    free(items);
+    free(keys);
+    free(reply);
+    free(gets);
+}
+
+/* The phases mode has values that grow from -s to 9 times -s across the
+ * keys, so that evenly split key ranges are not the same amount of work */
+struct phase_worker {
+    const struct bench_config *config;
+    struct Memcache *memcache;
+    unsigned int seed;
+    char *value;
+    struct Item item;
+    uint64_t errors;
+    uint64_t mismatches;
+    struct bench_histogram gets;
+    struct bench_histogram sets;
+};
+
+static size_t phase_value_size(const struct bench_config *config, uint64_t key)
+{
+    return config->valuesize + config->valuesize * 8 * key / config->keys;
+}
+
+static void *phase_setup(int id, void *arg)
+{
+    const struct bench_config *config = arg;
+    struct phase_worker *worker = calloc(1, sizeof(struct phase_worker));
+    if (worker == NULL)
+        return NULL;
+    worker->config = config;
+    worker->seed = bench_now() + id;
+    worker->value = malloc(config->valuesize * 9);
+    worker->memcache = bench_connect(config);
+    return worker;
+}
+
+static void phase_teardown(void *local)
+{
+    struct phase_worker *worker = local;
+    if (worker == NULL)
+        return;
+    if (worker->memcache != NULL)
+        libmemc_destroy(worker->memcache);
+    free(worker->item.data);
+    free(worker->value);
+    free(worker);
+}
+
+static int phase_set(struct phase_worker *worker, uint64_t key)
+{
+    char keybuf[32];
+    struct Item item = {0};
+    item.keylen = sprintf(keybuf, "bench_%llu", (unsigned long long)key);
+    item.key = keybuf;
+    item.size = phase_value_size(worker->config, key);
+    memset(worker->value, 'a' + key % 26, item.size);
+    item.data = worker->value;
+
+    uint64_t start = bench_now();
+    int ret = libmemc_set(worker->memcache, &item);
+    bench_histogram_add(&worker->sets, bench_now() - start);
+    if (ret == -1)
+        worker->errors++;
+    return ret;
+}
+
+// Returns 1 if the key has the value that phase_set() stores
+static int phase_get(struct phase_worker *worker, uint64_t key)
+{
+    char keybuf[32];
+    worker->item.keylen = sprintf(keybuf, "bench_%llu", (unsigned long long)key);
+    worker->item.key = keybuf;
+
+    uint64_t start = bench_now();
+    int ret = libmemc_get(worker->memcache, &worker->item);
+    bench_histogram_add(&worker->gets, bench_now() - start);
+    if (ret == -1) {
+        if (worker->item.status != NotFound)
+            worker->errors++;
+        return 0;
+    }
+
+    const char *data = worker->item.data;
+    size_t size = phase_value_size(worker->config, key);
+    if (worker->item.size != size)
+        return 0;
+    for (size_t i=0; i<size; i++) {
+        if (data[i] != 'a' + key % 26)
+            return 0;
+    }
+    return 1;
+}
+
+static void load_task(void *local, uint64_t begin, uint64_t end, void *arg)
+{
+    for (uint64_t key=begin; key<end; key++)
+        phase_set(local, key);
+}
+
+static void warm_task(void *local, uint64_t begin, uint64_t end, void *arg)
+{
+    for (uint64_t key=begin; key<end; key++)
+        phase_get(local, key);
+}
+
+static void measure_task(void *local, uint64_t begin, uint64_t end, void *arg)
+{
+    struct phase_worker *worker = local;
+    const struct bench_config *config = worker->config;
+    for (uint64_t i=begin; i<end; i++) {
+        uint64_t key = rand_r(&worker->seed) % config->keys;
+        if (rand_r(&worker->seed) % 100 < config->getratio)
+            phase_get(worker, key);
+        else
+            phase_set(worker, key);
+    }
+}
+
+static void verify_task(void *local, uint64_t begin, uint64_t end, void *arg)
+{
+    struct phase_worker *worker = local;
+    for (uint64_t key=begin; key<end; key++) {
+        if (!phase_get(worker, key))
+            worker->mismatches++;
+    }
+}
+
+/* Load, warm, measure and verify, each split into tasks across the
+ * workers of the work-stealing scheduler */
+static void run_phases(const struct bench_config *config, FILE *results)
+{
+    struct bench_scheduler *scheduler =
+        bench_scheduler_create(config->threads, phase_setup, phase_teardown, (void*)config);
+    if (scheduler == NULL) {
+        fprintf(stderr, "Could not start the workers\n");
+        exit(1);
+    }
+    for (int i=0; i<config->threads; i++) {
+        struct phase_worker *worker = bench_scheduler_local(scheduler, i);
+        if (worker == NULL || worker->memcache == NULL || worker->value == NULL) {
+            fprintf(stderr, "Could not set up worker %d\n", i);
+            exit(1);
+        }
+    }
+
+    fprintf(results, "# %s protocol, %d threads, %d keys, %zu to %zu byte values, "
+            "%d requests with %d%% gets, grain %d\n",
+            config->protocol == Textual ? "textual" : "binary",
+            config->threads, config->keys, config->valuesize,
+            config->valuesize * 9, config->operations, config->getratio,
+            config->grain);
+
+    static const struct {
+        const char *name;
+        bench_task_fn task;
+        int requests;
+    } phases[] = {
+        { "load", load_task, 0 },
+        { "warm", warm_task, 0 },
+        { "measure", measure_task, 1 },
+        { "verify", verify_task, 0 }
+    };
+    struct bench_histogram *gets = malloc(sizeof(*gets));
+    struct bench_histogram *sets = malloc(sizeof(*sets));
+    uint64_t mismatches = 0;
+    uint64_t errors = 0;
+    for (int p=0; p<4; p++) {
+        for (int i=0; i<config->threads; i++) {
+            struct phase_worker *worker = bench_scheduler_local(scheduler, i);
+            memset(&worker->gets, 0, sizeof(worker->gets));
+            memset(&worker->sets, 0, sizeof(worker->sets));
+        }
+
+        uint64_t tasks, steals, tasks0, steals0;
+        bench_scheduler_counters(scheduler, &tasks0, &steals0);
+        uint64_t start = bench_now();
+        bench_scheduler_run(scheduler, phases[p].task, NULL, 0,
+                            phases[p].requests ? config->operations : config->keys,
+                            config->grain);
+        uint64_t elapsed = bench_now() - start;
+        bench_scheduler_counters(scheduler, &tasks, &steals);
+
+        memset(gets, 0, sizeof(*gets));
+        memset(sets, 0, sizeof(*sets));
+        for (int i=0; i<config->threads; i++) {
+            struct phase_worker *worker = bench_scheduler_local(scheduler, i);
+            bench_histogram_merge(gets, &worker->gets);
+            bench_histogram_merge(sets, &worker->sets);
+        }
+
+        char name[32];
+        if (gets->count > 0) {
+            snprintf(name, sizeof(name), "%s get", phases[p].name);
+            bench_report(results, name, elapsed, gets);
+        }
+        if (sets->count > 0) {
+            snprintf(name, sizeof(name), "%s set", phases[p].name);
+            bench_report(results, name, elapsed, sets);
+        }
+        fprintf(results, "%-12s tasks %llu  steals %llu\n", phases[p].name,
+                (unsigned long long)(tasks - tasks0),
+                (unsigned long long)(steals - steals0));
+    }
+    for (int i=0; i<config->threads; i++) {
+        struct phase_worker *worker = bench_scheduler_local(scheduler, i);
+        errors += worker->errors;
+        mismatches += worker->mismatches;
+    }
+    fprintf(results, "errors %llu  mismatches %llu\n", (unsigned long long)errors,
+            (unsigned long long)mismatches);
+    fflush(results);
+
+    free(gets);
+    free(sets);
+    bench_scheduler_destroy(scheduler);
+}
+
+/* Store every key once so that the gets hit */
+static int preload(const struct bench_config *config)
+{
+    struct Memcache *memcache = bench_connect(config);
+    if (memcache == NULL)
+        return -1;
+
+    char *value = malloc(config->valuesize);
+    memset(value, 'x', config->valuesize);
+    struct Item item = {0};
+    char key[32];
+    int ret = 0;
+    for (int i=0; i<config->keys && ret == 0; i++) {
+        item.keylen = sprintf(key, "bench_%d", i);
+        item.key = key;
+        item.data = value;
+        item.size = config->valuesize;
+        ret = libmemc_set(memcache, &item);
+    }
+    if (ret == -1)
+        fprintf(stderr, "Failed to preload: %s\n", libmemc_strstatus(item.status));
+
+    free(value);
+    libmemc_destroy(memcache);
+    return ret;
+}
+
+/* Run the workers for the configured duration and report the results.
+ * A flood reports one line per run, to build a table across value sizes */
+static void run(struct bench_config *config, void *(*worker_main)(void *),
+                FILE *results, int flood)
+{
+    struct worker *workers = calloc(config->threads, sizeof(struct worker));
+    uint64_t start = bench_now();
+    for (int i=0; i<config->threads; i++) {
+        workers[i].config = config;
+        workers[i].seed = start + i;
+        workers[i].deadline = start + config->duration * 1000000ULL;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    struct bench_histogram *gets = calloc(1, sizeof(*gets));
+    struct bench_histogram *sets = calloc(1, sizeof(*sets));
+    struct UdpCounters counters = {0};
+    uint64_t errors = 0;
+    uint64_t hedged = 0;
+    uint64_t won = 0;
+    for (int i=0; i<config->threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hedged += workers[i].hedged;
+        won += workers[i].won;
+        bench_histogram_merge(gets, &workers[i].gets);
+        bench_histogram_merge(sets, &workers[i].sets);
+        errors += workers[i].errors;
+        counters.requests += workers[i].udp.requests;
+        counters.replies += workers[i].udp.replies;
+        counters.packets += workers[i].udp.packets;
+        counters.timeouts += workers[i].udp.timeouts;
+        counters.lost += workers[i].udp.lost;
+        counters.latency += workers[i].udp.latency;
+    }
+    uint64_t elapsed = bench_now() - start;
+    double seconds = elapsed / 1000000.0;
+    double latency = counters.replies ? (double)counters.latency / counters.replies : 0.0;
+
+    if (flood) {
+        // a lost reply datagram is one we never got for a request that timed out
+        fprintf(results, "%zu %.2f %.0f %.1f %llu %.3f\n",
+                config->valuesize,
+                counters.replies ? (double)counters.packets / counters.replies : 0.0,
+                counters.replies / seconds, latency,
+                (unsigned long long)counters.timeouts,
+                (counters.packets + counters.lost) ?
+                100.0 * counters.lost / (counters.packets + counters.lost) : 0.0);
+    } else if (worker_main == udp_worker_main) {
+        fprintf(results, "# udp, %d threads, %d keys, %zu byte values, %d gets per batch\n",
+                config->threads, config->keys, config->valuesize, config->batch);
+        bench_report(results, "udp batch", elapsed, gets);
+        fprintf(results, "udp gets %llu  gets/s %.0f  avg %.1f us  requests %llu  "
+                "packets %llu  timeouts %llu  lost packets %llu\n",
+                (unsigned long long)counters.replies, counters.replies / seconds,
+                latency, (unsigned long long)counters.requests,
+                (unsigned long long)counters.packets,
+                (unsigned long long)counters.timeouts,
+                (unsigned long long)counters.lost);
+        fprintf(results, "errors %llu\n", (unsigned long long)errors);
+    } else {
+        fprintf(results, "# %s protocol over %s, %d threads, %d keys, %zu byte values, %d%% gets%s%s\n",
+                config->protocol == Textual ? "textual" : "binary",
+                config->unixpath ? "a unix socket" : "tcp", config->threads,
+                config->keys, config->valuesize, config->getratio,
+                config->zerocopy ? ", zerocopy" : "",
+                config->compress ? ", compressed" : "");
+        bench_report(results, "get", elapsed, gets);
+        bench_report(results, "set", elapsed, sets);
+        if (config->hedge > 0)
+            fprintf(results, "hedged at p%g: %llu gets, %llu won by the second request\n",
+                    config->hedge, (unsigned long long)hedged, (unsigned long long)won);
+        if (config->nearcache != NULL) {
+            uint64_t hits, misses, revalidations;
+            libmemc_near_cache_counters(config->nearcache, &hits, &misses, &revalidations);
+            fprintf(results, "near cache: %llu hits, %llu misses, %llu revalidations\n",
+                    (unsigned long long)hits, (unsigned long long)misses,
+                    (unsigned long long)revalidations);
+        }
+        if (config->flights != NULL) {
+            uint64_t sent, joined;
+            libmemc_single_flight_counters(config->flights, &sent, &joined);
+            fprintf(results, "single flight: %llu gets sent, %llu joined\n",
+                    (unsigned long long)sent, (unsigned long long)joined);
+        }
+        fprintf(results, "errors %llu\n", (unsigned long long)errors);
+    }
+    fflush(results);
+
+    free(gets);
+    free(sets);
+    free(workers);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config = {
+        .mode = "tcp",
+        .host = "127.0.0.1",
+        .port = 0,
+        .udpport = 0,
+        .unixpath = NULL,
+        .protocol = Binary,
+        .threads = 4,
+        .duration = 10,
+        .keys = 1000,
+        .valuesize = 100,
+        .zerocopy = 0,
+        .compress = 0,
+        .hedge = 0,
+        .nearcache = NULL,
+        .flights = NULL,
+        .getratio = 90,
+        .batch = 100,
+        .udptimeout = 1000,
+        .udpretries = 2,
+        .packets = 8,
+        .operations = 100000,
+        .grain = 16,
+        .interval = 0,
+        .output = NULL
+    };
+    char *path = NULL;
+    const char *unixpath = NULL;
+    char unixbuffer[64];
+    int keys = 0;
+    int nearcache = 0;
+    int flights = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "btvm:p:H:P:U:u:c:d:k:s:g:B:T:N:n:G:z:e:L:FC:i:o:")) != -1) {
+        switch (c) {
+        case 'b': config.protocol = Binary;
+            break;
+        case 't': config.protocol = Textual;
+            break;
+        case 'v': verbose = 1;
+            break;
+        case 'm': config.mode = optarg;
+            break;
+        case 'p': path = optarg;
+            break;
+        case 'H': config.host = optarg;
+            break;
+        case 'P': config.port = atoi(optarg);
+            break;
+        case 'U': config.udpport = atoi(optarg);
+            break;
+        case 'u': unixpath = optarg;
+            break;
+        case 'c': config.threads = atoi(optarg);
+            break;
+        case 'd': config.duration = atoi(optarg);
+            break;
+        case 'k': config.keys = atoi(optarg);
+            keys = 1;
+            break;
+        case 's': config.valuesize = atol(optarg);
+            break;
+        case 'g': config.getratio = atoi(optarg);
+            break;
+        case 'B': config.batch = atoi(optarg);
+            break;
+        case 'T': config.udptimeout = atoi(optarg);
+            break;
+        case 'N': config.packets = atoi(optarg);
+            break;
+        case 'n': config.operations = atoi(optarg);
+            break;
+        case 'G': config.grain = atoi(optarg);
+            break;
+        case 'z': config.zerocopy = atol(optarg);
+            break;
+        case 'e': config.hedge = atof(optarg);
+            break;
+        case 'L': nearcache = atoi(optarg);
+            break;
+        case 'F': flights = 1;
+            break;
+        case 'C': config.compress = atol(optarg);
+            break;
+        case 'i': config.interval = atoi(optarg);
+            break;
+        case 'o': config.output = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (config.threads < 1 || config.duration < 1 || config.keys < 1 ||
+        config.valuesize < 1 || config.getratio < 0 || config.getratio > 100 ||
+        config.batch < 1 || config.udptimeout < 1 || config.packets < 1 ||
+        config.operations < 1 || config.grain < 1 || nearcache < 0)
+        usage();
+    int udp = !strcmp(config.mode, "udp") || !strcmp(config.mode, "udpflood");
+    int unixsocket = !strcmp(config.mode, "unix");
+    int large = !strcmp(config.mode, "large");
+    int shards = !strcmp(config.mode, "shards");
+    int phases = !strcmp(config.mode, "phases");
+    int decode = !strcmp(config.mode, "decode");
+    if (!udp && !unixsocket && !large && !shards && !phases && !decode &&
+        strcmp(config.mode, "tcp"))
+        usage();
+    if (large && !keys)
+        config.keys = 64;
+    if (!strcmp(config.mode, "udpflood"))
+        config.udpretries = 0;
+
+    // start a server unless we were given one or don't need one
+    if (config.port == 0 && !decode) {
+        char *targv[] = { argv[0], "-p", path, NULL };
+        optind = 1;
+        test_init(path ? 3 : 1, targv);
+        struct memcached_process_handle* mchandle = new_memcached(0, "");
+        if (!mchandle) {
+            fprintf(stderr,"Could not start memcached process\n\n");
+            exit(1);
+        }
+        config.port = mchandle->port;
+        config.udpport = mchandle->udpport;
+
+        // memcached listens on either tcp or a unix socket, so start another one
+        if (unixsocket) {
+            char args[80];
+            snprintf(unixbuffer, sizeof(unixbuffer), "/tmp/mcbench.%d", (int)getpid());
+            snprintf(args, sizeof(args), "-s %s", unixbuffer);
+            unixpath = unixbuffer;
+            if (!new_memcached(0, args)) {
+                fprintf(stderr,"Could not start memcached process\n\n");
+                exit(1);
+            }
+        }
+    }
+    if (unixsocket && unixpath == NULL) {
+        fprintf(stderr, "The unix mode needs the unix socket of a server (-u)\n");
+        exit(1);
+    }
+    if (udp && config.udpport == 0) {
+        fprintf(stderr, "The udp mode needs the udp port of the server (-U)\n");
+        exit(1);
+    }
+
+    if (strcmp(config.mode, "udpflood") && !large && !phases && !decode &&
+        preload(&config) == -1)
+        exit(1);
+    if (unixsocket) {
+        config.unixpath = unixpath;
+        if (preload(&config) == -1)
+            exit(1);
+        config.unixpath = NULL;
+    }
+
+    // gets of the values read in the last 100 ms are answered locally
+    if (nearcache > 0) {
+        config.nearcache = libmemc_near_cache_create(nearcache, config.valuesize, 100);
+        if (config.nearcache == NULL) {
+            fprintf(stderr, "Could not create the near cache\n");
+            exit(1);
+        }
+    }
+    if (flights && (config.flights = libmemc_single_flight_create()) == NULL) {
+        fprintf(stderr, "Could not create the single flight\n");
+        exit(1);
+    }
+
+    FILE *results = stdout;
+    FILE *statsfile = stdout;
+    struct bench_sampler *sampler = NULL;
+    if (config.output != NULL) {
+        results = fopen(config.output, "w");
+        if (results == NULL) {
+            perror(config.output);
+            exit(1);
+        }
+    }
+    if (config.interval > 0) {
+        if (config.output != NULL) {
+            char name[256];
+            snprintf(name, sizeof(name), "%s.stats", config.output);
+            statsfile = fopen(name, "w");
+            if (statsfile == NULL) {
+                perror(name);
+                exit(1);
+            }
+        }
+        sampler = bench_sampler_start(&config, statsfile);
+        if (sampler == NULL)
+            fprintf(stderr, "Could not start the stats sampler\n");
+    }
+
+    if (!strcmp(config.mode, "udpflood")) {
+        fprintf(results, "# udp flood, %d threads, %d keys, %d gets per batch, %d ms timeout\n",
+                config.threads, config.keys, config.batch, config.udptimeout);
+        fprintf(results, "# value packets/reply gets/s avg-us timeouts loss%%\n");
+        for (int packets=1; packets<=config.packets; packets++) {
+            // the reply is the value line, the value and "\r\nEND\r\n"
+            config.valuesize = packets * UDP_PAYLOAD - 48;
+            if (preload(&config) == -1)
+                exit(1);
+            run(&config, udp_worker_main, results, 1);
+        }
+    } else if (large) {
+        // the 256 kB values of multiversioning.c and values near the 1 MB
+        // item limit like lru.c, copied and with MSG_ZEROCOPY
+        size_t sizes[] = { 256 * 1024, 1024 * 1024 - 1024 };
+        size_t zerocopy = config.zerocopy ? config.zerocopy : 64 * 1024;
+        for (int i=0; i<2; i++) {
+            config.valuesize = sizes[i];
+            config.zerocopy = 0;
+            if (preload(&config) == -1)
+                exit(1);
+            run(&config, worker_main, results, 0);
+            config.zerocopy = zerocopy;
+            run(&config, worker_main, results, 0);
+        }
+    } else if (unixsocket) {
+        // the same workload over tcp loopback and over the unix socket
+        run(&config, worker_main, results, 0);
+        config.unixpath = unixpath;
+        run(&config, worker_main, results, 0);
+        config.unixpath = NULL;
+    } else if (shards) {
+        run_shards(&config, results);
+    } else if (phases) {
+        run_phases(&config, results);
+    } else if (decode) {
+        run_decode(&config, results);
+    } else {
+        run(&config, udp ? udp_worker_main : worker_main, results, 0);
+    }
+    bench_sampler_stop(sampler);
+    if (config.nearcache != NULL)
+        libmemc_near_cache_destroy(config.nearcache);
+    if (config.flights != NULL)
+        libmemc_single_flight_destroy(config.flights);
+
+    if (results != stdout)
+        fclose(results);
+    if (statsfile != stdout)
+        fclose(statsfile);
+    if (unixpath == unixbuffer)
+        unlink(unixbuffer);
+    return 0;
+}
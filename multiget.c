@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+#define KEYS 1000
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // two servers, so that the keys are spread over both
+    struct memcached_process_handle* mchandle[2];
+    struct Memcache* memcache = libmemc_create(Automatic);
+    for (int i = 0; i < 2; i++) {
+        mchandle[i] = new_memcached(0, "");
+        if (!mchandle[i]) {
+            fprintf(stderr,"Could not start memcached process\n\n");
+            exit(0);
+        }
+        if (libmemc_add_server(memcache, "127.0.0.1", mchandle[i]->port) == -1) {
+            fprintf(stderr,"Could not add server\n\n");
+            exit(0);
+        }
+    }
+
+    char *value = malloc(KEYS * 7);
+    for (int i = 0; i < KEYS * 7; i++) {
+        value[i] = 'a' + i % 26;
+    }
+
+    // Test 1: store every key but each tenth, with sizes from 0 on
+    static char keys[KEYS][20];
+    static struct Item items[KEYS];
+    int stored = 0;
+    for (int i = 0; i < KEYS; i++) {
+        sprintf(keys[i], "multiget_%d", i);
+        if (i % 10 == 3) {
+            continue;
+        }
+        setItem(&items[i], 0, keys[i], strlen(keys[i]), i, value + i, i * 7 % 4001, 0);
+        stored += (libmemc_set(memcache, &items[i]) == 0);
+    }
+    ok_test(stored == KEYS - KEYS / 10, "stored the keys", "failed to store the keys");
+
+    // Test 2: one multi-get reads them all back from both servers
+    for (int i = 0; i < KEYS; i++) {
+        setItem(&items[i], 0, keys[i], strlen(keys[i]), 0, NULL, 0, 0);
+    }
+    ok_test(libmemc_multi_get(memcache, items, KEYS) == 0, "multi-get succeeded",
+            "multi-get failed");
+    int found = 0;
+    int missed = 0;
+    for (int i = 0; i < KEYS; i++) {
+        if (i % 10 == 3) {
+            missed += (items[i].status == NotFound);
+        } else if (items[i].status == Success && items[i].flags == (uint32_t)i &&
+                   items[i].size == (size_t)(i * 7 % 4001) &&
+                   !memcmp(items[i].data, value + i, items[i].size)) {
+            found++;
+        }
+    }
+    ok_test(found == KEYS - KEYS / 10, "values read back", "values not read back");
+    ok_test(missed == KEYS / 10, "missing keys not found", "missing keys found");
+
+    // Test 3: the keys of a server that is down fail, the others are read
+    int down = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (down == -1 || bind(down, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        getsockname(down, (struct sockaddr*)&addr, &len) == -1) {
+        fprintf(stderr,"Could not reserve a port\n\n");
+        exit(0);
+    }
+    close(down);
+
+    struct Memcache* partial = libmemc_create(libmemc_get_protocol(memcache));
+    if (libmemc_add_server(partial, "127.0.0.1", mchandle[0]->port) == -1 ||
+        libmemc_add_server(partial, "127.0.0.1", ntohs(addr.sin_port)) == -1) {
+        fprintf(stderr,"Could not add server\n\n");
+        exit(0);
+    }
+    struct Item probe[KEYS] = {{0}};
+    for (int i = 0; i < KEYS; i++) {
+        setItem(&probe[i], 0, keys[i], strlen(keys[i]), 0, "x", 1, 0);
+    }
+    ok_test(libmemc_multi_get(partial, probe, KEYS) == -1, "multi-get failed",
+            "multi-get did not fail");
+    int failed = 0;
+    int answered = 0;
+    for (int i = 0; i < KEYS; i++) {
+        if (probe[i].status == Success || probe[i].status == NotFound) {
+            answered++;
+        } else {
+            failed++;
+        }
+    }
+    ok_test(failed > 0 && answered > 0 && failed + answered == KEYS,
+            "only the keys of the server that is down failed",
+            "the server that is down was not told apart");
+
+    // Test 4: a header may straddle the end of the read buffer, which
+    // holds 65k. Values of about that size end the buffer at every offset
+    struct Memcache* single = libmemc_create(libmemc_get_protocol(memcache));
+    if (libmemc_add_server(single, "127.0.0.1", mchandle[0]->port) == -1) {
+        fprintf(stderr,"Could not add server\n\n");
+        exit(0);
+    }
+    char *large = malloc(65 * 1024);
+    memset(large, 'z', 65 * 1024);
+    struct Item head = {0};
+    setItem(&head, 0, "straddle_head", 13, 0, large, 1000, 0);
+    int straddled = (libmemc_set(single, &head) == 0);
+    for (int size = 65 * 1024 - 120; straddled && size < 65 * 1024; size++) {
+        struct Item tail[3] = {{0}};
+        setItem(&tail[1], 0, "straddle_tail", 13, 0, large, size, 0);
+        if (libmemc_set(single, &tail[1]) == -1) {
+            straddled = 0;
+            break;
+        }
+        setItem(&tail[0], 0, "straddle_head", 13, 0, NULL, 0, 0);
+        setItem(&tail[1], 0, "straddle_tail", 13, 0, NULL, 0, 0);
+        setItem(&tail[2], 0, "straddle_none", 13, 0, "x", 1, 0);
+        straddled = (libmemc_multi_get(single, tail, 3) == 0) &&
+            tail[0].status == Success && tail[0].size == 1000 &&
+            tail[1].status == Success && tail[1].size == (size_t)size &&
+            !memcmp(tail[1].data, large, size) &&
+            tail[2].status == NotFound && tail[2].size == 0;
+        free(tail[0].data);
+        free(tail[1].data);
+        free(tail[2].data);
+    }
+    ok_test(straddled, "headers read across the end of the buffer",
+            "headers not read across the end of the buffer");
+
+    for (int i = 0; i < KEYS; i++) {
+        free(items[i].data);
+        free(probe[i].data);
+    }
+    free(head.data);
+    free(large);
+    free(value);
+    libmemc_destroy(single);
+    libmemc_destroy(partial);
+    libmemc_destroy(memcache);
+    test_report();
+}
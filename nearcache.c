@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // start the server
+    struct memcached_process_handle* mchandle = new_memcached(0, "");
+    if (!mchandle) {
+        fprintf(stderr,"Could not start memcached process\n\n");
+        exit(0);
+    }
+
+    // a handle with a near cache and another one without
+    struct Memcache* memcache = libmemc_create(Automatic);
+    struct Memcache* other = libmemc_create(Automatic);
+    if (libmemc_add_server(memcache, "127.0.0.1", mchandle->port) == -1 ||
+        libmemc_add_server(other, "127.0.0.1", mchandle->port) == -1) {
+        fprintf(stderr,"Could not add server\n\n");
+        exit(0);
+    }
+    struct NearCache *cache = libmemc_near_cache_create(64, 1024, 200);
+    ok_test(cache != NULL, "created near cache", "failed to create near cache");
+    libmemc_set_near_cache(memcache, cache);
+
+    // Test 1: the second get is served from the cache
+    uint64_t hits, misses, revalidations;
+    struct Item item = {0};
+    setItem(&item, 0, "near", 4, 0, "one", 3, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored near", "failed to store near");
+    mem_get_is(memcache, &item, "near == 'one'", "near != 'one'");
+    mem_get_is(memcache, &item, "near == 'one'", "near != 'one'");
+    libmemc_near_cache_counters(cache, &hits, &misses, &revalidations);
+    ok_test(hits == 1, "second get was a hit", "second get was not a hit");
+
+    // Test 2: a write by another handle shows after the ttl
+    setItem(&item, 0, "near", 4, 0, "two", 3, 0);
+    ok_test(!libmemc_set(other, &item), "stored near elsewhere",
+            "failed to store near elsewhere");
+    setItem(&item, 0, "near", 4, 0, "one", 3, 0);
+    mem_get_is(memcache, &item, "near == 'one' within the ttl",
+               "near != 'one' within the ttl");
+    usleep(250 * 1000);
+    setItem(&item, 0, "near", 4, 0, "two", 3, 0);
+    mem_get_is(memcache, &item, "near == 'two' after the ttl",
+               "near != 'two' after the ttl");
+    libmemc_near_cache_counters(cache, &hits, &misses, &revalidations);
+    ok_test(revalidations >= 1, "entry was revalidated", "entry was not revalidated");
+
+    // Test 3: a delete through the handle drops the entry
+    ok_test(!libmemc_delete(memcache, &item), "deleted near", "failed to delete near");
+    setItem(&item, 0, "near", 4, 0, NULL, 0, 0);
+    mem_get_is(memcache, &item, "near == <undef>", "near != <undef>");
+
+    // Test 4: more keys than entries are evicted, not served wrong
+    int correct = 0;
+    for (int i = 0; i < 200; i++) {
+        char key[20];
+        sprintf(key, "near_%d", i);
+        setItem(&item, 0, key, strlen(key), 0, key, strlen(key), 0);
+        libmemc_set(memcache, &item);
+    }
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 200; i++) {
+            char key[20];
+            sprintf(key, "near_%d", i);
+            struct Item got = {0};
+            setItem(&got, 0, key, strlen(key), 0, NULL, 0, 0);
+            if (libmemc_get(memcache, &got) == 0 && got.size == strlen(key) &&
+                memcmp(got.data, key, got.size) == 0) {
+                correct++;
+            }
+            free(got.data);
+        }
+    }
+    ok_test(correct == 400, "evicted entries read again",
+            "wrong values after eviction");
+
+    // Test 5: an entry stored through the cache expires with the item
+    struct NearCache *lasting = libmemc_near_cache_create(64, 1024, 60000);
+    libmemc_set_near_cache(memcache, lasting);
+    setItem(&item, 0, "expiring", 8, 0, "val", 3, 1);
+    ok_test(!libmemc_set(memcache, &item), "stored expiring",
+            "failed to store expiring");
+    mem_get_is(memcache, &item, "expiring == 'val'", "expiring != 'val'");
+    mem_get_is(memcache, &item, "expiring == 'val'", "expiring != 'val'");
+    usleep(2100 * 1000);
+    setItem(&item, 0, "expiring", 8, 0, NULL, 0, 0);
+    mem_get_is(memcache, &item, "expiring == <undef>", "expiring != <undef>");
+    libmemc_near_cache_counters(lasting, &hits, &misses, &revalidations);
+    ok_test(hits == 1 && misses == 1, "expired entry dropped",
+            "expired entry kept");
+
+    // Test 6: a flush through the handle empties the cache as well
+    setItem(&item, 0, "flushed", 7, 0, "val", 3, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored flushed",
+            "failed to store flushed");
+    mem_get_is(memcache, &item, "flushed == 'val'", "flushed != 'val'");
+    ok_test(!libmemc_flush_all(memcache, 0), "flushed all", "failed to flush all");
+    setItem(&item, 0, "flushed", 7, 0, NULL, 0, 0);
+    mem_get_is(memcache, &item, "flushed == <undef>", "flushed != <undef>");
+
+    libmemc_destroy(memcache);
+    libmemc_destroy(other);
+    libmemc_near_cache_destroy(cache);
+    libmemc_near_cache_destroy(lasting);
+    test_report();
+}
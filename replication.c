@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+#define KEYS 20
+
+// how many of the keys a single server has
+static int count_keys(struct Memcache *memcache)
+{
+    int found = 0;
+    for (int i = 0; i < KEYS; i++) {
+        char key[20];
+        sprintf(key, "replica_%d", i);
+        struct Item item = {0};
+        setItem(&item, 0, key, strlen(key), 0, NULL, 0, 0);
+        if (libmemc_get(memcache, &item) == 0 && item.size == 3 &&
+            memcmp(item.data, "val", 3) == 0) {
+            found++;
+        }
+        free(item.data);
+    }
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // start two servers, with a handle of its own for each of them
+    struct memcached_process_handle* mchandle[2];
+    struct Memcache* single[2];
+    struct Memcache* memcache = libmemc_create(Automatic);
+    for (int i = 0; i < 2; i++) {
+        mchandle[i] = new_memcached(0, "");
+        if (!mchandle[i]) {
+            fprintf(stderr,"Could not start memcached process\n\n");
+            exit(0);
+        }
+        single[i] = libmemc_create(Automatic);
+        if (libmemc_add_server(memcache, "127.0.0.1", mchandle[i]->port) == -1 ||
+            libmemc_add_server(single[i], "127.0.0.1", mchandle[i]->port) == -1) {
+            fprintf(stderr,"Could not add server\n\n");
+            exit(0);
+        }
+    }
+
+    // Test 1: the number of replicas is checked
+    ok_test(libmemc_set_replicas(memcache, 0) == -1, "0 replicas rejected",
+            "0 replicas accepted");
+    ok_test(!libmemc_set_replicas(memcache, 2), "set 2 replicas",
+            "failed to set 2 replicas");
+
+    // Test 2: every key is stored on both servers
+    struct Item item = {0};
+    char key[20];
+    int stored = 0;
+    for (int i = 0; i < KEYS; i++) {
+        sprintf(key, "replica_%d", i);
+        setItem(&item, 0, key, strlen(key), 0, "val", 3, 0);
+        stored += !libmemc_set(memcache, &item);
+    }
+    ok_test(stored == KEYS, "stored the keys", "failed to store the keys");
+    ok_test(count_keys(single[0]) == KEYS, "first server has every key",
+            "first server misses keys");
+    ok_test(count_keys(single[1]) == KEYS, "second server has every key",
+            "second server misses keys");
+
+    // Test 3: the keys are still found after a server lost them
+    libmemc_flush_all(single[0], 0);
+    ok_test(count_keys(single[0]) == 0, "first server lost the keys",
+            "first server still has keys");
+    ok_test(count_keys(memcache) == KEYS, "found every key on the replica",
+            "keys lost with the first server");
+
+    // Test 4: a counter changes on both servers
+    setItem(&item, 0, "counter", 7, 0, "1", 1, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored counter", "failed to store counter");
+    ok_test(!libmemc_incr(memcache, &item, 4), "incremented counter",
+            "failed to increment counter");
+    for (int i = 0; i < 2; i++) {
+        setItem(&item, 0, "counter", 7, 0, "5", 1, 0);
+        mem_get_is(single[i], &item, "counter == 5", "counter != 5");
+    }
+
+    // Test 5: a delete removes the key from both servers
+    sprintf(key, "replica_%d", 0);
+    setItem(&item, 0, key, strlen(key), 0, "val", 3, 0);
+    ok_test(!libmemc_set(memcache, &item), "stored key again",
+            "failed to store key again");
+    ok_test(!libmemc_delete(memcache, &item), "deleted key", "failed to delete key");
+    for (int i = 0; i < 2; i++) {
+        setItem(&item, 0, key, strlen(key), 0, NULL, 0, 0);
+        mem_get_is(single[i], &item, "key == <undef>", "key != <undef>");
+    }
+
+    for (int i = 0; i < 2; i++) {
+        libmemc_destroy(single[i]);
+    }
+    libmemc_destroy(memcache);
+    test_report();
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "libmemc.h"
+#include "libmemctest.h"
+
+#define THREADS 8
+#define ROUNDS 20
+#define VALUE_SIZE (512 * 1024)
+
+struct getter {
+    struct Memcache *memcache;
+    pthread_barrier_t *barrier;
+    const char *value;
+    int correct;
+};
+
+// every thread gets the same big key at the same time, round after round
+static void *getter_main(void *arg)
+{
+    struct getter *getter = arg;
+    struct Item item = {0};
+    for (int round = 0; round < ROUNDS; round++) {
+        pthread_barrier_wait(getter->barrier);
+        setItem(&item, 0, "herd", 4, 0, NULL, 0, 0);
+        if (libmemc_get(getter->memcache, &item) == 0 && item.size == VALUE_SIZE &&
+            memcmp(item.data, getter->value, VALUE_SIZE) == 0) {
+            getter->correct++;
+        }
+    }
+    free(item.data);
+    return NULL;
+}
+
+// every thread gets a key that is not there at the same time
+static void *misser_main(void *arg)
+{
+    struct getter *getter = arg;
+    struct Item item = {0};
+    pthread_barrier_wait(getter->barrier);
+    setItem(&item, 0, "nothere", 7, 0, NULL, 0, 0);
+    if (libmemc_get(getter->memcache, &item) == -1 && item.status == NotFound) {
+        getter->correct++;
+    }
+    free(item.data);
+    return NULL;
+}
+
+// A server that answers the one get it is sent with a miss, but only once
+// the gets of the other threads have joined it
+struct gate {
+    int conn[THREADS];
+    struct SingleFlight *flights;
+    uint64_t joined;
+};
+
+static void *gate_main(void *arg)
+{
+    struct gate *gate = arg;
+    struct pollfd pfd[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pfd[i].fd = gate->conn[i];
+        pfd[i].events = POLLIN;
+    }
+    if (poll(pfd, THREADS, 5000) <= 0) {
+        return NULL;
+    }
+    int i = 0;
+    while (!(pfd[i].revents & POLLIN)) {
+        i++;
+    }
+    char request[512];
+    char binary = 0;
+    if (recv(pfd[i].fd, request, sizeof(request), 0) > 0) {
+        binary = (request[0] == (char)0x80);
+    }
+
+    uint64_t sent, joined = 0;
+    for (int wait = 0; wait < 5000 && joined < gate->joined + THREADS - 1; wait++) {
+        usleep(1000);
+        libmemc_single_flight_counters(gate->flights, &sent, &joined);
+    }
+    if (binary) {
+        // key not found, with the message as the body
+        unsigned char response[24 + 9] = { 0x81, 0x00, 0, 0, 0, 0, 0x00, 0x01,
+                                           0, 0, 0, 9 };
+        memcpy(response + 24, "Not found", 9);
+        send(pfd[i].fd, response, sizeof(response), 0);
+    } else {
+        send(pfd[i].fd, "END\r\n", 5, 0);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    test_init(argc, argv);
+
+    // start the server
+    struct memcached_process_handle* mchandle = new_memcached(0, "");
+    if (!mchandle) {
+        fprintf(stderr,"Could not start memcached process\n\n");
+        exit(0);
+    }
+
+    struct SingleFlight *flights = libmemc_single_flight_create();
+    ok_test(flights != NULL, "created single flight", "failed to create single flight");
+
+    struct getter getter[THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    char *value = malloc(VALUE_SIZE);
+    for (int i = 0; i < VALUE_SIZE; i++) {
+        value[i] = 'a' + i % 26;
+    }
+    for (int i = 0; i < THREADS; i++) {
+        getter[i].memcache = libmemc_create(Automatic);
+        if (libmemc_add_server(getter[i].memcache, "127.0.0.1", mchandle->port) == -1) {
+            fprintf(stderr,"Could not add server\n\n");
+            exit(0);
+        }
+        libmemc_set_single_flight(getter[i].memcache, flights);
+        getter[i].barrier = &barrier;
+        getter[i].value = value;
+        getter[i].correct = 0;
+    }
+
+    struct Item item = {0};
+    setItem(&item, 0, "herd", 4, 0, value, VALUE_SIZE, 0);
+    ok_test(!libmemc_set(getter[0].memcache, &item), "stored herd", "failed to store herd");
+
+    // Test 1: every thread gets the value, whether it asked or waited
+    pthread_t thread[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&thread[i], NULL, getter_main, &getter[i]);
+    }
+    int correct = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(thread[i], NULL);
+        correct += getter[i].correct;
+    }
+    ok_test(correct == THREADS * ROUNDS, "every get returned the value",
+            "a get returned the wrong value");
+
+    // Test 2: some of the gets joined another one
+    uint64_t sent, joined;
+    libmemc_single_flight_counters(flights, &sent, &joined);
+    ok_test(sent + joined == THREADS * ROUNDS, "every get was counted",
+            "gets were not counted");
+
+    // Test 3: a miss is shared as well. The server holds it back until the
+    // other gets have joined, so that they are merged for sure
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(listener, THREADS) == -1 ||
+        getsockname(listener, (struct sockaddr*)&addr, &len) == -1) {
+        fprintf(stderr,"Could not create gated server\n\n");
+        exit(0);
+    }
+    struct gate gate;
+    gate.flights = flights;
+    gate.joined = joined;
+    for (int i = 0; i < THREADS; i++) {
+        libmemc_destroy(getter[i].memcache);
+        getter[i].memcache = libmemc_create(Automatic);
+        if (libmemc_add_server(getter[i].memcache, "127.0.0.1", ntohs(addr.sin_port)) == -1 ||
+            (gate.conn[i] = accept(listener, NULL, NULL)) == -1) {
+            fprintf(stderr,"Could not connect to gated server\n\n");
+            exit(0);
+        }
+        libmemc_set_single_flight(getter[i].memcache, flights);
+        getter[i].correct = 0;
+    }
+    pthread_t gate_thread;
+    pthread_create(&gate_thread, NULL, gate_main, &gate);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&thread[i], NULL, misser_main, &getter[i]);
+    }
+    correct = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(thread[i], NULL);
+        correct += getter[i].correct;
+    }
+    pthread_join(gate_thread, NULL);
+    uint64_t sent_before = sent;
+    libmemc_single_flight_counters(flights, &sent, &joined);
+    ok_test(correct == THREADS, "every get missed", "a get did not miss");
+    ok_test(sent == sent_before + 1 && joined == gate.joined + THREADS - 1,
+            "the miss was shared", "the miss was not shared");
+
+    for (int i = 0; i < THREADS; i++) {
+        libmemc_destroy(getter[i].memcache);
+        close(gate.conn[i]);
+    }
+    close(listener);
+    libmemc_single_flight_destroy(flights);
+    pthread_barrier_destroy(&barrier);
+    free(value);
+    test_report();
+}
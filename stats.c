@@ -88,6 +88,31 @@ int main(int argc, char **argv)
         }
     }
 
+    // the same stats as a table, fetched twice into the same table
+    struct Stats *table = libmemc_stats_create();
+    for (int poll=0; poll<2; poll++) {
+        ok_test(libmemc_stats_fetch(libmemc_get_server_no(memcache, 0), libmemc_get_protocol(memcache), "", table) == 0,
+                "fetched stats table", "failed to fetch stats table");
+        ok_test(libmemc_stats_count(table) == 22, "22 stats in table", "not 22 stats in table");
+    }
+
+    for (int i=0; i<5; i++) {
+        char msg_OK[50];
+        char msg_NotOK[50];
+        int64_t val = -1;
+        libmemc_stats_int64(table, keys2[i], &val);
+        sprintf(msg_OK, "table %s is 1", keys2[i]);
+        sprintf(msg_NotOK, "table %s is %lld", keys2[i], (long long)val);
+        ok_test(val == 1, msg_OK, msg_NotOK);
+    }
+
+    ok_test(libmemc_stats_value(table, "version") != NULL, "table has version", "table has no version");
+    ok_test(libmemc_stats_int64(table, "version", &(int64_t){0}) == -1,
+            "version is not a number", "version is a number");
+    ok_test(libmemc_stats_value(table, "no_such_stat") == NULL,
+            "no_such_stat not in table", "no_such_stat in table");
+    libmemc_stats_destroy(table);
+
     libmemc_destroy(memcache);
     test_report();
 }
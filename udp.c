@@ -196,6 +196,46 @@ int main(int argc, char **argv)
 
         if (res)
             free(res);        
+
+        // the same gets through the UDP transport in libmemc
+        struct UdpClient *udp = libmemc_udp_create("127.0.0.1", mchandle->udpport);
+        ok_test(udp != NULL, "created udp client", "failed to create udp client");
+
+        struct Item items[600] = {{0}};
+        const char *keys[3] = {"foo", "notexist", "big"};
+        for (int i=0; i<3; i++) {
+            items[i].key = keys[i];
+            items[i].keylen = strlen(keys[i]);
+        }
+        ok_test(libmemc_udp_gets(udp, items, 3) == 0, "udp gets", "udp gets failed");
+        ok_test((items[0].status == Success) && (items[0].size == 6) &&
+                !memcmp(items[0].data, "fooval", 6),
+                "udp foo == fooval", "udp foo != fooval");
+        ok_test(items[1].status == NotFound, "udp notexist not found", "udp notexist found");
+        ok_test((items[2].status == Success) && (items[2].size == size) &&
+                !memcmp(items[2].data, big, size),
+                "udp big reassembled", "udp big not reassembled");
+
+        // more requests than fit in the window of requests in flight
+        for (int i=0; i<600; i++) {
+            items[i].key = (i % 2) ? "big" : "foo";
+            items[i].keylen = 3;
+        }
+        ok_test(libmemc_udp_gets(udp, items, 600) == 0, "600 udp gets", "600 udp gets failed");
+        int matches = 0;
+        for (int i=0; i<600; i++) {
+            if ((i % 2) ? ((items[i].size == size) && !memcmp(items[i].data, big, size))
+                        : ((items[i].size == 6) && !memcmp(items[i].data, "fooval", 6)))
+                matches++;
+            free(items[i].data);
+        }
+        ok_test(matches == 600, "600 udp values match", "udp values do not match");
+
+        struct UdpCounters counters;
+        libmemc_udp_get_counters(udp, &counters);
+        ok_test(counters.replies == 603, "603 udp replies", "not 603 udp replies");
+        libmemc_udp_destroy(udp);
+        free(big);
     } else {
         fprintf(stdout, "Tests not implemented for binary protocol\n");
     }
@@ -20,13 +20,11 @@ int main(int argc, char **argv)
     }
     
     struct Memcache* memcache = libmemc_create(Automatic);
-    if (libmemc_add_server(memcache, "127.0.0.1", mchandle->port) == -1) {
+    if (libmemc_add_server_unix(memcache, filename) == -1) {
         fprintf(stderr,"Could not add server\n\n");
         exit(0);
     }
 
-    libmemc_set_socket(libmemc_get_server_no(memcache, 0), mchandle->socket);
-
     struct Item item = {0};
     setItem(&item, 0, "foo", 3, 0, "fooval", 6, 0);
     ok_test(!libmemc_set(memcache, &item), "stored foo", "failed to store foo");